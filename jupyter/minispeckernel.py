@@ -23,7 +23,7 @@ from ipykernel.kernelbase import Kernel
 from IPython.display import SVG
 from subprocess import Popen, PIPE
 from tempfile import mkdtemp
-import os, re, select, signal, sys
+import hashlib, json, os, re, select, shlex, signal, subprocess, sys, time
 
 ## Helper functions
 
@@ -38,6 +38,54 @@ def writeFile(file, data):
     f.write(data)
     f.close()
 
+# Returns the contents of the files in userDir imported by code, directly or
+# through other imported files, as a sorted list of (file, contents)
+def getUserImports(code, userDir):
+    importRegex = re.compile(r"\b(bsvimport|import)\s+([A-Za-z_]\w*(?:\s*,\s*[A-Za-z_]\w*)*)\s*;")
+    files = {}
+    pending = [code]
+    while pending:
+        for m in importRegex.finditer(pending.pop()):
+            ext = ".bsv" if m.group(1) == "bsvimport" else ".ms"
+            for name in m.group(2).split(","):
+                f = os.path.join(userDir, name.strip() + ext)
+                if f in files or not os.path.isfile(f): continue
+                files[f] = readFile(f)
+                if ext == ".ms": pending.append(files[f])
+    return sorted(files.items())
+
+# Maximum time runCmd blocks waiting for subprocess output (seconds)
+pollTimeout = 1.0
+
+# Directory of the per-user output cache (see do_execute)
+def getOutputCacheDir():
+    cacheHome = os.environ.get("XDG_CACHE_HOME", os.path.join(os.path.expanduser("~"), ".cache"))
+    return os.path.join(cacheHome, "minispec", "jupyter")
+
+# Maximum size of the output cache; the least recently used entries are
+# evicted beyond it (bytes)
+outputCacheMaxBytes = 256 << 20
+
+def evictOutputCache(cacheDir, maxBytes):
+    entries = []
+    totalBytes = 0
+    for name in os.listdir(cacheDir):
+        if not name.endswith(".json"): continue
+        entryFile = os.path.join(cacheDir, name)
+        try:
+            size = os.path.getsize(entryFile)
+            entries.append((os.path.getmtime(entryFile), size, entryFile))
+            totalBytes += size
+        except OSError:
+            continue
+    for (_, size, entryFile) in sorted(entries):
+        if totalBytes <= maxBytes: break
+        try:
+            os.remove(entryFile)
+        except OSError:
+            pass
+        totalBytes -= size
+
 
 class MinispecKernel(Kernel):
     implementation = 'Minispec'
@@ -55,6 +103,15 @@ class MinispecKernel(Kernel):
     history_files = []
     tmpDir = ""
 
+    # Outputs sent during the current execution, for the output cache
+    outputLog = None
+    toolVersion = None
+
+    def sendOutput(self, msgType, content):
+        if self.outputLog is not None:
+            self.outputLog.append((msgType, content))
+        self.send_response(self.iopub_socket, msgType, content)
+
     # Display functions allow post-processing of a command's stdout/stderr 
     # before sending to Jupyter. runCmd guarantees that:
     # - name is always "stdout" or "stderr"
@@ -62,7 +119,7 @@ class MinispecKernel(Kernel):
     #   can do line-level regex/replace/capture
     def _defaultDisplay(self, name, text):
         content = {'name': name, 'text': text}
-        self.send_response(self.iopub_socket, 'stream', content)
+        self.sendOutput('stream', content)
 
     def runCmd(self, cmd, display=_defaultDisplay):
         # Run subprocesses with line buffering. Python programs (e.g., synth)
@@ -75,8 +132,13 @@ class MinispecKernel(Kernel):
             p.stderr : ("stderr", [])
         }
         anyOutput = False
+        wallStart = time.time()
+        cpuStart = time.process_time()
         while activePipes:
-            readyPipes, _, _ = select.select(list(activePipes.keys()), [], [], 0)
+            # Block until there's output (or the pipes close), so the kernel
+            # sleeps instead of spinning while long compiles and sims run.
+            # The timeout only bounds how long each wait can last.
+            readyPipes, _, _ = select.select(list(activePipes.keys()), [], [], pollTimeout)
             for pipe in readyPipes:
                 (name, linebuf) = activePipes[pipe]
                 data = os.read(pipe.fileno(), 1024).decode("utf-8")
@@ -103,12 +165,46 @@ class MinispecKernel(Kernel):
                         linebuf.append(data)
         
         p.communicate()  # close pipes & wait for return
+        self.log.info("%s: %.2f s wall, %.2f s kernel CPU" % (cmd, time.time() - wallStart, time.process_time() - cpuStart))
         if p.returncode != 0 and not anyOutput:
             stream_content = {'name': 'stderr', 'text': "command %s silently failed with exit code %d\n" % (cmd, p.returncode)}
-            self.send_response(self.iopub_socket, 'stream', stream_content)
+            self.sendOutput('stream', stream_content)
         
         return p.returncode
 
+    # Output cache: re-running a cell with the same history, code, and magics
+    # (e.g., after a kernel restart) replays the outputs of its last
+    # successful run instead of running the tools again
+    def getOutputCacheKey(self, code, magics, userDir):
+        if self.toolVersion is None:
+            try:
+                self.toolVersion = subprocess.check_output(["msc", "--version"]).decode("utf-8")
+            except Exception:
+                self.toolVersion = ""
+        history = [(f, readFile(os.path.join(self.tmpDir, f))) for f in self.history_files]
+        allCode = "\n".join([c for (_, c) in history] + [code])
+        key = {
+            "version": 1,
+            "tools": self.toolVersion,
+            "cell": "In%d" % (self.execution_count,),
+            "history": history,
+            "code": code,
+            "magics": magics,
+            "userDir": userDir,
+            "userImports": getUserImports(allCode, userDir),
+        }
+        return hashlib.sha256(json.dumps(key, sort_keys=True).encode("utf-8")).hexdigest()
+
+    def saveOutputs(self, cacheFile):
+        try:
+            os.makedirs(os.path.dirname(cacheFile), exist_ok=True)
+            tmpFile = "%s.tmp%d" % (cacheFile, os.getpid())
+            writeFile(tmpFile, json.dumps({"outputs": self.outputLog}))
+            os.replace(tmpFile, cacheFile)
+            evictOutputCache(os.path.dirname(cacheFile), outputCacheMaxBytes)
+        except Exception as e:
+            self.log.warn("Could not save outputs to cache: " + str(e))
+
     def do_execute(self, code, silent, store_history=True, user_expressions=None,
                    allow_stdin=False):
         # Initialize
@@ -118,6 +214,7 @@ class MinispecKernel(Kernel):
         tmpDir = self.tmpDir
         errMsg = {'status': 'error'}
         userDir = os.getcwd()
+        self.outputLog = None
 
         # Extract magics
         lines = code.split("\n")
@@ -132,9 +229,30 @@ class MinispecKernel(Kernel):
                 codeLines.append(line)
         code = "\n".join(codeLines)
 
+        # Cells are kept in cells/, and each cell is compiled from a copy in
+        # tmpDir (renamed by minispec-combine once it's part of history)
         codeFile = "In%d.ms" % (self.execution_count,)
+        cellFile = os.path.join("cells", codeFile)
+        os.makedirs(os.path.join(tmpDir, "cells"), exist_ok=True)
+        writeFile(os.path.join(tmpDir, cellFile), code)
         writeFile(os.path.join(tmpDir, codeFile), code)
 
+        # Replay the outputs of an identical earlier run, if any. Only
+        # successful runs are cached, so there is nothing else to do.
+        cacheFile = os.path.join(getOutputCacheDir(), self.getOutputCacheKey(code, magics, userDir) + ".json")
+        outputs = None
+        if os.path.isfile(cacheFile):
+            try:
+                outputs = json.loads(readFile(cacheFile))["outputs"]
+                os.utime(cacheFile)  # mark as recently used
+            except Exception:
+                self.log.warn("Ignoring corrupt output cache file " + cacheFile)
+        if outputs is not None:
+            for (msgType, content) in outputs:
+                self.send_response(self.iopub_socket, msgType, content)
+            return self.finishExecution(cellFile, store_history)
+        self.outputLog = []
+
         def mscDisplay(self, name, text):
             if name == "stdout":
                 text = re.sub("produced simulation executable (.*?)\n", "", text)
@@ -157,49 +275,50 @@ class MinispecKernel(Kernel):
                     self._defaultDisplay("stderr", "exceeded maximum simulation output (%d lines), aborting" % (maxLines,))
                     raise Exception("too much simulation output")
 
-        # Produce history
-        combineArgs = " ".join(self.history_files + [codeFile])
-        if self.runCmd("(cd %s && minispec-combine %s > History___.ms)" % (tmpDir, combineArgs), display=mscDisplay): return errMsg
-       
-        # Produce top-level file. This leverages the fact that the compiler
-        # flattens imports to avoid modifying the actual input files, which
-        # gives better error messages.
+        # Produce history: minispec-combine writes each previous cell, with
+        # globals renamed as needed, to tmpDir. It caches parsed cells in
+        # .combine-cache, so only the new cell is parsed.
+        combineArgs = " ".join(self.history_files + [cellFile])
+        if self.runCmd("(cd %s && minispec-combine --cache-dir .combine-cache --output-dir . %s)" % (tmpDir, combineArgs), display=mscDisplay): return errMsg
+
+        # Produce top-level file, which imports every cell in order. This
+        # leverages the fact that the compiler flattens imports to avoid
+        # modifying the actual input files, which gives better error messages.
+        # With --build-dir, msc emits one Bluespec package per cell and keeps
+        # bsc's outputs across executions, so bsc only compiles the new cell
+        # (and cells whose renames changed) against the earlier cells' .bo files.
         topFile = "Top___.ms"
         hf = os.path.join(tmpDir, topFile)
-        writeFile(hf, "import History___;\nimport In%d;\n" % (self.execution_count,))
+        cellNames = [os.path.splitext(os.path.basename(f))[0] for f in self.history_files + [cellFile]]
+        writeFile(hf, "".join("import %s;\n" % c for c in cellNames))
+        mscOpts = "--build-dir build -p '%s'" % (userDir,)
 
         # All magics have to compile the code, so do a basic compile only if there are no magics
         if len(magics) == 0:
-            if self.runCmd("(cd %s && msc '%s' -p '%s')" % (tmpDir, topFile, userDir), display=mscDisplay): return errMsg;
+            if self.runCmd("(cd %s && msc '%s' %s)" % (tmpDir, topFile, mscOpts), display=mscDisplay): return errMsg;
 
+        # Consecutive eval magics are evaluated together, with a single compile
+        magicCmds = []  # (cmd, list of args, magic)
         for magic in magics:
             (cmd, _, args) = magic.partition(" ")
-            args = args.strip()
+            if cmd == "eval" and len(magicCmds) and magicCmds[-1][0] == "eval":
+                magicCmds[-1][1].append(args.strip())
+            else:
+                magicCmds.append((cmd, [args.strip()], magic))
+
+        for (cmd, argsList, magic) in magicCmds:
+            args = argsList[0]
             if cmd == "sim":
                 modName = args
-                if self.runCmd("(cd %s && msc '%s' '%s' -p '%s')" % (tmpDir, topFile, modName, userDir), display=mscDisplay): return errMsg
+                if self.runCmd("(cd %s && msc '%s' '%s' %s)" % (tmpDir, topFile, modName, mscOpts), display=mscDisplay): return errMsg
                 if self.runCmd("(cd %s && ./%s)" % (tmpDir, modName), display=simDisplay): return errMsg
             elif cmd == "eval":
-                # TODO: Pre-check expr is a valid expression (use MinispecParser/msutil)
-                # TODO: Combine multiple eval magics into a single compile
-                # TODO: Code.ms should still be precompiled before Eval.ms to minimize eval error handling...
-                expr = args
-                evalFile = os.path.join(tmpDir, "Eval___.ms")
-                evalCode = '''
-import Top___;
-// Auto-generated eval module
-module Eval___;
-  rule eval;
-    let expr =
-%s
-    ;
-    $display("%s = ", fshow(expr));
-    $finish;
-  endrule
-endmodule''' % (expr, expr)
-                writeFile(evalFile, evalCode)
-                if self.runCmd("(cd %s && msc Eval___.ms Eval___ -p '%s')" % (tmpDir, userDir), display=mscDisplay): return errMsg
-                if self.runCmd("(cd %s && ./Eval___)" % tmpDir, display=simDisplay): return errMsg
+                # msc evaluates most expressions itself, and falls back to
+                # compiling and simulating an Eval___ module with bsc
+                def evalDisplay(self, name, text):
+                    simDisplay(self, name, re.sub(r"In(\d+)\.ms", r"In [\1]", text))
+                evalOpts = " ".join("--eval %s" % shlex.quote(expr) for expr in argsList)
+                if self.runCmd("(cd %s && msc %s '%s' %s)" % (tmpDir, evalOpts, topFile, mscOpts), display=evalDisplay): return errMsg
             elif cmd == "synth":
                 def synthDisplay(self, name, text):
                     text = re.sub("from file (.*?)\n", "\n", text)
@@ -209,7 +328,7 @@ endmodule''' % (expr, expr)
                         svgFilename = m.group(1).strip()
                         im = SVG(filename=os.path.join(tmpDir, svgFilename))
                         stream_content = {'data': {"image/svg+xml" : im._repr_svg_()}}
-                        self.send_response(self.iopub_socket, 'display_data', stream_content)
+                        self.sendOutput('display_data', stream_content)
                         cur = m.end() + 1
                     if cur < len(text):
                         self._defaultDisplay(name, text[cur:])
@@ -229,19 +348,24 @@ endmodule''' % (expr, expr)
                 if self.runCmd(cmd, display=synthDisplay): return errMsg
             elif cmd == "help":
                 helpMsg = '''Available magics:
-  %%eval <expression>           Evaluate expression
+  %%eval <expression>           Evaluate expression (consecutive evals share a single compile)
   %%sim <moduleName>            Simulate module
   %%synth <function/module>     Synthesize function or module (for more help, run %%synth -h)
   %%help                        Print help message'''
                 self._defaultDisplay("stdout", helpMsg)
             else:
                 stream_content = {'name': 'stderr', 'text': "Invalid magic: " + magic}
-                self.send_response(self.iopub_socket, 'stream', stream_content)
+                self.sendOutput('stream', stream_content)
                 return errMsg
 
         # Success!
+        self.saveOutputs(cacheFile)
+        self.outputLog = None
+        return self.finishExecution(cellFile, store_history)
+
+    def finishExecution(self, cellFile, store_history):
         if store_history:
-            self.history_files.append(codeFile)
+            self.history_files.append(cellFile)
         return {'status': 'ok',
                 # The base class increments the execution count
                 'execution_count': self.execution_count,
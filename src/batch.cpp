@@ -0,0 +1,283 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Batch compilation mode, for running many independent compiles (e.g., for
+ * autograding) without paying for process startup and library parsing on
+ * every compile. The manifest is a JSON object:
+ *
+ *   {
+ *     "path": ["lib"],           // optional, path for the library files
+ *     "library": ["lib/A.ms"],   // optional, files shared by all jobs
+ *     "jobs": [
+ *       {"id": "alice", "dir": "subs/alice", "args": ["design.ms", "Top"]},
+ *       ...
+ *     ]
+ *   }
+ *
+ * Relative paths are relative to the manifest's directory. args are regular
+ * msc arguments, and each job runs in its dir (or the manifest's directory).
+ *
+ * Library files are parsed once, before any job runs. Each job then runs in
+ * its own forked worker process, which shares the parsed library (and ANTLR's
+ * warmed-up caches) copy-on-write. Forking isolates jobs: a job that exits on
+ * errors or crashes does not affect other jobs. Elaboration is not shared, as
+ * it depends on each job's top-levels. Each job's stdout and stderr are
+ * captured separately, and reported as a JSON record (one per line) when the
+ * job finishes.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "argparse/argparse.hpp"
+#include "batch.h"
+#include "jobserver.h"
+#include "json.h"
+#include "log.h"
+#include "parse.h"
+#include "strutils.h"
+
+struct BatchJob {
+    std::string id;
+    std::string dir;
+    std::vector<std::string> args;
+};
+
+// SIGCHLD self-pipe, so that the batch loop can block until either a worker
+// exits or a jobserver token may be available
+static int sigchldPipe[2] = {-1, -1};
+
+static void sigchldHandler(int) {
+    int savedErrno = errno;
+    char c = 0;
+    (void) !write(sigchldPipe[1], &c, 1);
+    errno = savedErrno;
+}
+
+static std::string readFileOrEmpty(const std::string& fileName) {
+    std::ifstream stream(fileName);
+    return std::string(std::istreambuf_iterator<char>(stream), {});
+}
+
+int runBatch(int argc, const char* argv[], CompileFn compile) {
+    argparse::ArgumentParser args;
+    args.add_argument("--batch")
+        .help("JSON manifest with the compile jobs to run")
+        .required();
+    args.add_argument("-j", "--jobs")
+        .help("maximum number of jobs to run concurrently (0 means number of cores)")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
+    try {
+        args.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        error("could not parse command-line arguments: %s\n       run %s --help for information on command-line options",
+                err.what(), argv[0]);
+    }
+
+    std::string manifestFile = args.get<std::string>("--batch");
+    std::string manifestStr = readFileOrEmpty(manifestFile);
+    if (manifestStr.empty()) error("could not read batch manifest %s", manifestFile.c_str());
+    JsonValue manifest;
+    try {
+        manifest = parseJson(manifestStr);
+    } catch (const std::exception& e) {
+        error("could not parse batch manifest %s: %s", manifestFile.c_str(), e.what());
+    }
+    if (!manifest.isObject()) error("batch manifest %s must be a JSON object", manifestFile.c_str());
+
+    std::filesystem::path baseDir = std::filesystem::absolute(manifestFile).parent_path();
+    auto getStrings = [&](const char* key) {
+        std::vector<std::string> res;
+        auto v = manifest.get(key);
+        if (!v) return res;
+        if (!v->isArray()) error("batch manifest: %s must be a list of strings", key);
+        for (auto& s : v->getArray()) {
+            if (!s.isString()) error("batch manifest: %s must be a list of strings", key);
+            res.push_back(s.getString());
+        }
+        return res;
+    };
+
+    std::vector<BatchJob> jobs;
+    auto jobsVal = manifest.get("jobs");
+    if (!jobsVal || !jobsVal->isArray()) error("batch manifest: jobs must be a list of jobs");
+    for (auto& jv : jobsVal->getArray()) {
+        BatchJob job;
+        auto id = jv.get("id");
+        auto dir = jv.get("dir");
+        auto jobArgs = jv.get("args");
+        job.id = (id && id->isString())? id->getString() : std::to_string(jobs.size());
+        job.dir = baseDir / ((dir && dir->isString())? dir->getString() : "");
+        if (!jobArgs || !jobArgs->isArray()) error("batch manifest: job %s must have a list of args", job.id.c_str());
+        for (auto& a : jobArgs->getArray()) {
+            if (!a.isString()) error("batch manifest: job %s must have a list of args", job.id.c_str());
+            job.args.push_back(a.getString());
+        }
+        // Parallelism comes from running jobs concurrently, so by default each
+        // job runs bsc processes one at a time
+        bool hasJobsArg = false;
+        for (auto& a : job.args) if (a == "-j" || a == "--jobs") hasJobsArg = true;
+        if (!hasJobsArg) {
+            job.args.push_back("-j");
+            job.args.push_back("1");
+        }
+        jobs.push_back(job);
+    }
+
+    // Parse the library once; workers inherit the parse trees
+    std::vector<std::string> libPath;
+    for (auto& dir : getStrings("path")) libPath.push_back(baseDir / dir);
+    libPath.push_back("");
+    for (auto& libFile : getStrings("library")) parseFileAndImports(baseDir / libFile, libPath);
+
+    uint32_t maxWorkers = args.get<uint64_t>("--jobs");
+    if (!maxWorkers) maxWorkers = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+    char outDirBuf[] = "/tmp/msc_batch_XXXXXX";
+    if (!mkdtemp(outDirBuf)) error("could not create temporary directory");
+    std::string outDir = outDirBuf;
+
+    struct RunningJob {
+        size_t idx;
+        std::chrono::steady_clock::time_point start;
+    };
+    std::unordered_map<pid_t, RunningJob> running;
+    size_t nextJob = 0;
+    size_t okJobs = 0;
+
+    auto outFile = [&](size_t idx, const char* ext) { return outDir + "/" + std::to_string(idx) + ext; };
+
+    // Under make, every worker beyond the first needs a jobserver token.
+    // Workers run their own bsc commands with the token they were started
+    // with, plus any others they acquire.
+    JobServer* jobServer = JobServer::get();
+    struct sigaction oldSigchld;
+    if (jobServer) {
+        if (pipe2(sigchldPipe, O_NONBLOCK | O_CLOEXEC) != 0) error("could not create pipe");
+        struct sigaction sa = {};
+        sa.sa_handler = sigchldHandler;
+        sa.sa_flags = SA_NOCLDSTOP;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGCHLD, &sa, &oldSigchld);
+    }
+
+    while (nextJob < jobs.size() || !running.empty()) {
+        while (nextJob < jobs.size() && running.size() < maxWorkers) {
+            if (jobServer && running.size() && running.size() > jobServer->getNumTokens() &&
+                    !jobServer->tryAcquire())
+                break;
+            size_t idx = nextJob++;
+            auto& job = jobs[idx];
+            // Don't let the worker inherit unflushed output
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid < 0) error("could not fork batch worker");
+            if (pid == 0) {
+                if (jobServer) {
+                    sigaction(SIGCHLD, &oldSigchld, nullptr);
+                    close(sigchldPipe[0]);
+                    close(sigchldPipe[1]);
+                }
+                int outFd = open(outFile(idx, ".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                int errFd = open(outFile(idx, ".err").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (outFd < 0 || errFd < 0) _exit(ERROR_EXIT_CODE);
+                dup2(outFd, STDOUT_FILENO);
+                dup2(errFd, STDERR_FILENO);
+                close(outFd);
+                close(errFd);
+                if (chdir(job.dir.c_str()) != 0) error("could not enter job directory %s", job.dir.c_str());
+                std::vector<const char*> jobArgv = {argv[0]};
+                for (auto& a : job.args) jobArgv.push_back(a.c_str());
+                jobArgv.push_back(nullptr);
+                exit(compile(jobArgv.size() - 1, jobArgv.data()));
+            }
+            running[pid] = {idx, std::chrono::steady_clock::now()};
+        }
+
+        int status;
+        pid_t pid;
+        if (jobServer && nextJob < jobs.size() && running.size() < maxWorkers) {
+            // Wait for a worker to finish or for a token to become available
+            pid = waitpid(-1, &status, WNOHANG);
+            if (pid == 0) {
+                pollfd pfds[] = {{jobServer->getFd(), POLLIN, 0}, {sigchldPipe[0], POLLIN, 0}};
+                poll(pfds, 2, -1);
+                char buf[64];
+                while (read(sigchldPipe[0], buf, sizeof(buf)) > 0) {}
+                continue;
+            }
+        } else {
+            pid = waitpid(-1, &status, 0);
+        }
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            error("could not wait for batch workers");
+        }
+        auto it = running.find(pid);
+        if (it == running.end()) continue;
+        auto [idx, start] = it->second;
+        running.erase(it);
+        while (jobServer && nextJob == jobs.size() && jobServer->getNumTokens() + 1 > std::max(running.size(), (size_t) 1))
+            jobServer->release();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        JsonValue record = JsonValue::object();
+        record.set("id", jobs[idx].id);
+        if (WIFEXITED(status)) {
+            int exitCode = WEXITSTATUS(status);
+            const char* jobStatus = (exitCode == 0)? "ok" :
+                (exitCode == (PANIC_EXIT_CODE & 0xff))? "crashed" : "failed";
+            record.set("status", jobStatus);
+            record.set("exitCode", exitCode);
+            if (exitCode == 0) okJobs++;
+        } else {
+            record.set("status", "crashed");
+            record.set("signal", WTERMSIG(status));
+        }
+        record.set("time", secs);
+        record.set("stdout", readFileOrEmpty(outFile(idx, ".out")));
+        record.set("stderr", readFileOrEmpty(outFile(idx, ".err")));
+        std::filesystem::remove(outFile(idx, ".out"));
+        std::filesystem::remove(outFile(idx, ".err"));
+        std::cout << record.str() << std::endl;
+    }
+
+    if (jobServer) {
+        jobServer->releaseAll();
+        sigaction(SIGCHLD, &oldSigchld, nullptr);
+        close(sigchldPipe[0]);
+        close(sigchldPipe[1]);
+    }
+    std::filesystem::remove_all(outDir);
+    std::cerr << okJobs << "/" << jobs.size() << " jobs compiled successfully\n";
+    return 0;
+}
@@ -0,0 +1,29 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+
+// Compiles with msc's regular command-line arguments (argv[0] is the program
+// name) and returns the exit code. It may also exit() on errors.
+typedef std::function<int(int, const char*[])> CompileFn;
+
+// Runs all the compile jobs in a batch manifest (msc --batch manifest.json)
+// and prints one JSON record per job. See batch.cpp for the manifest format.
+int runBatch(int argc, const char* argv[], CompileFn compile);
@@ -0,0 +1,147 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include "bscrts.h"
+
+std::string BscRtsSettings::str() const {
+    std::stringstream ss;
+    ss << "+RTS -K" << stackMB << "M";
+    if (heapHintMB) ss << " -H" << heapHintMB << "M";
+    if (allocAreaMB) ss << " -A" << allocAreaMB << "M";
+    if (maxHeapMB) ss << " -M" << maxHeapMB << "M";
+    ss << " -RTS";
+    return ss.str();
+}
+
+static uint64_t getPhysMemMB() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || pageSize <= 0) return 4096;  // unknown, assume a small machine
+    return (uint64_t) pages * pageSize >> 20;
+}
+
+BscRtsSettings getDefaultBscRtsSettings(uint64_t codeBytes, uint32_t jobs) {
+    // bsc's stack and heap use grow roughly linearly with design size. Start
+    // from the -K16M that works for typical designs (up to ~128KB of Bluespec)
+    // and scale from there, leaving each concurrent bsc a share of memory.
+    uint64_t scale = 1;
+    while (scale * (128 << 10) < codeBytes) scale *= 2;
+    uint64_t jobMemMB = getPhysMemMB() / std::max(jobs, 1u);
+
+    BscRtsSettings res;
+    res.stackMB = std::min(16 * scale, (uint64_t) 1024);
+    res.heapHintMB = std::min(64 * scale, jobMemMB / 2);
+    if (res.heapHintMB < 64) res.heapHintMB = 0;
+    res.allocAreaMB = (scale > 1)? std::min(4 * scale, (uint64_t) 64) : 0;
+    res.maxHeapMB = 0;
+    return res;
+}
+
+static bool isStackExhausted(const std::string& output) {
+    return output.find("tack space overflow") != std::string::npos ||
+        output.find("tack overflow") != std::string::npos;
+}
+
+static bool isHeapExhausted(const std::string& output) {
+    return output.find("eap exhausted") != std::string::npos ||
+        output.find("eap overflow") != std::string::npos;
+}
+
+bool isBscRtsExhausted(const std::string& output) {
+    return isStackExhausted(output) || isHeapExhausted(output);
+}
+
+BscRtsSettings growBscRtsSettings(const BscRtsSettings& settings, uint32_t jobs) {
+    // Each of the concurrent bsc processes gets a share of memory
+    uint64_t jobMemMB = getPhysMemMB() / std::max(jobs, 1u);
+    BscRtsSettings res = settings;
+    // Growing both is simpler than telling which one ran out from partial
+    // output, and the stack limit only costs memory if it's used
+    res.stackMB = std::min(std::max(settings.stackMB * 8, (uint64_t) 256), std::max(jobMemMB / 2, settings.stackMB));
+    res.heapHintMB = std::min(std::max(settings.heapHintMB * 2, (uint64_t) 256), jobMemMB / 2);
+    res.maxHeapMB = std::max(settings.maxHeapMB * 2, jobMemMB * 3 / 4);
+    res.maxHeapMB = std::min(res.maxHeapMB, jobMemMB);
+    return res;
+}
+
+BscRtsSettings maxBscRtsSettings(const BscRtsSettings& a, const BscRtsSettings& b) {
+    BscRtsSettings res;
+    res.stackMB = std::max(a.stackMB, b.stackMB);
+    res.heapHintMB = std::max(a.heapHintMB, b.heapHintMB);
+    res.allocAreaMB = std::max(a.allocAreaMB, b.allocAreaMB);
+    // 0 leaves bsc's default, which a saved limit was grown past
+    res.maxHeapMB = std::max(a.maxHeapMB, b.maxHeapMB);
+    return res;
+}
+
+std::string getBscRtsKey(const std::string& design) {
+    std::stringstream ss;
+    ss << std::hex << std::hash<std::string>()(design);
+    return ss.str();
+}
+
+// File format: one "key stackMB heapHintMB allocAreaMB maxHeapMB" line per
+// design, most recently saved last
+static const size_t maxCacheEntries = 256;
+
+bool loadBscRtsSettings(const std::string& cacheFile, const std::string& key, BscRtsSettings& settings) {
+    std::ifstream ifs(cacheFile);
+    bool found = false;
+    for (std::string line; std::getline(ifs, line); ) {
+        std::istringstream iss(line);
+        std::string lineKey;
+        BscRtsSettings s;
+        if (!(iss >> lineKey >> s.stackMB >> s.heapHintMB >> s.allocAreaMB >> s.maxHeapMB)) continue;
+        if (lineKey != key || !s.stackMB) continue;
+        settings = s;
+        found = true;
+    }
+    return found;
+}
+
+void saveBscRtsSettings(const std::string& cacheFile, const std::string& key, const BscRtsSettings& settings) {
+    std::vector<std::string> lines;
+    std::ifstream ifs(cacheFile);
+    for (std::string line; std::getline(ifs, line); )
+        if (line.compare(0, key.size() + 1, key + " ")) lines.push_back(line);
+    ifs.close();
+    std::stringstream ss;
+    ss << key << " " << settings.stackMB << " " << settings.heapHintMB << " "
+       << settings.allocAreaMB << " " << settings.maxHeapMB;
+    lines.push_back(ss.str());
+    if (lines.size() > maxCacheEntries) lines.erase(lines.begin(), lines.end() - maxCacheEntries);
+
+    // Write a new file and rename it, so readers never see a partial file
+    std::error_code ec;
+    auto dir = std::filesystem::path(cacheFile).parent_path();
+    if (!dir.empty()) std::filesystem::create_directories(dir, ec);
+    std::string tmpFile = cacheFile + ".tmp" + std::to_string(getpid());
+    std::ofstream ofs(tmpFile);
+    if (!ofs.good()) return;
+    for (auto& line : lines) ofs << line << "\n";
+    ofs.close();
+    if (!ofs.good() || rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+        std::filesystem::remove(tmpFile, ec);
+}
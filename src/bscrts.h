@@ -0,0 +1,64 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// bsc is a Haskell program, and large designs can exhaust the stack or heap
+// limits of its runtime system (RTS). These pick RTS settings for a design,
+// grow them when bsc runs out of space, and remember what worked.
+
+struct BscRtsSettings {
+    uint64_t stackMB;      // -K, maximum stack size
+    uint64_t heapHintMB;   // -H, suggested heap size (fewer GCs)
+    uint64_t allocAreaMB;  // -A, allocation area (GC nursery) size
+    uint64_t maxHeapMB;    // -M, maximum heap size (0 leaves bsc's default)
+
+    bool operator==(const BscRtsSettings& other) const {
+        return stackMB == other.stackMB && heapHintMB == other.heapHintMB &&
+            allocAreaMB == other.allocAreaMB && maxHeapMB == other.maxHeapMB;
+    }
+    bool operator!=(const BscRtsSettings& other) const { return !(*this == other); }
+
+    // Returns "+RTS ... -RTS", to be passed to bsc
+    std::string str() const;
+};
+
+// Initial settings for a design with codeBytes of Bluespec code, compiled by
+// up to jobs concurrent bsc processes
+BscRtsSettings getDefaultBscRtsSettings(uint64_t codeBytes, uint32_t jobs);
+
+// Returns whether bsc output reports RTS stack or heap exhaustion
+bool isBscRtsExhausted(const std::string& output);
+
+// Larger settings to retry with after bsc ran out of stack or heap space,
+// with up to jobs bsc processes retrying concurrently
+BscRtsSettings growBscRtsSettings(const BscRtsSettings& settings, uint32_t jobs);
+
+// Field-by-field maximum of two settings (e.g., defaults and saved settings)
+BscRtsSettings maxBscRtsSettings(const BscRtsSettings& a, const BscRtsSettings& b);
+
+// Settings that worked for past compiles, keyed by a stable design identity
+// such as the input file and top levels (see getBscRtsKey()), are stored in a small text file. Loading returns false if
+// there is no entry for key. Saving is best-effort, and concurrent msc
+// processes may drop each other's updates.
+std::string getBscRtsKey(const std::string& design);
+bool loadBscRtsSettings(const std::string& cacheFile, const std::string& key, BscRtsSettings& settings);
+void saveBscRtsSettings(const std::string& cacheFile, const std::string& key, const BscRtsSettings& settings);
@@ -0,0 +1,96 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <sys/file.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "bsvcache.h"
+#include "version.h"
+
+std::string getUserCacheDir() {
+    if (const char* xdgCache = getenv("XDG_CACHE_HOME")) return std::string(xdgCache) + "/minispec";
+    if (const char* home = getenv("HOME")) return std::string(home) + "/.cache/minispec";
+    return "";
+}
+
+std::string getBsvImportBdir(const std::string& cacheDir, const std::string& srcDir,
+        const std::string& bscVersion, const std::string& flags) {
+    std::error_code ec;
+    auto canonicalDir = std::filesystem::weakly_canonical(srcDir, ec);
+    if (ec) return "";
+    std::string key = canonicalDir.string() + "\n" + bscVersion + "\n" + getVersion() + "\n" + flags;
+    std::stringstream ss;
+    // Name directories after the source directory, so they're easy to find
+    std::string name = canonicalDir.filename();
+    ss << cacheDir << "/" << (name.empty()? "root" : name) << "-" << std::hex << std::hash<std::string>()(key);
+    std::string bdir = ss.str();
+    std::filesystem::create_directories(bdir, ec);
+    return ec? "" : bdir;
+}
+
+bool isBsvImportBdirUpToDate(const std::string& bdir, const std::vector<std::string>& files,
+        const std::vector<std::string>& srcDirs) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    for (auto& file : files) {
+        auto bo = fs::path(bdir) / fs::path(file).stem().concat(".bo");
+        if (!fs::exists(bo, ec)) return false;
+    }
+    for (auto& entry : fs::directory_iterator(bdir, ec)) {
+        if (entry.path().extension() != ".bo") continue;
+        auto boTime = fs::last_write_time(entry.path(), ec);
+        if (ec) return false;
+        std::string bsvName = entry.path().stem().string() + ".bsv";
+        for (auto& srcDir : srcDirs) {
+            auto bsv = fs::path(srcDir) / bsvName;
+            if (!fs::exists(bsv, ec)) continue;
+            auto bsvTime = fs::last_write_time(bsv, ec);
+            if (ec || bsvTime > boTime) return false;
+            break;
+        }
+    }
+    return !ec;
+}
+
+static std::unordered_map<std::string, int> lockFds;
+
+bool lockBsvImportBdir(const std::string& bdir, bool exclusive) {
+    auto it = lockFds.find(bdir);
+    int fd;
+    if (it != lockFds.end()) {
+        fd = it->second;
+    } else {
+        fd = open((bdir + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) return false;
+        lockFds[bdir] = fd;
+    }
+    while (flock(fd, exclusive? LOCK_EX : LOCK_SH) == -1) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+void unlockBsvImportBdir(const std::string& bdir) {
+    auto it = lockFds.find(bdir);
+    if (it != lockFds.end()) flock(it->second, LOCK_UN);
+}
@@ -0,0 +1,55 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Persistent bsc output directories for BSV packages imported with
+// bsvimport, so unchanged packages are compiled once and their .bo files are
+// reused across msc runs and projects.
+
+// Returns msc's per-user cache directory ($XDG_CACHE_HOME/minispec or
+// ~/.cache/minispec), or an empty string if there is none
+std::string getUserCacheDir();
+
+// Returns the persistent bdir for BSV packages in srcDir, compiled by
+// bscVersion with the given flags, under cacheDir. Directories are keyed by
+// all of these, so different bsc versions, flags (e.g., -D __VERILOG__), and
+// source directories never share .bo files. Creates the directory if needed,
+// and returns an empty string on failure.
+std::string getBsvImportBdir(const std::string& cacheDir, const std::string& srcDir,
+        const std::string& bscVersion, const std::string& flags);
+
+// Returns whether bdir has up-to-date .bo files for all files, i.e., whether
+// bsc -u would not recompile anything. Every .bo in bdir must be newer than
+// its source, found in the first of srcDirs that has it. Call with bdir
+// locked, so that the check stays valid.
+bool isBsvImportBdirUpToDate(const std::string& bdir, const std::vector<std::string>& files,
+        const std::vector<std::string>& srcDirs);
+
+// Locks bdir for this process, exclusively (to compile packages into it) or
+// shared (to read its .bo files). Blocks until the lock is acquired. Locking
+// again converts the lock; like flock(), conversion is not atomic, so
+// recheck bdir after it. The lock is held until the process exits or
+// unlockBsvImportBdir() is called. Returns false on failure.
+// NOTE: To avoid deadlocks, take the locks of several bdirs in a fixed
+// (sorted) order, without holding any lock on bdirs later in that order.
+bool lockBsvImportBdir(const std::string& bdir, bool exclusive);
+void unlockBsvImportBdir(const std::string& bdir);
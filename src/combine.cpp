@@ -75,11 +75,27 @@
  * This makes things simple, but requites that a single file/cell contains ALL
  * DEFS (parametric and instances) of a parametric.
  *
+ * With --cache-dir <dir>, minispec-combine caches what it needs from each
+ * file (its defs and its renameable names) in dir, keyed by file contents.
+ * Since the kernel combines all previous cells on every execution, this makes
+ * each execution parse only the new cell, instead of reparsing the whole
+ * history.
+ *
+ * With --output-dir <dir>, instead of printing a single combined file,
+ * minispec-combine writes each renamed file (except the last one) to dir, with
+ * the same name as the input file. The kernel compiles each cell as its own
+ * package this way, so that a cell's Bluespec package only changes (and is
+ * only recompiled) when a later cell redefines one of the globals it uses.
+ *
  * TODO: Emit warnings on confusing behaviors above (ooo defs + partial
  * parametrics)
  */
 
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -93,6 +109,61 @@
 using namespace antlr4;
 using misc::Interval;
 
+// Combining a file only needs the globals it defines and its text, split into
+// literal segments and the names that may be renamed. Files are reduced to a
+// CellInfo once, and CellInfos are cached by file contents, so each combine
+// only parses the files it hasn't seen before (in a notebook, the new cell).
+struct CellInfo {
+    // Defined globals, in def order
+    std::vector<std::string> defs;
+    // Text segments; names (isName = true) are passed through RenameTable
+    struct Segment {
+        bool isName;
+        std::string text;
+    };
+    std::vector<Segment> segments;
+};
+
+std::vector<std::string> getDefs(MinispecParser::PackageDefContext* tree) {
+    std::vector<std::string> names;
+    for (auto stmt : tree->packageStmt()) {
+        if (stmt->functionDef()) {
+            auto name = stmt->functionDef()->functionId()->name->getText();
+            names.push_back(name);
+        } if (stmt->moduleDef()) {
+            auto name = stmt->moduleDef()->moduleId()->name->getText();
+            names.push_back(name);
+        } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefSynonym()) {
+            auto typeId = stmt->typeDecl()->typeDefSynonym()->typeId();
+            auto name = typeId->name->getText();
+            names.push_back(name);
+        } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefEnum()) {
+            auto typeDefEnum = stmt->typeDecl()->typeDefEnum();
+            names.push_back(typeDefEnum->upperCaseIdentifier()->getText());
+            for (auto elem : typeDefEnum->typeDefEnumElement()) {
+                names.push_back(elem->tag->getText());
+            }
+        } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefStruct()) {
+            auto typeId = stmt->typeDecl()->typeDefStruct()->typeId();
+            auto name = typeId->name->getText();
+            names.push_back(name);
+        } else if (stmt->varDecl()) {
+            auto lb = dynamic_cast<MinispecParser::LetBindingContext*>(stmt->varDecl());
+            auto vb = dynamic_cast<MinispecParser::VarBindingContext*>(stmt->varDecl());
+            if (lb) {
+                for (auto var : lb->lowerCaseIdentifier()) {
+                    names.push_back(var->getText());
+                }
+            } else if (vb) {
+                for (auto varInit : vb->varInit()) {
+                    names.push_back(varInit->var->getText());
+                }
+            }
+        }
+    }
+    return names;
+}
+
 class RenameTable {
     private:
         // Each rename element has the renamed identifier and the **file** where the def takes place
@@ -101,67 +172,30 @@ class RenameTable {
         std::unordered_map<std::string, RenameQueue> renameTable;
 
     public:
-        RenameTable(const std::vector<MinispecParser::PackageDefContext*>& parseTrees) {
-            for (auto tree : parseTrees) {
-                for (auto stmt : tree->packageStmt()) {
-                    std::vector<std::string> names;
-                    if (stmt->functionDef()) {
-                        auto name = stmt->functionDef()->functionId()->name->getText();
-                        names.push_back(name);
-                    } if (stmt->moduleDef()) {
-                        auto name = stmt->moduleDef()->moduleId()->name->getText();
-                        names.push_back(name);
-                    } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefSynonym()) {
-                        auto typeId = stmt->typeDecl()->typeDefSynonym()->typeId();
-                        auto name = typeId->name->getText();
-                        names.push_back(name);
-                    } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefEnum()) {
-                        auto typeDefEnum = stmt->typeDecl()->typeDefEnum();
-                        names.push_back(typeDefEnum->upperCaseIdentifier()->getText());
-                        for (auto elem : typeDefEnum->typeDefEnumElement()) {
-                            names.push_back(elem->tag->getText());
-                        }
-                    } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefStruct()) {
-                        auto typeId = stmt->typeDecl()->typeDefStruct()->typeId();
-                        auto name = typeId->name->getText();
-                        names.push_back(name);
-                    } else if (stmt->varDecl()) {
-                        auto lb = dynamic_cast<MinispecParser::LetBindingContext*>(stmt->varDecl());
-                        auto vb = dynamic_cast<MinispecParser::VarBindingContext*>(stmt->varDecl());
-                        if (lb) {
-                            for (auto var : lb->lowerCaseIdentifier()) {
-                                names.push_back(var->getText());
-                            }
-                        } else if (vb) {
-                            for (auto varInit : vb->varInit()) {
-                                names.push_back(varInit->var->getText());
-                            }
-                        }
-                    }
-
-                    for (auto name : names) {
-                        std::string fileName = getTokenStream(stmt)->getSourceName();
-                        if (renameTable.find(name) == renameTable.end()) {
-                            renameTable[name] = {std::make_tuple(name, fileName)};
-                        } else {
-                            auto& [prevName, prevFileName] = renameTable[name].back();
-                            assert(prevName == name);
-                            if (prevFileName != fileName) {  // only one rename per file
-                                std::string suffix = "___" + prevFileName;
-                                replace(suffix, ".ms", "");  // not safe in general, but these files are always named InXXX.ms
-                                renameTable[name].back() = std::make_tuple(name + suffix, prevFileName);
-				renameTable[name].push_back(std::make_tuple(name, fileName));
-                            }
+        RenameTable(const std::vector<std::string>& fileNames, const std::vector<CellInfo>& cells) {
+            assert(fileNames.size() == cells.size());
+            for (size_t i = 0; i < cells.size(); i++) {
+                const std::string& fileName = fileNames[i];
+                for (auto& name : cells[i].defs) {
+                    if (renameTable.find(name) == renameTable.end()) {
+                        renameTable[name] = {std::make_tuple(name, fileName)};
+                    } else {
+                        auto& [prevName, prevFileName] = renameTable[name].back();
+                        assert(prevName == name);
+                        if (prevFileName != fileName) {  // only one rename per file
+                            // Files are always named [dir/]InXXX.ms, so the stem identifies the cell
+                            std::string suffix = "___" + std::filesystem::path(prevFileName).stem().string();
+                            renameTable[name].back() = std::make_tuple(name + suffix, prevFileName);
+                            renameTable[name].push_back(std::make_tuple(name, fileName));
                         }
                     }
                 }
             }
         }
 
-        void advance(MinispecParser::PackageDefContext* tree) {
-            std::string fileName = getTokenStream(tree)->getSourceName();
+        void advance(const std::string& fileName) {
             for (auto& it : renameTable) {
-		auto& rq = it.second;
+                auto& rq = it.second;
                 if (rq.size() > 1) {
                     auto& [nextName, nextFileName] = rq[1];
                     if (nextFileName == fileName) {
@@ -197,9 +231,10 @@ class LocalVars {
 
 class RenameListener : public MinispecBaseListener {
     private:
-        const RenameTable& rt;
         LocalVars lv;
-	std::unordered_map<tree::ParseTree*, std::string> names;
+        // Global (non-local) names, which may be renamed when combining
+        std::unordered_map<tree::ParseTree*, std::string> names;
+        std::string literal;
 
         void walk(tree::ParseTree* parseTree) {
             if (!parseTree) return;
@@ -207,7 +242,6 @@ class RenameListener : public MinispecBaseListener {
         }
 
     public:
-	RenameListener(const RenameTable& rt) : rt(rt) {}
 
         // Context level control
         //void enterTypeDefSynonym(MinispecParser::TypeDefSynonymContext* ctx) override { lv.enterLevel(); }
@@ -317,10 +351,7 @@ class RenameListener : public MinispecBaseListener {
             if (!isRenameable) return;
 
             std::string name = ctx->getText();
-            if (!lv.isDefined(name)) {
-                std::string newName = rt.rename(name);
-                if (newName != name) names[ctx] = newName;
-            }
+            if (!lv.isDefined(name)) names[ctx] = name;
         }
 
         virtual void enterUpperCaseIdentifier(MinispecParser::UpperCaseIdentifierContext* ctx) override {
@@ -335,17 +366,16 @@ class RenameListener : public MinispecBaseListener {
             if (!isRenameable) return;
 
             std::string name = ctx->getText();
-            if (!lv.isDefined(name)) {
-                std::string newName = rt.rename(name);
-                if (newName != name) names[ctx] = newName;
-            }
+            if (!lv.isDefined(name)) names[ctx] = name;
         }
 
-        void emit(tree::ParseTree* ctx) {
+        void emit(tree::ParseTree* ctx, CellInfo& info) {
             if (!ctx) return;
             auto it = names.find(ctx);
             if (it != names.end()) {
-                std::cout << it->second;
+                if (!literal.empty()) info.segments.push_back({false, literal});
+                literal.clear();
+                info.segments.push_back({true, it->second});
                 return;
             }
 
@@ -358,41 +388,175 @@ class RenameListener : public MinispecBaseListener {
                         Interval prev = prCtx->children[i-1]->getSourceInterval();
                         Interval cur = prCtx->children[i]->getSourceInterval();
                         if (prev.b + 1 < cur.a) {
-                            std::cout << tokenStream->getText(Interval(prev.b + 1, cur.a -1));
+                            literal += tokenStream->getText(Interval(prev.b + 1, cur.a -1));
                         }
                     }
-                    emit(ctx->children[i]);
+                    emit(ctx->children[i], info);
                 }
             } else {
                 std::string s = ctx->getText();
-                if (s == "<EOF>") s = "\n";
-                std::cout << s;
+                if (s == "<EOF>") s = "";
+                literal += s;
             }
         }
+
+        // Walks the whole tree first, then emits it into info's segments.
+        // Segments reproduce the file exactly, including any leading comments.
+        void emitFile(MinispecParser::PackageDefContext* tree, CellInfo& info) {
+            tree::ParseTreeWalker::DEFAULT.walk(this, tree);
+            ssize_t startIdx = tree->getSourceInterval().a;
+            if (startIdx > 0) literal = getTokenStream(tree)->getText(Interval((ssize_t) 0, startIdx - 1));
+            emit(tree, info);
+            if (!literal.empty()) info.segments.push_back({false, literal});
+            literal.clear();
+        }
 };
 
+// CellInfo cache. Entries are named by the hash and size of the file's
+// contents, so renaming or rewriting a file never returns a stale entry, and
+// an entry is only used if its segments reproduce the file exactly, so hash
+// collisions are parsed again.
+// File format: a header line, the number of defs and one def per line, and
+// the number of segments followed by "N <name>" or "L <length>\n<text>" each.
+static const char* cacheHeader = "minispec-combine-cache 2";
+
+static std::string getCacheFile(const std::string& cacheDir, const std::string& data) {
+    std::stringstream ss;
+    ss << cacheDir << "/" << std::hex << std::hash<std::string>()(data) << "-" << std::dec << data.size();
+    return ss.str();
+}
+
+static bool loadCellInfo(const std::string& cacheFile, CellInfo& info) {
+    std::ifstream ifs(cacheFile, std::ios::binary);
+    std::string line;
+    if (!std::getline(ifs, line) || line != cacheHeader) return false;
+    size_t numDefs, numSegments;
+    if (!(ifs >> numDefs)) return false;
+    info.defs.resize(numDefs);
+    for (auto& def : info.defs) if (!(ifs >> def)) return false;
+    if (!(ifs >> numSegments)) return false;
+    info.segments.resize(numSegments);
+    for (auto& seg : info.segments) {
+        std::string kind;
+        if (!(ifs >> kind)) return false;
+        if (kind == "N") {
+            seg.isName = true;
+            if (!(ifs >> seg.text)) return false;
+        } else if (kind == "L") {
+            size_t len;
+            if (!(ifs >> len) || ifs.get() != '\n') return false;
+            seg.isName = false;
+            seg.text.resize(len);
+            if (!ifs.read(seg.text.data(), len)) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool matchesFile(const CellInfo& info, const std::string& data) {
+    size_t pos = 0;
+    for (auto& seg : info.segments) {
+        if (seg.text.size() > data.size() - pos || data.compare(pos, seg.text.size(), seg.text)) return false;
+        pos += seg.text.size();
+    }
+    return pos == data.size();
+}
+
+static void saveCellInfo(const std::string& cacheFile, const CellInfo& info) {
+    // Write a new file and rename it, so concurrent readers never see a partial file
+    std::string tmpFile = cacheFile + ".tmp" + std::to_string(getpid());
+    std::ofstream ofs(tmpFile, std::ios::binary);
+    if (!ofs.good()) return;
+    ofs << cacheHeader << "\n" << info.defs.size() << "\n";
+    for (auto& def : info.defs) ofs << def << "\n";
+    ofs << info.segments.size() << "\n";
+    for (auto& seg : info.segments) {
+        if (seg.isName) ofs << "N " << seg.text << "\n";
+        else ofs << "L " << seg.text.size() << "\n" << seg.text << "\n";
+    }
+    ofs.close();
+    std::error_code ec;
+    if (!ofs.good() || rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+        std::filesystem::remove(tmpFile, ec);
+}
+
+CellInfo getCellInfo(const std::string& fileName, const std::string& cacheDir) {
+    CellInfo info;
+    std::string cacheFile;
+    if (!cacheDir.empty()) {
+        std::ifstream stream(fileName);
+        if (!stream.good()) error("Could not read source file %s", fileName.c_str());
+        std::string data(std::istreambuf_iterator<char>(stream), {});
+        cacheFile = getCacheFile(cacheDir, data);
+        if (loadCellInfo(cacheFile, info) && matchesFile(info, data)) return info;
+        info = CellInfo();
+    }
+
+    auto parseTree = parseSingleFile(fileName);
+    info.defs = getDefs(parseTree);
+    RenameListener renameListener;
+    renameListener.emitFile(parseTree, info);
+    if (!cacheFile.empty()) saveCellInfo(cacheFile, info);
+    return info;
+}
+
+// Writes file only if its contents change, so that tools that check
+// timestamps (and msc --build-dir) see unchanged cells as unchanged
+static void writeIfChanged(const std::string& fileName, const std::string& data) {
+    std::ifstream ifs(fileName, std::ios::binary);
+    if (ifs.good() && std::string(std::istreambuf_iterator<char>(ifs), {}) == data) return;
+    ifs.close();
+    std::ofstream ofs(fileName, std::ios::binary);
+    if (!ofs.good()) error("Could not open output file %s", fileName.c_str());
+    ofs << data;
+}
+
 int main(int argc, const char* argv[]) {
-    if (argc < 2) {
+    std::string cacheDir, outputDir;
+    int firstFile = 1;
+    while (firstFile + 1 < argc) {
+        std::string arg = argv[firstFile];
+        if (arg == "--cache-dir") cacheDir = argv[firstFile + 1];
+        else if (arg == "--output-dir") outputDir = argv[firstFile + 1];
+        else break;
+        firstFile += 2;
+    }
+    if (!cacheDir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(cacheDir, ec);
+        if (ec) cacheDir = "";
+    }
+
+    if (argc <= firstFile) {
         std::cerr << "error: need some files!\n";
         exit(-1);
     }
 
-    std::vector<MinispecParser::PackageDefContext*> parseTrees;
-    for (int i = 1; i < argc; i++) {
-        parseTrees.push_back(parseSingleFile(argv[i]));
+    std::vector<std::string> fileNames;
+    std::vector<CellInfo> cells;
+    for (int i = firstFile; i < argc; i++) {
+        fileNames.push_back(argv[i]);
+        cells.push_back(getCellInfo(argv[i], cacheDir));
     }
 
-    RenameTable renameTable(parseTrees);
-    RenameListener renameListener(renameTable);
-    for (auto parseTree : parseTrees) {
-        if (parseTree == parseTrees.back()) continue;  // skip last file
-
-        renameTable.advance(parseTree);
-        tree::ParseTreeWalker::DEFAULT.walk(&renameListener, parseTree);
-
-        std::string fileName = getTokenStream(parseTree)->getSourceName();
-        std::cout << "// File " << fileName << "\n";
-        renameListener.emit(parseTree);
+    RenameTable renameTable(fileNames, cells);
+    for (size_t i = 0; i < cells.size() - 1; i++) {  // skip last file
+        renameTable.advance(fileNames[i]);
+        std::string code;
+        for (auto& seg : cells[i].segments) {
+            code += seg.isName? renameTable.rename(seg.text) : seg.text;
+        }
+        if (outputDir.empty()) {
+            std::cout << "// File " << fileNames[i] << "\n" << code << "\n";
+        } else {
+            auto fileName = std::filesystem::path(outputDir) / std::filesystem::path(fileNames[i]).filename();
+            std::error_code ec;
+            if (std::filesystem::weakly_canonical(fileName, ec) == std::filesystem::weakly_canonical(fileNames[i], ec))
+                error("output file %s would overwrite its input", fileName.c_str());
+            writeIfChanged(fileName, code);
+        }
     }
 
     return 0;
@@ -16,56 +16,218 @@
  * this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <iostream>
+#include <sstream>
 #include <string>
 #include <unordered_set>
 #include "antlr4-runtime.h"
 #include "errors.h"
+#include "json.h"
 #include "log.h"
 #include "strutils.h"
+#include "version.h"
 
 using namespace antlr4;
 
 // Error reporting
-static std::unordered_set<std::string> warnMsgs, errMsgs;
+namespace std {
+    template <> struct hash<DiagKey> {
+        size_t operator()(const DiagKey& k) const {
+            size_t h = std::hash<const void*>()(k.ctx) ^ (k.argsHash * 0x9e3779b97f4a7c15ul);
+            return k.code.empty()? h : h ^ std::hash<std::string>()(k.code);
+        }
+    };
+}
+
+static std::unordered_set<DiagKey> warnKeys, errKeys;
+static std::unordered_set<std::string> warnDiags, errDiags;
 static std::unordered_set<tree::ParseTree*> warnCtxs, errCtxs;
 static size_t totalErrs = 0;
 static size_t totalWarns = 0;
+static size_t printedErrs = 0;
 static bool reportAllMsgs = false;
+static DiagnosticsFormat diagFormat = DIAG_TEXT;
+
+// Machine-readable diagnostics
+static JsonValue sarifResults = JsonValue::array();
+static JsonValue sarifArtifacts = JsonValue::array();
+
+static void printSarifLog() {
+    JsonValue driver = JsonValue::object();
+    driver.set("name", "msc");
+    driver.set("version", getVersion());
+    driver.set("informationUri", "https://github.com/minispec-hdl/minispec");
+    JsonValue run = JsonValue::object();
+    run.set("tool", JsonValue::object().set("driver", driver));
+    run.set("artifacts", sarifArtifacts);
+    run.set("results", sarifResults);
+    JsonValue log = JsonValue::object();
+    log.set("$schema", "https://json.schemastore.org/sarif-2.1.0.json");
+    log.set("version", "2.1.0");
+    log.set("runs", JsonValue::array().push(run));
+    std::cout << log.str() << std::endl;
+}
 
-void initReporting(bool reportAllErrors) {
+void initReporting(bool reportAllErrors, DiagnosticsFormat format) {
     reportAllMsgs = reportAllErrors;
+    diagFormat = format;
+    if (format != DIAG_TEXT) setColorOutput(false);
+    if (format == DIAG_SARIF) atexit(printSarifLog);
 }
 
-void reportMsg(bool isError, const std::string& msg,
-        const std::string& locInfo, tree::ParseTree* ctx) {
-    auto& msgs = isError? errMsgs : warnMsgs;
-    auto& ctxs = isError? errCtxs : warnCtxs;
-    size_t& total = isError? totalErrs : totalWarns;
-    if (msgs.count(msg)) {
-        // Sometimes bsc derps out and spits the same error multiple times
-        // (e.g. double-writes). If we have emitted EXACTLY the same error
-        // already, then don't even count it as a total, regardless of
-        // reportAllMsgs
+static std::string diagText(bool isError, const Diagnostic& diag) {
+    std::stringstream ss;
+    if (diag.loc.file.size()) ss << hlColored(getLoc(diag.loc) + ":") << " ";
+    if (diag.label) ss << (isError? errorColored("error:") : warnColored("warning:")) << " ";
+    ss << diag.message << "\n";
+    for (auto& sub : diag.subLocs) {
+        // Sub-locations in the primary location's file omit its name (see getSubLoc())
+        std::string subLoc = getLoc(sub);
+        if (sub.line && sub.file == diag.loc.file)
+            subLoc = std::string(sub.file.size(), ' ') + " " + std::to_string(sub.line) + ":" + std::to_string(sub.col);
+        ss << hlColored(subLoc + ":") << " " << sub.message << "\n";
+    }
+    for (auto& line : diag.context) ss << "    " << line << "\n";
+    return ss.str();
+}
+
+static JsonValue diagRecord(bool isError, const Diagnostic& diag, const std::string& locInfo) {
+    JsonValue record = JsonValue::object();
+    record.set("type", "diagnostic");
+    record.set("severity", isError? "error" : "warning");
+    record.set("code", diag.code);
+    record.set("message", diag.message);
+    JsonValue locations = JsonValue::array();
+    std::vector<DiagLoc> locs = {diag.loc};
+    locs.insert(locs.end(), diag.subLocs.begin(), diag.subLocs.end());
+    for (auto& loc : locs) {
+        // Locations without a line (e.g., command-line args) are not in a file
+        if (!loc.line) continue;
+        JsonValue l = JsonValue::object();
+        l.set("file", loc.file).set("line", (uint64_t) loc.line).set("column", (uint64_t) loc.col);
+        if (loc.message.size()) l.set("message", loc.message);
+        locations.push(l);
+    }
+    record.set("locations", locations);
+    JsonValue context = JsonValue::array();
+    for (auto& line : diag.context) context.push(line);
+    record.set("context", context);
+    std::string info = trim(locInfo);
+    while (info.size() && info.back() == '\n') info.pop_back();
+    if (info.size()) record.set("info", info);
+    return record;
+}
+
+static JsonValue sarifLocation(const JsonValue& loc, const std::string& snippet = "") {
+    JsonValue region = JsonValue::object();
+    region.set("startLine", *loc.get("line")).set("startColumn", *loc.get("column"));
+    if (snippet.size()) region.set("snippet", JsonValue::object().set("text", snippet));
+    JsonValue physical = JsonValue::object();
+    physical.set("artifactLocation", JsonValue::object().set("uri", *loc.get("file")));
+    physical.set("region", region);
+    JsonValue res = JsonValue::object();
+    res.set("physicalLocation", physical);
+    if (auto msg = loc.get("message")) res.set("message", JsonValue::object().set("text", *msg));
+    return res;
+}
+
+static void emitDiagRecord(const JsonValue& record) {
+    if (diagFormat == DIAG_JSON) {
+        std::cout << record.str() << std::endl;
         return;
     }
-    if (reportAllMsgs || (!msgs.count(msg) && !ctxs.count(ctx))) {
-        msgs.insert(msg);
-        if (ctx) ctxs.insert(ctx);
-        std::cerr << locInfo << msg << "\n";
+    // SARIF: the primary location goes in locations, the rest are related
+    std::string text = record.get("message")->getString();
+    if (auto info = record.get("info")) text = info->getString() + "\n" + text;
+    auto& locs = record.get("locations")->getArray();
+    JsonValue result = JsonValue::object();
+    std::string code = record.get("code")->getString();
+    result.set("ruleId", code.empty()? "msc" : code);
+    result.set("level", record.get("severity")->getString());
+    result.set("message", JsonValue::object().set("text", text));
+    if (locs.size()) {
+        std::string snippet;
+        for (auto& line : record.get("context")->getArray()) snippet += line.getString() + "\n";
+        result.set("locations", JsonValue::array().push(sarifLocation(locs[0], snippet)));
+        JsonValue related = JsonValue::array();
+        for (size_t i = 1; i < locs.size(); i++) related.push(sarifLocation(locs[i]));
+        if (locs.size() > 1) result.set("relatedLocations", related);
     }
+    sarifResults.push(result);
+}
+
+void reportOutput(const std::string& kind, const std::string& file, const std::string& text) {
+    if (diagFormat == DIAG_TEXT) {
+        std::cout << text << "\n";
+    } else if (diagFormat == DIAG_JSON) {
+        JsonValue record = JsonValue::object();
+        record.set("type", "output").set("kind", kind).set("file", file);
+        std::cout << record.str() << std::endl;
+    } else {
+        JsonValue artifact = JsonValue::object();
+        artifact.set("location", JsonValue::object().set("uri", file));
+        artifact.set("roles", JsonValue::array().push("resultFile"));
+        artifact.set("description", JsonValue::object().set("text", kind));
+        sarifArtifacts.push(artifact);
+    }
+}
+
+// Prints a diagnostic that is not a duplicate, unless its ctx already has
+// one. Returns whether it was printed.
+static bool reportUnique(bool isError, const std::function<Diagnostic()>& build,
+        const std::string& locInfo, tree::ParseTree* ctx) {
+    auto& ctxs = isError? errCtxs : warnCtxs;
+    size_t& total = isError? totalErrs : totalWarns;
     total++;
+    if (!reportAllMsgs && ctxs.count(ctx)) return false;
+    if (ctx) ctxs.insert(ctx);
+    if (isError) printedErrs++;
+    Diagnostic diag = build();
+    if (diagFormat == DIAG_TEXT) std::cerr << locInfo << diagText(isError, diag) << "\n";
+    else emitDiagRecord(diagRecord(isError, diag, locInfo));
+    return true;
+}
+
+// Sometimes bsc derps out and spits the same error multiple times (e.g.
+// double-writes), and unrolled loops and parametric instances repeat the same
+// errors. If we have emitted EXACTLY the same error already, then don't even
+// count it as a total, regardless of reportAllMsgs.
+void reportMsg(bool isError, const DiagKey& key, const std::function<Diagnostic()>& build,
+        const std::string& locInfo, tree::ParseTree* ctx) {
+    auto& keys = isError? errKeys : warnKeys;
+    if (keys.count(key)) return;
+    auto buildWithCode = [&]() {
+        Diagnostic diag = build();
+        if (diag.code.empty()) diag.code = key.code;
+        return diag;
+    };
+    if (reportUnique(isError, buildWithCode, locInfo, ctx)) keys.insert(key);
+}
+
+void reportMsg(bool isError, const Diagnostic& diag,
+        const std::string& locInfo, tree::ParseTree* ctx) {
+    // Diagnostics built upfront are only duplicates if they're identical, so
+    // compare their full contents (hashes could collide)
+    auto& diags = isError? errDiags : warnDiags;
+    std::stringstream ss;
+    ss << diag.code << '\0' << getLoc(diag.loc) << '\0' << diag.message << '\0' << diag.label;
+    for (auto& sub : diag.subLocs) ss << '\0' << getLoc(sub) << '\0' << sub.message;
+    for (auto& line : diag.context) ss << '\0' << line;
+    std::string contents = ss.str();
+    if (diags.count(contents)) return;
+    if (reportUnique(isError, [&diag]() { return diag; }, locInfo, ctx)) diags.insert(contents);
 }
 
-void reportErr(const std::string& msg, const std::string& locInfo,
-        tree::ParseTree* ctx) { reportMsg(true, msg, locInfo, ctx); }
+void reportErr(const Diagnostic& diag, const std::string& locInfo,
+        tree::ParseTree* ctx) { reportMsg(true, diag, locInfo, ctx); }
 
-void reportWarn(const std::string& msg, const std::string& locInfo,
-        tree::ParseTree* ctx) { reportMsg(false, msg, locInfo, ctx); }
+void reportWarn(const Diagnostic& diag, const std::string& locInfo,
+        tree::ParseTree* ctx) { reportMsg(false, diag, locInfo, ctx); }
 
 void exitIfErrors() {
     if (!totalErrs) return;
-    if (totalErrs > errMsgs.size()) {
-        auto omittedErrs = totalErrs - errMsgs.size();
+    if (totalErrs > printedErrs) {
+        auto omittedErrs = totalErrs - printedErrs;
         std::cerr << noteColored("note:") << " omitted " << omittedErrs
             << " errors similar to those reported; run with "
             << hlColored("--all-errors") << " to see all errors\n";
@@ -99,3 +261,14 @@ Token* getStartToken(tree::ParseTree* pt) {
 
 std::string getLoc(tree::ParseTree* pt) { return getLoc(getStartToken(pt)); }
 std::string getSubLoc(tree::ParseTree* pt) { return getSubLoc(getStartToken(pt)); }
+
+std::string getLoc(const DiagLoc& loc) {
+    if (!loc.line) return loc.file;
+    return loc.file + ":" + std::to_string(loc.line) + ":" + std::to_string(loc.col);
+}
+
+DiagLoc getDiagLoc(tree::ParseTree* pt, const std::string& message) {
+    Token* tok = getStartToken(pt);
+    return {tok->getTokenSource()->getSourceName(), (uint32_t) tok->getLine(),
+        (uint32_t) tok->getCharPositionInLine() + 1, message};
+}
@@ -18,23 +18,77 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
+#include <vector>
 #include "antlr4-runtime.h"
 
 // Reporting of errors in user code (**not** errors in the compiler itself)
-void initReporting(bool reportAllErrors);
 
-void reportMsg(bool isError, const std::string& msg,
+// Diagnostics are printed as colored text on stderr, or as machine-readable
+// records on stdout: one JSON object per line (json), or a SARIF 2.1.0 log
+// printed on exit (sarif). Machine-readable output is not colored.
+enum DiagnosticsFormat {DIAG_TEXT, DIAG_JSON, DIAG_SARIF};
+
+void initReporting(bool reportAllErrors, DiagnosticsFormat format = DIAG_TEXT);
+
+// A diagnostic's parts. Text mode renders them as
+//   file:line:col: error: message
+//        line:col: sub-location message
+//       context line
+// and machine-readable modes report each part on its own.
+struct DiagLoc {
+    std::string file;  // or a description, like "command-line arg"
+    uint32_t line = 0;  // 0 if there is no line
+    uint32_t col = 0;
+    std::string message;  // only for sub-locations
+};
+
+struct Diagnostic {
+    DiagLoc loc;  // primary location, if file is not empty
+    std::string message;
+    std::vector<DiagLoc> subLocs;
+    std::vector<std::string> context;  // source lines (see contextLines())
+    std::string code;  // kind of diagnostic, if known (e.g., bsc's T0020)
+    bool label = true;  // print "error:" or "warning:" before the message
+};
+
+// Reports a diagnostic. Diagnostics identical to an earlier one are dropped.
+void reportMsg(bool isError, const Diagnostic& diag,
         const std::string& locInfo = "", antlr4::tree::ParseTree* ctx = nullptr);
 
-void reportErr(const std::string& msg, const std::string& locInfo = "",
+// Diagnostics are deduplicated on compact keys: the diagnostic's code, the
+// parse tree node it refers to, and a hash of its other arguments (e.g., its
+// message template). Keys are much cheaper to build than the messages.
+struct DiagKey {
+    std::string code;
+    const void* ctx;
+    size_t argsHash;
+
+    bool operator==(const DiagKey& other) const {
+        return ctx == other.ctx && argsHash == other.argsHash && code == other.code;
+    }
+};
+
+// Reports a diagnostic that is built only if it is printed, i.e., if it is
+// not a duplicate of an earlier one
+void reportMsg(bool isError, const DiagKey& key, const std::function<Diagnostic()>& build,
+        const std::string& locInfo = "", antlr4::tree::ParseTree* ctx = nullptr);
+
+void reportErr(const Diagnostic& diag, const std::string& locInfo = "",
         antlr4::tree::ParseTree* ctx = nullptr);
 
-void reportWarn(const std::string& msg, const std::string& locInfo = "",
+void reportWarn(const Diagnostic& diag, const std::string& locInfo = "",
         antlr4::tree::ParseTree* ctx = nullptr);
 
 void exitIfErrors();
 
+// Reports an output produced by msc (e.g., kind "sim" for a simulation
+// executable). text is printed in text mode.
+void reportOutput(const std::string& kind, const std::string& file, const std::string& text);
+
 // Error locations
 std::string getLoc(antlr4::tree::ParseTree* pt);
 std::string getSubLoc(antlr4::tree::ParseTree* pt);
+std::string getLoc(const DiagLoc& loc);
+DiagLoc getDiagLoc(antlr4::tree::ParseTree* pt, const std::string& message = "");
@@ -0,0 +1,1424 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include "antlr4-runtime.h"
+#include "eval.h"
+#include "strutils.h"
+
+using namespace antlr4;
+
+// Minispec strings can't have quotes, tabs, or line breaks, so sanitize the label
+static std::string getEvalLabel(const std::string& expr) {
+    std::string label = expr;
+    replace(label, "\"", "'");
+    for (const char* ws : {"\t", "\n", "\r", "\f"}) replace(label, ws, " ");
+    return label;
+}
+
+// Escapes a label for a $display format string, so that it prints as
+// written (e.g., "7 % 3"), like labels of natively evaluated expressions
+static std::string getDisplayFormat(const std::string& label) {
+    std::string res;
+    for (char c : label) {
+        if (c == '%') res += "%%";
+        else if (c == '\\') res += "\\\\";
+        else res += c;
+    }
+    return res;
+}
+
+std::string getEvalModuleCode(const std::string& importName, const std::vector<std::string>& exprs) {
+    std::stringstream ss;
+    if (!importName.empty()) ss << "import " << importName << ";\n";
+    ss << "// Auto-generated eval module\n";
+    ss << "module Eval___;\n";
+    ss << "  rule eval;\n";
+    for (size_t i = 0; i < exprs.size(); i++) {
+        ss << "    let expr___" << i << " =\n" << exprs[i] << "\n    ;\n";
+        ss << "    $display(\"" << getDisplayFormat(getEvalLabel(exprs[i])) << " = \", fshow(expr___" << i << "));\n";
+    }
+    ss << "    $finish;\n";
+    ss << "  endrule\n";
+    ss << "endmodule\n";
+    return ss.str();
+}
+
+/* Native evaluator
+ *
+ * Evaluates the combinational subset of Minispec directly on the parse tree:
+ * Integer, Bool, Bit/Int/UInt, enum, (non-parametric) struct, and Vector
+ * values; operators; conditional and case expressions; and calls to
+ * package-level functions, including parametric ones. Anything else (e.g.,
+ * modules, Bluespec library functions, or don't-care values) throws
+ * EvalUnsupported, and the caller falls back to bsc.
+ *
+ * The evaluator assumes the code has already passed msc's checks; it does
+ * not try to catch type errors that only bsc reports, but it never guesses:
+ * when bsc's typing rules would be needed to pick a value, it gives up.
+ */
+
+struct EvalUnsupported {};
+
+[[noreturn]] static void unsupported() { throw EvalUnsupported(); }
+
+// Limits to keep runaway evaluations (e.g., unbounded recursion) in check
+static const uint64_t maxSteps = 10*1000*1000;
+static const size_t maxDepth = 1000;
+static const int64_t maxWidth = 1 << 16;
+static const int64_t maxElems = 1 << 16;
+
+struct EvalType;
+typedef std::shared_ptr<const EvalType> EvalTypePtr;
+
+struct EvalType {
+    enum Kind { INTEGER, BOOL, BIT, INT, UINT, ENUM, STRUCT, VECTOR };
+    Kind kind;
+    uint32_t width = 0;  // BIT, INT, UINT, ENUM: bits; VECTOR: elements
+    std::string name;  // ENUM and STRUCT
+    std::vector<std::tuple<std::string, int64_t>> tags;  // ENUM
+    std::vector<std::tuple<std::string, EvalTypePtr>> fields;  // STRUCT
+    EvalTypePtr elem;  // VECTOR
+
+    bool isBits() const { return kind == BIT || kind == INT || kind == UINT; }
+};
+
+static EvalTypePtr makeType(EvalType::Kind kind, uint32_t width = 0) {
+    auto type = std::make_shared<EvalType>();
+    type->kind = kind;
+    type->width = width;
+    return type;
+}
+
+static bool sameType(const EvalTypePtr& a, const EvalTypePtr& b) {
+    if (a == b) return true;
+    if (a->kind != b->kind || a->width != b->width || a->name != b->name) return false;
+    if (a->kind == EvalType::VECTOR) return sameType(a->elem, b->elem);
+    return true;
+}
+
+// Bit-vector arithmetic on little-endian 64-bit words. All functions take
+// and return words with bits at and above width cleared.
+typedef std::vector<uint64_t> Words;
+
+static Words zeroWords(uint32_t width) { return Words((width + 63) / 64, 0); }
+
+static void clearHighBits(Words& w, uint32_t width) {
+    if (width % 64) w.back() &= (1ul << (width % 64)) - 1;
+}
+
+static bool getBit(const Words& w, uint32_t i) { return (w[i / 64] >> (i % 64)) & 1; }
+
+static void setBit(Words& w, uint32_t i, bool b) {
+    if (b) w[i / 64] |= 1ul << (i % 64);
+    else w[i / 64] &= ~(1ul << (i % 64));
+}
+
+static bool isZero(const Words& w) {
+    for (uint64_t x : w) if (x) return false;
+    return true;
+}
+
+static Words resizeWords(const Words& a, uint32_t width, uint32_t newWidth, bool signExtend) {
+    Words res = zeroWords(newWidth);
+    bool sign = signExtend && width && getBit(a, width - 1);
+    for (uint32_t i = 0; i < newWidth; i++) setBit(res, i, (i < width)? getBit(a, i) : sign);
+    return res;
+}
+
+static Words fromInt64(int64_t v, uint32_t width) {
+    Words res = zeroWords(width);
+    for (size_t i = 0; i < res.size(); i++) res[i] = (i == 0)? (uint64_t) v : ((v < 0)? ~0ul : 0ul);
+    clearHighBits(res, width);
+    return res;
+}
+
+static Words addWords(const Words& a, const Words& b, uint32_t width) {
+    Words res(a.size());
+    unsigned __int128 carry = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        unsigned __int128 sum = (unsigned __int128) a[i] + b[i] + carry;
+        res[i] = (uint64_t) sum;
+        carry = sum >> 64;
+    }
+    clearHighBits(res, width);
+    return res;
+}
+
+static Words notWords(const Words& a, uint32_t width) {
+    Words res(a.size());
+    for (size_t i = 0; i < a.size(); i++) res[i] = ~a[i];
+    clearHighBits(res, width);
+    return res;
+}
+
+static Words negWords(const Words& a, uint32_t width) {
+    return addWords(notWords(a, width), fromInt64(1, width), width);
+}
+
+static Words subWords(const Words& a, const Words& b, uint32_t width) {
+    return addWords(a, negWords(b, width), width);
+}
+
+static Words mulWords(const Words& a, const Words& b, uint32_t width) {
+    Words res(a.size(), 0);
+    for (size_t i = 0; i < a.size(); i++) {
+        unsigned __int128 carry = 0;
+        for (size_t j = 0; i + j < res.size(); j++) {
+            unsigned __int128 prod = (unsigned __int128) a[i] * b[j] + res[i + j] + carry;
+            res[i + j] = (uint64_t) prod;
+            carry = prod >> 64;
+        }
+    }
+    clearHighBits(res, width);
+    return res;
+}
+
+static int ucmpWords(const Words& a, const Words& b) {
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i]) return (a[i] < b[i])? -1 : 1;
+    }
+    return 0;
+}
+
+static int scmpWords(const Words& a, const Words& b, uint32_t width) {
+    bool aNeg = getBit(a, width - 1);
+    bool bNeg = getBit(b, width - 1);
+    if (aNeg != bNeg) return aNeg? -1 : 1;
+    return ucmpWords(a, b);
+}
+
+static Words shlWords(const Words& a, uint64_t shift, uint32_t width) {
+    Words res = zeroWords(width);
+    for (uint64_t i = shift; i < width; i++) setBit(res, i, getBit(a, i - shift));
+    return res;
+}
+
+static Words shrWords(const Words& a, uint64_t shift, uint32_t width, bool arith) {
+    Words res = zeroWords(width);
+    bool sign = arith && getBit(a, width - 1);
+    shift = std::min(shift, (uint64_t) width);
+    for (uint32_t i = 0; i < width; i++) setBit(res, i, (i + shift < width)? getBit(a, i + shift) : sign);
+    return res;
+}
+
+static void udivmodWords(const Words& a, const Words& b, uint32_t width, Words& quot, Words& rem) {
+    // Restoring division; the remainder takes an extra bit before each subtraction
+    Words divisor = resizeWords(b, width, width + 1, false);
+    Words r = zeroWords(width + 1);
+    quot = zeroWords(width);
+    for (uint32_t i = width; i-- > 0;) {
+        r = shlWords(r, 1, width + 1);
+        setBit(r, 0, getBit(a, i));
+        if (ucmpWords(r, divisor) >= 0) {
+            r = subWords(r, divisor, width + 1);
+            setBit(quot, i, true);
+        }
+    }
+    rem = resizeWords(r, width + 1, width, false);
+}
+
+static std::string udecWords(Words a) {
+    if (isZero(a)) return "0";
+    std::string s;
+    while (!isZero(a)) {
+        unsigned __int128 rem = 0;
+        for (size_t i = a.size(); i-- > 0;) {
+            unsigned __int128 cur = (rem << 64) | a[i];
+            a[i] = (uint64_t) (cur / 10);
+            rem = cur % 10;
+        }
+        s.push_back('0' + (char) rem);
+    }
+    std::reverse(s.begin(), s.end());
+    return s;
+}
+
+static std::string hexWords(const Words& a, uint32_t width) {
+    std::string s;
+    for (uint32_t d = (width + 3) / 4; d-- > 0;) {
+        uint32_t nibble = 0;
+        for (uint32_t b = 0; b < 4; b++) {
+            uint32_t i = 4 * d + b;
+            if (i < width && getBit(a, i)) nibble |= 1 << b;
+        }
+        s.push_back("0123456789abcdef"[nibble]);
+    }
+    return s;
+}
+
+// Returns the value of a (as unsigned if !isSigned), or false if it does not fit in an int64_t
+static bool wordsToInt64(const Words& a, uint32_t width, bool isSigned, int64_t& res) {
+    bool neg = isSigned && getBit(a, width - 1);
+    Words mag = neg? negWords(a, width) : a;
+    for (size_t i = 1; i < mag.size(); i++) if (mag[i]) return false;
+    uint64_t v = mag[0];
+    if (v > (neg? (1ul << 63) : (1ul << 63) - 1)) return false;
+    res = neg? (int64_t) (0 - v) : (int64_t) v;
+    return true;
+}
+
+static bool fitsInType(int64_t v, const EvalTypePtr& type) {
+    uint32_t w = type->width;
+    if (type->kind == EvalType::INT) {
+        if (w >= 64) return true;
+        return v >= -(1l << (w - 1)) && v < (1l << (w - 1));
+    }
+    if (v < 0) return false;
+    return w >= 63 || v < (1l << w);
+}
+
+/* Values */
+
+struct EvalValue {
+    EvalTypePtr type;
+    bool valid = true;  // false for variables declared without a value
+    bool sizedLiteral = false;  // sized literals (e.g., 4'b1010) may also become Int#(n) or UInt#(n)
+    int64_t integer = 0;  // INTEGER, BOOL (0/1), and ENUM (tag value)
+    Words bits;  // BIT, INT, and UINT
+    std::vector<EvalValue> elems;  // STRUCT (in member order) and VECTOR
+
+    bool isFullyValid() const {
+        if (!valid) return false;
+        for (const auto& e : elems) if (!e.isFullyValid()) return false;
+        return true;
+    }
+};
+
+static EvalValue integerValue(int64_t v) {
+    static EvalTypePtr integerType = makeType(EvalType::INTEGER);
+    EvalValue res;
+    res.type = integerType;
+    res.integer = v;
+    return res;
+}
+
+static EvalValue boolValue(bool b) {
+    static EvalTypePtr boolType = makeType(EvalType::BOOL);
+    EvalValue res;
+    res.type = boolType;
+    res.integer = b;
+    return res;
+}
+
+static EvalValue bitsValue(const EvalTypePtr& type, const Words& bits) {
+    EvalValue res;
+    res.type = type;
+    res.bits = bits;
+    return res;
+}
+
+static EvalValue undefinedValue(const EvalTypePtr& type) {
+    EvalValue res;
+    res.type = type;
+    if (type->kind == EvalType::STRUCT) {
+        for (const auto& field : type->fields) res.elems.push_back(undefinedValue(std::get<1>(field)));
+    } else if (type->kind == EvalType::VECTOR) {
+        res.elems.resize(type->width, undefinedValue(type->elem));
+    } else {
+        res.valid = false;
+        if (type->isBits()) res.bits = zeroWords(type->width);
+    }
+    return res;
+}
+
+// Converts v to type, allowing the implicit conversions bsc does for literals
+static EvalValue convert(const EvalValue& v, const EvalTypePtr& type) {
+    if (!v.isFullyValid()) unsupported();
+    if (sameType(v.type, type)) {
+        EvalValue res = v;
+        res.type = type;
+        res.sizedLiteral = false;
+        return res;
+    }
+    if (v.type->kind == EvalType::INTEGER && type->isBits()) {
+        if (!fitsInType(v.integer, type)) unsupported();
+        return bitsValue(type, fromInt64(v.integer, type->width));
+    }
+    if (v.sizedLiteral && type->isBits() && v.type->width == type->width) {
+        return bitsValue(type, v.bits);
+    }
+    unsupported();
+}
+
+// Gives both operands of a binary operator the same type
+static void unify(EvalValue& a, EvalValue& b) {
+    if (sameType(a.type, b.type)) return;
+    // An Integer takes the other operand's type, including its literal-ness
+    if (b.type->kind == EvalType::INTEGER) {
+        b = convert(b, a.type);
+        b.sizedLiteral = a.sizedLiteral;
+    } else if (a.type->kind == EvalType::INTEGER) {
+        a = convert(a, b.type);
+        a.sizedLiteral = b.sizedLiteral;
+    } else if (a.sizedLiteral) a = convert(a, b.type);
+    else if (b.sizedLiteral) b = convert(b, a.type);
+    else unsupported();
+}
+
+static bool equals(EvalValue a, EvalValue b) {
+    unify(a, b);
+    if (!a.isFullyValid() || !b.isFullyValid()) unsupported();
+    if (a.type->isBits()) return a.bits == b.bits;
+    if (a.type->kind == EvalType::STRUCT || a.type->kind == EvalType::VECTOR) {
+        for (size_t i = 0; i < a.elems.size(); i++) {
+            if (!equals(a.elems[i], b.elems[i])) return false;
+        }
+        return true;
+    }
+    return a.integer == b.integer;
+}
+
+// Returns the position of a Vector element or bit
+static int64_t getIndex(const EvalValue& v) {
+    if (!v.isFullyValid()) unsupported();
+    if (v.type->kind == EvalType::INTEGER) return v.integer;
+    int64_t res;
+    if (!v.type->isBits() || !wordsToInt64(v.bits, v.type->width, v.type->kind == EvalType::INT, res)) unsupported();
+    return res;
+}
+
+static uint32_t packedWidth(const EvalTypePtr& type) {
+    switch (type->kind) {
+        case EvalType::BOOL: return 1;
+        case EvalType::BIT: case EvalType::INT: case EvalType::UINT: case EvalType::ENUM: return type->width;
+        case EvalType::STRUCT: {
+            uint64_t width = 0;
+            for (const auto& field : type->fields) width += packedWidth(std::get<1>(field));
+            if (width > maxWidth) unsupported();
+            return width;
+        }
+        case EvalType::VECTOR: {
+            uint64_t width = (uint64_t) type->width * packedWidth(type->elem);
+            if (width > maxWidth) unsupported();
+            return width;
+        }
+        default: unsupported();
+    }
+}
+
+// Packs v into res starting at bit pos. Struct members are packed with the
+// first one in the MSBs, and Vector elements with element 0 in the LSBs.
+static void packInto(const EvalValue& v, Words& res, uint32_t pos) {
+    const auto& type = v.type;
+    if (type->isBits()) {
+        for (uint32_t i = 0; i < type->width; i++) setBit(res, pos + i, getBit(v.bits, i));
+    } else if (type->kind == EvalType::BOOL || type->kind == EvalType::ENUM) {
+        uint32_t width = packedWidth(type);
+        for (uint32_t i = 0; i < width; i++) setBit(res, pos + i, (v.integer >> i) & 1);
+    } else if (type->kind == EvalType::STRUCT) {
+        for (size_t i = v.elems.size(); i-- > 0;) {
+            packInto(v.elems[i], res, pos);
+            pos += packedWidth(v.elems[i].type);
+        }
+    } else if (type->kind == EvalType::VECTOR) {
+        for (const auto& e : v.elems) {
+            packInto(e, res, pos);
+            pos += packedWidth(e.type);
+        }
+    } else {
+        unsupported();
+    }
+}
+
+static EvalValue unpackFrom(const EvalTypePtr& type, const Words& bits, uint32_t pos) {
+    if (type->isBits()) {
+        Words w = zeroWords(type->width);
+        for (uint32_t i = 0; i < type->width; i++) setBit(w, i, getBit(bits, pos + i));
+        return bitsValue(type, w);
+    } else if (type->kind == EvalType::BOOL) {
+        return boolValue(getBit(bits, pos));
+    } else if (type->kind == EvalType::ENUM) {
+        EvalValue res;
+        res.type = type;
+        for (uint32_t i = 0; i < type->width; i++) res.integer |= ((int64_t) getBit(bits, pos + i)) << i;
+        // Values that match no tag have no defined fshow() output
+        bool isTag = false;
+        for (const auto& tag : type->tags) isTag |= (std::get<1>(tag) == res.integer);
+        if (!isTag) unsupported();
+        return res;
+    } else if (type->kind == EvalType::STRUCT) {
+        EvalValue res;
+        res.type = type;
+        res.elems.resize(type->fields.size());
+        for (size_t i = type->fields.size(); i-- > 0;) {
+            const auto& fieldType = std::get<1>(type->fields[i]);
+            res.elems[i] = unpackFrom(fieldType, bits, pos);
+            pos += packedWidth(fieldType);
+        }
+        return res;
+    } else if (type->kind == EvalType::VECTOR) {
+        EvalValue res;
+        res.type = type;
+        for (uint32_t i = 0; i < type->width; i++) {
+            res.elems.push_back(unpackFrom(type->elem, bits, pos));
+            pos += packedWidth(type->elem);
+        }
+        return res;
+    }
+    unsupported();
+}
+
+// Formats v as Bluesim prints fshow(v) with $display
+static std::string formatValue(const EvalValue& v) {
+    // Unconstrained literals and Integers get their type (and format) from bsc
+    if (v.sizedLiteral || !v.isFullyValid()) unsupported();
+    const auto& type = v.type;
+    switch (type->kind) {
+        case EvalType::BOOL: return v.integer? "True" : "False";
+        case EvalType::BIT: return "'h" + hexWords(v.bits, type->width);
+        case EvalType::UINT: {
+            // Like Verilog, %d pads to the width of the largest value
+            std::string maxStr = udecWords(notWords(zeroWords(type->width), type->width));
+            std::string s = udecWords(v.bits);
+            return std::string(maxStr.size() - s.size(), ' ') + s;
+        }
+        case EvalType::INT: {
+            // ... and signed %d to the width of the most negative value
+            Words minVal = zeroWords(type->width);
+            setBit(minVal, type->width - 1, true);
+            std::string minStr = "-" + udecWords(minVal);
+            bool neg = getBit(v.bits, type->width - 1);
+            std::string s = neg? "-" + udecWords(negWords(v.bits, type->width)) : udecWords(v.bits);
+            return std::string(minStr.size() - std::min(minStr.size(), s.size()), ' ') + s;
+        }
+        case EvalType::ENUM:
+            for (const auto& tag : type->tags) {
+                if (std::get<1>(tag) == v.integer) return std::get<0>(tag);
+            }
+            unsupported();
+        default: unsupported();
+    }
+}
+
+// Parses an integer literal; sized literals become Bit#(n) sized literals
+static EvalValue parseIntLiteral(std::string s) {
+    replace(s, "_", "");
+    size_t quotePos = s.find("'");
+    uint32_t base = 10;
+    std::string digits = s;
+    int64_t width = -1;
+    if (quotePos != std::string::npos) {
+        if (quotePos > 0) {
+            if (quotePos > 6) unsupported();
+            width = std::stol(s.substr(0, quotePos));
+            if (width <= 0 || width > maxWidth) unsupported();
+        }
+        char baseChar = s[quotePos + 1];
+        base = (baseChar == 'b')? 2 : (baseChar == 'h')? 16 : 10;
+        digits = s.substr(quotePos + 2);
+    }
+    auto digitVal = [](char c) -> uint32_t {
+        if (c >= '0' && c <= '9') return c - '0';
+        return (std::tolower(c) - 'a') + 10;
+    };
+
+    if (width < 0) {
+        int64_t v = 0;
+        for (char c : digits) {
+            if (__builtin_mul_overflow(v, (int64_t) base, &v) ||
+                    __builtin_add_overflow(v, (int64_t) digitVal(c), &v)) unsupported();
+        }
+        return integerValue(v);
+    }
+
+    // Accumulate with some headroom to detect digits that don't fit in width
+    uint32_t accWidth = width + 8;
+    Words acc = zeroWords(accWidth);
+    Words baseWords = fromInt64(base, accWidth);
+    for (char c : digits) {
+        acc = addWords(mulWords(acc, baseWords, accWidth), fromInt64(digitVal(c), accWidth), accWidth);
+        for (uint32_t i = width; i < accWidth; i++) if (getBit(acc, i)) unsupported();
+    }
+    EvalValue res = bitsValue(makeType(EvalType::BIT, width), resizeWords(acc, accWidth, width, false));
+    res.sizedLiteral = true;
+    return res;
+}
+
+class Evaluator {
+    private:
+        // Package-level definitions
+        std::unordered_map<std::string, std::vector<MinispecParser::FunctionDefContext*>> functions;
+        std::unordered_map<std::string, MinispecParser::TypeDefSynonymContext*> synonyms;
+        std::unordered_map<std::string, MinispecParser::TypeDefStructContext*> structs;
+        std::unordered_map<std::string, MinispecParser::TypeDefEnumContext*> enums;
+        std::unordered_map<std::string, std::string> enumTags;  // tag -> enum name
+        std::unordered_map<std::string, ParserRuleContext*> globals;  // VarInitContext or LetBindingContext
+
+        std::unordered_map<std::string, EvalTypePtr> userTypes;
+        std::unordered_map<std::string, EvalValue> globalValues;
+        std::unordered_set<std::string> globalsInProgress;
+
+        struct Scope {
+            std::unordered_map<std::string, EvalValue> vars;
+            std::unordered_map<std::string, EvalTypePtr> types;
+        };
+
+        // Each function call (and global or typedef elaboration) gets its own frame
+        struct Frame {
+            std::vector<Scope> scopes;
+            EvalTypePtr returnType;
+            bool returned = false;
+            EvalValue returnValue;
+        };
+        std::vector<Frame> frames;
+        uint64_t steps = 0;
+
+        void step() {
+            if (++steps > maxSteps) unsupported();
+        }
+
+        template <typename F>
+        auto withFrame(Scope scope, EvalTypePtr returnType, F f) -> decltype(f()) {
+            if (frames.size() >= maxDepth) unsupported();
+            Frame frame;
+            frame.scopes.push_back(std::move(scope));
+            frame.returnType = returnType;
+            frames.push_back(std::move(frame));
+            struct FramePopper {
+                std::vector<Frame>& frames;
+                ~FramePopper() { frames.pop_back(); }
+            } popper{frames};
+            return f();
+        }
+
+        template <typename F>
+        void withScope(F f) {
+            frames.back().scopes.push_back(Scope());
+            struct ScopePopper {
+                std::vector<Frame>& frames;
+                ~ScopePopper() { frames.back().scopes.pop_back(); }
+            } popper{frames};
+            f();
+        }
+
+        EvalValue* findVar(const std::string& name) {
+            if (frames.empty()) return nullptr;
+            auto& scopes = frames.back().scopes;
+            for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+                auto varIt = it->vars.find(name);
+                if (varIt != it->vars.end()) return &varIt->second;
+            }
+            return nullptr;
+        }
+
+        EvalTypePtr findTypeParam(const std::string& name) {
+            if (frames.empty()) return nullptr;
+            auto& scopes = frames.back().scopes;
+            for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+                auto typeIt = it->types.find(name);
+                if (typeIt != it->types.end()) return typeIt->second;
+            }
+            return nullptr;
+        }
+
+        void declareVar(const std::string& name, const EvalValue& value) {
+            frames.back().scopes.back().vars[name] = value;
+        }
+
+        /* Types */
+
+        int64_t evalIntegerParam(MinispecParser::ParamContext* param) {
+            if (!param->intParam) unsupported();
+            EvalValue v = eval(param->intParam);
+            if (v.type->kind != EvalType::INTEGER) unsupported();
+            return v.integer;
+        }
+
+        EvalTypePtr resolveType(MinispecParser::TypeContext* ctx) {
+            std::string name = ctx->name->getText();
+            std::vector<MinispecParser::ParamContext*> params;
+            if (ctx->params()) params = ctx->params()->param();
+
+            if (auto typeParam = findTypeParam(name)) {
+                if (!params.empty()) unsupported();
+                return typeParam;
+            }
+
+            if (name == "Bit" || name == "Int" || name == "UInt") {
+                if (params.size() != 1) unsupported();
+                int64_t width = evalIntegerParam(params[0]);
+                if (width <= 0 || width > maxWidth) unsupported();
+                auto kind = (name == "Bit")? EvalType::BIT : (name == "Int")? EvalType::INT : EvalType::UINT;
+                return makeType(kind, width);
+            } else if (name == "Bool" || name == "Integer") {
+                if (!params.empty()) unsupported();
+                return makeType((name == "Bool")? EvalType::BOOL : EvalType::INTEGER);
+            } else if (name == "Vector") {
+                if (params.size() != 2 || !params[1]->type()) unsupported();
+                int64_t elems = evalIntegerParam(params[0]);
+                if (elems <= 0 || elems > maxElems) unsupported();
+                auto type = std::make_shared<EvalType>();
+                type->kind = EvalType::VECTOR;
+                type->width = elems;
+                type->elem = resolveType(params[1]->type());
+                return type;
+            }
+
+            auto synIt = synonyms.find(name);
+            if (synIt != synonyms.end()) {
+                auto synCtx = synIt->second;
+                // Typedefs are elaborated in their own frame, with their own params
+                Scope scope;
+                if (!bindParams(synCtx->typeId()->paramFormals(), params, scope)) unsupported();
+                return withFrame(std::move(scope), nullptr, [&]() { return resolveType(synCtx->type()); });
+            }
+
+            if (!params.empty()) unsupported();
+            return resolveUserType(name);
+        }
+
+        // Resolves non-parametric structs and enums (cached, as values hold pointers to their types)
+        EvalTypePtr resolveUserType(const std::string& name) {
+            auto typeIt = userTypes.find(name);
+            if (typeIt != userTypes.end()) return typeIt->second;
+
+            auto type = std::make_shared<EvalType>();
+            type->name = name;
+            if (structs.count(name)) {
+                auto structCtx = structs[name];
+                if (structCtx->typeId()->paramFormals()) unsupported();
+                type->kind = EvalType::STRUCT;
+                withFrame(Scope(), nullptr, [&]() {
+                    for (auto member : structCtx->structMember()) {
+                        type->fields.push_back(std::make_tuple(member->lowerCaseIdentifier()->getText(),
+                                    resolveType(member->type())));
+                    }
+                });
+            } else if (enums.count(name)) {
+                type->kind = EvalType::ENUM;
+                int64_t nextVal = 0;
+                int64_t maxVal = 0;
+                for (auto elem : enums[name]->typeDefEnumElement()) {
+                    if (elem->tagval) {
+                        EvalValue v = parseIntLiteral(elem->tagval->getText());
+                        if (v.type->kind != EvalType::INTEGER) unsupported();
+                        nextVal = v.integer;
+                    }
+                    if (nextVal < 0 || nextVal >= (1l << 32)) unsupported();
+                    type->tags.push_back(std::make_tuple(elem->tag->getText(), nextVal));
+                    maxVal = std::max(maxVal, nextVal);
+                    nextVal++;
+                }
+                while ((maxVal >> type->width) != 0) type->width++;
+            } else {
+                unsupported();
+            }
+            userTypes[name] = type;
+            return type;
+        }
+
+        // Binds formals to the (caller-evaluated) params. Returns false if a
+        // specialized formal does not match.
+        bool bindParams(MinispecParser::ParamFormalsContext* formalsCtx,
+                const std::vector<MinispecParser::ParamContext*>& params, Scope& scope) {
+            auto formals = formalsCtx? formalsCtx->paramFormal() : std::vector<MinispecParser::ParamFormalContext*>();
+            if (formals.size() != params.size()) unsupported();
+            std::vector<Scope> bound;
+            for (size_t i = 0; i < formals.size(); i++) {
+                auto formal = formals[i];
+                auto param = params[i];
+                if (formal->intName) {
+                    if (!formal->type() || formal->type()->getText() != "Integer") unsupported();
+                    scope.vars[formal->intName->getText()] = integerValue(evalIntegerParam(param));
+                } else if (formal->typeName) {
+                    if (!param->type()) unsupported();
+                    scope.types[formal->typeName->getText()] = resolveType(param->type());
+                } else {
+                    auto spec = formal->param();
+                    if (spec->type() && param->type()) {
+                        if (!sameType(resolveType(spec->type()), resolveType(param->type()))) return false;
+                    } else if (spec->intParam && param->intParam) {
+                        if (evalIntegerParam(spec) != evalIntegerParam(param)) return false;
+                    } else {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /* Globals */
+
+        bool getGlobal(const std::string& name, EvalValue& value) {
+            auto valueIt = globalValues.find(name);
+            if (valueIt != globalValues.end()) {
+                value = valueIt->second;
+                return true;
+            }
+            auto it = globals.find(name);
+            if (it == globals.end()) return false;
+            if (globalsInProgress.count(name)) unsupported();
+            globalsInProgress.insert(name);
+            auto ctx = it->second;
+            value = withFrame(Scope(), nullptr, [&]() {
+                if (auto varInit = dynamic_cast<MinispecParser::VarInitContext*>(ctx)) {
+                    auto binding = dynamic_cast<MinispecParser::VarBindingContext*>(varInit->parent);
+                    if (!binding || !varInit->rhs) unsupported();
+                    auto type = resolveType(binding->type());
+                    return convert(eval(varInit->rhs, type), type);
+                }
+                auto letBinding = dynamic_cast<MinispecParser::LetBindingContext*>(ctx);
+                if (!letBinding || !letBinding->rhs || letBinding->lowerCaseIdentifier().size() != 1) unsupported();
+                return eval(letBinding->rhs);
+            });
+            globalsInProgress.erase(name);
+            globalValues[name] = value;
+            return true;
+        }
+
+        /* Expressions */
+
+        EvalValue evalBinop(MinispecParser::BinopExprContext* ctx, const EvalTypePtr& expected) {
+            step();
+            if (ctx->unopExpr()) return evalUnop(ctx->unopExpr(), expected);
+            std::string op = ctx->op->getText();
+
+            if (op == "&&" || op == "||") {
+                EvalValue l = evalBinop(ctx->left, nullptr);
+                if (l.type->kind != EvalType::BOOL || !l.valid) unsupported();
+                // Expressions have no side effects, so short-circuiting is safe
+                if (l.integer == (op == "||")) return l;
+                EvalValue r = evalBinop(ctx->right, nullptr);
+                if (r.type->kind != EvalType::BOOL || !r.valid) unsupported();
+                return r;
+            }
+
+            bool isShift = (op == "<<" || op == ">>");
+            bool isArith = !isShift && (op == "+" || op == "-" || op == "*" || op == "/" || op == "%" ||
+                    op == "**" || op == "&" || op == "|" || op == "^" || op == "^~" || op == "~^");
+            EvalValue l = evalBinop(ctx->left, (isArith || isShift)? expected : nullptr);
+            EvalTypePtr rightExpected = isShift? nullptr : (l.type->kind != EvalType::INTEGER && !l.sizedLiteral)?
+                l.type : isArith? expected : nullptr;
+            EvalValue r = evalBinop(ctx->right, rightExpected);
+            if (!l.isFullyValid() || !r.isFullyValid()) unsupported();
+
+            if (l.type->kind == EvalType::INTEGER && r.type->kind == EvalType::INTEGER) {
+                return evalIntegerBinop(op, l.integer, r.integer);
+            }
+
+            if (op == "==") return boolValue(equals(l, r));
+            if (op == "!=") return boolValue(!equals(l, r));
+
+            if (isShift) {
+                // The amount is unsigned; the shifted value takes its type from context
+                if (l.type->kind == EvalType::INTEGER) {
+                    if (!expected || !expected->isBits()) unsupported();
+                    l = convert(l, expected);
+                }
+                if (!l.type->isBits()) unsupported();
+                uint64_t shift;
+                if (r.type->kind == EvalType::INTEGER) {
+                    if (r.integer < 0) unsupported();
+                    shift = r.integer;
+                } else if (r.type->kind == EvalType::BIT || r.type->kind == EvalType::UINT) {
+                    int64_t v;
+                    shift = wordsToInt64(r.bits, r.type->width, false, v)? v : ~0ul;
+                } else {
+                    unsupported();
+                }
+                uint32_t width = l.type->width;
+                Words res = (op == "<<")? shlWords(l.bits, std::min(shift, (uint64_t) width), width) :
+                    shrWords(l.bits, shift, width, l.type->kind == EvalType::INT);
+                EvalValue resValue = bitsValue(l.type, res);
+                resValue.sizedLiteral = l.sizedLiteral;
+                return resValue;
+            }
+
+            unify(l, r);
+            if (!l.type->isBits()) unsupported();
+            const auto& type = l.type;
+            uint32_t width = type->width;
+            bool isSigned = type->kind == EvalType::INT;
+            const Words& a = l.bits;
+            const Words& b = r.bits;
+
+            if (op == "<" || op == "<=" || op == ">" || op == ">=") {
+                int cmp = isSigned? scmpWords(a, b, width) : ucmpWords(a, b);
+                if (op == "<") return boolValue(cmp < 0);
+                if (op == "<=") return boolValue(cmp <= 0);
+                if (op == ">") return boolValue(cmp > 0);
+                return boolValue(cmp >= 0);
+            }
+
+            Words res;
+            if (op == "+") res = addWords(a, b, width);
+            else if (op == "-") res = subWords(a, b, width);
+            else if (op == "*") res = mulWords(a, b, width);
+            else if (op == "/" || op == "%") {
+                if (isZero(b)) unsupported();
+                bool aNeg = isSigned && getBit(a, width - 1);
+                bool bNeg = isSigned && getBit(b, width - 1);
+                Words quot, rem;
+                udivmodWords(aNeg? negWords(a, width) : a, bNeg? negWords(b, width) : b, width, quot, rem);
+                // Signed division truncates toward zero; the remainder takes the dividend's sign
+                if (op == "/") res = (aNeg != bNeg)? negWords(quot, width) : quot;
+                else res = aNeg? negWords(rem, width) : rem;
+                // Overflow (most negative value / -1)
+                if (isSigned && op == "/" && aNeg && bNeg && getBit(res, width - 1)) unsupported();
+            } else if (op == "&" || op == "|" || op == "^" || op == "^~" || op == "~^") {
+                res = zeroWords(width);
+                for (size_t i = 0; i < res.size(); i++) {
+                    if (op == "&") res[i] = a[i] & b[i];
+                    else if (op == "|") res[i] = a[i] | b[i];
+                    else if (op == "^") res[i] = a[i] ^ b[i];
+                    else res[i] = ~(a[i] ^ b[i]);
+                }
+                clearHighBits(res, width);
+            } else {
+                unsupported();
+            }
+            EvalValue resValue = bitsValue(type, res);
+            resValue.sizedLiteral = l.sizedLiteral && r.sizedLiteral;
+            return resValue;
+        }
+
+        // Mirrors the elaborator's Integer operators, but gives up on overflow
+        EvalValue evalIntegerBinop(const std::string& op, int64_t l, int64_t r) {
+            int64_t res;
+            if (op == "+") { if (__builtin_add_overflow(l, r, &res)) unsupported(); }
+            else if (op == "-") { if (__builtin_sub_overflow(l, r, &res)) unsupported(); }
+            else if (op == "*") { if (__builtin_mul_overflow(l, r, &res)) unsupported(); }
+            else if (op == "/" || op == "%") {
+                // bsc errors on division by zero, and its Integer division
+                // and modulo round toward negative infinity
+                if (r == 0 || (l == INT64_MIN && r == -1)) unsupported();
+                int64_t quot = l / r, rem = l % r;
+                if (rem != 0 && ((rem < 0) != (r < 0))) { quot--; rem += r; }
+                res = (op == "/")? quot : rem;
+            } else if (op == "**") {
+                if (r < 0) unsupported();
+                res = 1;
+                while (r-- > 0) {
+                    step();
+                    if (__builtin_mul_overflow(res, l, &res)) unsupported();
+                }
+            } else if (op == "<<") {
+                if (r < 0 || r >= 63) unsupported();
+                res = (int64_t) ((uint64_t) l << r);
+                if ((res >> r) != l) unsupported();
+            } else if (op == ">>") {
+                if (r < 0 || r >= 63) unsupported();
+                res = l >> r;
+            }
+            else if (op == "&") res = l & r;
+            else if (op == "|") res = l | r;
+            else if (op == "^") res = l ^ r;
+            else if (op == "^~" || op == "~^") res = ~l ^ r;
+            else if (op == "<") return boolValue(l < r);
+            else if (op == "<=") return boolValue(l <= r);
+            else if (op == ">") return boolValue(l > r);
+            else if (op == ">=") return boolValue(l >= r);
+            else if (op == "==") return boolValue(l == r);
+            else if (op == "!=") return boolValue(l != r);
+            else unsupported();
+            return integerValue(res);
+        }
+
+        EvalValue evalUnop(MinispecParser::UnopExprContext* ctx, const EvalTypePtr& expected) {
+            if (!ctx->op) return evalPrimary(ctx->exprPrimary(), expected);
+            std::string op = ctx->op->getText();
+            bool keepsType = (op == "~" || op == "+" || op == "-");
+            EvalValue v = evalPrimary(ctx->exprPrimary(), keepsType? expected : nullptr);
+            if (!v.isFullyValid()) unsupported();
+            const auto& type = v.type;
+
+            if (type->kind == EvalType::INTEGER) {
+                int64_t i = v.integer;
+                int64_t parity = __builtin_parityl(i);
+                if (op == "~") return integerValue(~i);
+                if (op == "&") return integerValue((i == -1)? 1 : 0);
+                if (op == "~&") return integerValue((i == -1)? 0 : 1);
+                if (op == "|") return integerValue((i == 0)? 0 : 1);
+                if (op == "~|") return integerValue((i == 0)? 1 : 0);
+                if (op == "^") return integerValue(parity);
+                if (op == "^~" || op == "~^") return integerValue((parity == 0)? 1 : 0);
+                if (op == "+") return v;
+                if (op == "-" && i != INT64_MIN) return integerValue(-i);
+                unsupported();
+            }
+
+            if (type->kind == EvalType::BOOL) {
+                if (op != "!") unsupported();
+                return boolValue(!v.integer);
+            }
+
+            if (!type->isBits()) unsupported();
+            uint32_t width = type->width;
+            if (keepsType) {
+                EvalValue res = v;
+                if (op == "~") res.bits = notWords(v.bits, width);
+                else if (op == "-") res.bits = negWords(v.bits, width);
+                return res;
+            }
+
+            // Reduction operators
+            if (type->kind != EvalType::BIT || op == "!") unsupported();
+            bool andRed = (v.bits == notWords(zeroWords(width), width));
+            bool orRed = !isZero(v.bits);
+            bool xorRed = false;
+            for (uint64_t w : v.bits) xorRed ^= __builtin_parityl(w);
+            bool res;
+            if (op == "&") res = andRed;
+            else if (op == "~&") res = !andRed;
+            else if (op == "|") res = orRed;
+            else if (op == "~|") res = !orRed;
+            else if (op == "^") res = xorRed;
+            else res = !xorRed;
+            return bitsValue(makeType(EvalType::BIT, 1), fromInt64(res, 1));
+        }
+
+        EvalValue evalPrimary(MinispecParser::ExprPrimaryContext* ctx, const EvalTypePtr& expected) {
+            step();
+            if (auto parenCtx = dynamic_cast<MinispecParser::ParenExprContext*>(ctx)) {
+                return eval(parenCtx->expression(), expected);
+            } else if (auto fieldCtx = dynamic_cast<MinispecParser::FieldExprContext*>(ctx)) {
+                EvalValue base = evalPrimary(fieldCtx->exprPrimary(), nullptr);
+                if (base.type->kind != EvalType::STRUCT) unsupported();
+                std::string field = fieldCtx->field->getText();
+                for (size_t i = 0; i < base.type->fields.size(); i++) {
+                    if (std::get<0>(base.type->fields[i]) == field) return base.elems[i];
+                }
+                unsupported();
+            } else if (auto varCtx = dynamic_cast<MinispecParser::VarExprContext*>(ctx)) {
+                if (varCtx->params()) unsupported();
+                std::string name = varCtx->var->getText();
+                if (name == "True" || name == "False") return boolValue(name == "True");
+                if (auto var = findVar(name)) {
+                    if (!var->isFullyValid()) unsupported();
+                    return *var;
+                }
+                auto tagIt = enumTags.find(name);
+                if (tagIt != enumTags.end()) {
+                    EvalValue res;
+                    res.type = resolveUserType(tagIt->second);
+                    for (const auto& tag : res.type->tags) {
+                        if (std::get<0>(tag) == name) res.integer = std::get<1>(tag);
+                    }
+                    return res;
+                }
+                EvalValue global;
+                if (getGlobal(name, global)) return global;
+                unsupported();
+            } else if (auto intCtx = dynamic_cast<MinispecParser::IntLiteralContext*>(ctx)) {
+                return parseIntLiteral(intCtx->getText());
+            } else if (auto concatCtx = dynamic_cast<MinispecParser::BitConcatContext*>(ctx)) {
+                std::vector<EvalValue> values;
+                uint64_t width = 0;
+                for (auto e : concatCtx->expression()) {
+                    values.push_back(eval(e));
+                    const auto& v = values.back();
+                    if (v.type->kind != EvalType::BIT || !v.valid) unsupported();
+                    width += v.type->width;
+                }
+                if (width > maxWidth) unsupported();
+                Words res = zeroWords(width);
+                uint32_t pos = width;
+                for (const auto& v : values) {
+                    pos -= v.type->width;
+                    packInto(v, res, pos);
+                }
+                return bitsValue(makeType(EvalType::BIT, width), res);
+            } else if (auto sliceCtx = dynamic_cast<MinispecParser::SliceExprContext*>(ctx)) {
+                EvalValue base = evalPrimary(sliceCtx->array, nullptr);
+                if (!base.isFullyValid()) unsupported();
+                if (!sliceCtx->lsb) {
+                    int64_t idx = getIndex(eval(sliceCtx->msb));
+                    if (idx < 0 || idx >= base.type->width) unsupported();
+                    if (base.type->kind == EvalType::VECTOR) return base.elems[idx];
+                    if (base.type->kind != EvalType::BIT) unsupported();
+                    return bitsValue(makeType(EvalType::BIT, 1), fromInt64(getBit(base.bits, idx), 1));
+                }
+                // Ranges need elaboration-time bounds to have a known width
+                EvalValue msb = eval(sliceCtx->msb);
+                EvalValue lsb = eval(sliceCtx->lsb);
+                if (base.type->kind != EvalType::BIT || msb.type->kind != EvalType::INTEGER ||
+                        lsb.type->kind != EvalType::INTEGER) unsupported();
+                if (lsb.integer < 0 || msb.integer < lsb.integer || msb.integer >= base.type->width) unsupported();
+                uint32_t width = msb.integer - lsb.integer + 1;
+                return bitsValue(makeType(EvalType::BIT, width), resizeWords(
+                            shrWords(base.bits, lsb.integer, base.type->width, false), base.type->width, width, false));
+            } else if (auto callCtx = dynamic_cast<MinispecParser::CallExprContext*>(ctx)) {
+                return evalCall(callCtx, expected);
+            } else if (auto structCtx = dynamic_cast<MinispecParser::StructExprContext*>(ctx)) {
+                auto type = resolveType(structCtx->type());
+                if (type->kind != EvalType::STRUCT) unsupported();
+                EvalValue res = undefinedValue(type);
+                std::vector<bool> bound(type->fields.size(), false);
+                for (auto bind : structCtx->memberBinds()->memberBind()) {
+                    std::string field = bind->field->getText();
+                    size_t i = 0;
+                    while (i < type->fields.size() && std::get<0>(type->fields[i]) != field) i++;
+                    if (i == type->fields.size() || bound[i]) unsupported();
+                    const auto& fieldType = std::get<1>(type->fields[i]);
+                    res.elems[i] = convert(eval(bind->expression(), fieldType), fieldType);
+                    bound[i] = true;
+                }
+                for (bool b : bound) if (!b) unsupported();
+                return res;
+            }
+            // Strings, don't-care values, and returns outside statements
+            unsupported();
+        }
+
+        EvalValue evalCall(MinispecParser::CallExprContext* ctx, const EvalTypePtr& expected) {
+            auto fcnCtx = dynamic_cast<MinispecParser::VarExprContext*>(ctx->fcn);
+            if (!fcnCtx) unsupported();
+            std::string name = fcnCtx->var->getText();
+            auto args = ctx->expression();
+
+            if (!functions.count(name)) {
+                // Builtins
+                if (fcnCtx->params() || args.size() != 1) unsupported();
+                if (name == "zeroExtend" || name == "signExtend" || name == "truncate") {
+                    EvalValue v = eval(args[0]);
+                    if (!expected || !v.type->isBits() || !v.valid || v.sizedLiteral) unsupported();
+                    if (expected->kind != v.type->kind) unsupported();
+                    bool extend = (name != "truncate");
+                    if (extend? (expected->width < v.type->width) : (expected->width > v.type->width)) unsupported();
+                    return bitsValue(expected, resizeWords(v.bits, v.type->width, expected->width, name == "signExtend"));
+                } else if (name == "pack") {
+                    EvalValue v = eval(args[0]);
+                    if (!v.isFullyValid() || v.type->kind == EvalType::INTEGER || v.sizedLiteral) unsupported();
+                    uint32_t width = packedWidth(v.type);
+                    if (width == 0) unsupported();
+                    Words res = zeroWords(width);
+                    packInto(v, res, 0);
+                    return bitsValue(makeType(EvalType::BIT, width), res);
+                } else if (name == "unpack") {
+                    EvalValue v = eval(args[0]);
+                    if (!expected || !v.isFullyValid() || v.type->kind != EvalType::BIT) unsupported();
+                    if (packedWidth(expected) != v.type->width) unsupported();
+                    return unpackFrom(expected, v.bits, 0);
+                } else if (name == "fromInteger") {
+                    EvalValue v = eval(args[0]);
+                    if (!expected || v.type->kind != EvalType::INTEGER) unsupported();
+                    return convert(v, expected);
+                } else if (name == "log2") {
+                    EvalValue v = eval(args[0]);
+                    if (v.type->kind != EvalType::INTEGER || v.integer <= 0) unsupported();
+                    int64_t res = 0;
+                    while ((1l << res) < v.integer) res++;
+                    return integerValue(res);
+                }
+                unsupported();
+            }
+
+            // Pick the function definition; with params, the most specialized match
+            std::vector<MinispecParser::ParamContext*> params;
+            if (fcnCtx->params()) params = fcnCtx->params()->param();
+            MinispecParser::FunctionDefContext* def = nullptr;
+            Scope scope;
+            int64_t bestSpecialized = -1;
+            for (auto candidate : functions[name]) {
+                auto formalsCtx = candidate->functionId()->paramFormals();
+                if (!formalsCtx) {
+                    if (!params.empty()) continue;
+                    if (def) unsupported();
+                    def = candidate;
+                    continue;
+                }
+                if (formalsCtx->paramFormal().size() != params.size()) continue;
+                Scope candScope;
+                if (!bindParams(formalsCtx, params, candScope)) continue;
+                int64_t specialized = 0;
+                for (auto formal : formalsCtx->paramFormal()) specialized += (formal->param() != nullptr);
+                if (specialized == bestSpecialized) unsupported();
+                if (specialized > bestSpecialized) {
+                    bestSpecialized = specialized;
+                    def = candidate;
+                    scope = std::move(candScope);
+                }
+            }
+            if (!def) unsupported();
+
+            // Resolve the signature with the function's params
+            std::vector<std::tuple<std::string, EvalTypePtr>> formals;
+            EvalTypePtr returnType = withFrame(scope, nullptr, [&]() {
+                if (def->argFormals()) {
+                    for (auto formal : def->argFormals()->argFormal()) {
+                        formals.push_back(std::make_tuple(formal->argName->getText(), resolveType(formal->type())));
+                    }
+                }
+                return resolveType(def->type());
+            });
+            if (formals.size() != args.size()) unsupported();
+
+            // Evaluate args in the caller's frame
+            for (size_t i = 0; i < args.size(); i++) {
+                const auto& argType = std::get<1>(formals[i]);
+                scope.vars[std::get<0>(formals[i])] = convert(eval(args[i], argType), argType);
+            }
+
+            return withFrame(std::move(scope), returnType, [&]() {
+                if (def->expression()) return convert(eval(def->expression(), returnType), returnType);
+                for (auto stmt : def->stmt()) {
+                    exec(stmt);
+                    if (frames.back().returned) break;
+                }
+                if (!frames.back().returned) unsupported();
+                return frames.back().returnValue;
+            });
+        }
+
+        /* Statements */
+
+        void execScoped(MinispecParser::StmtContext* ctx) {
+            withScope([&]() { exec(ctx); });
+        }
+
+        void exec(MinispecParser::StmtContext* ctx) {
+            step();
+            if (frames.back().returned) return;
+            if (auto varDecl = ctx->varDecl()) {
+                if (auto binding = dynamic_cast<MinispecParser::VarBindingContext*>(varDecl)) {
+                    auto type = resolveType(binding->type());
+                    for (auto varInit : binding->varInit()) {
+                        EvalValue v = varInit->rhs? convert(eval(varInit->rhs, type), type) : undefinedValue(type);
+                        declareVar(varInit->var->getText(), v);
+                    }
+                } else {
+                    auto letBinding = dynamic_cast<MinispecParser::LetBindingContext*>(varDecl);
+                    if (!letBinding || !letBinding->rhs || letBinding->lowerCaseIdentifier().size() != 1) unsupported();
+                    EvalValue v = eval(letBinding->rhs);
+                    if (!v.isFullyValid()) unsupported();
+                    declareVar(letBinding->lowerCaseIdentifier(0)->getText(), v);
+                }
+            } else if (auto varAssign = ctx->varAssign()) {
+                if (varAssign->vars) unsupported();
+                assign(varAssign->var, varAssign->expression());
+            } else if (auto block = ctx->beginEndBlock()) {
+                withScope([&]() {
+                    for (auto stmt : block->stmt()) {
+                        exec(stmt);
+                        if (frames.back().returned) break;
+                    }
+                });
+            } else if (auto ifStmt = ctx->ifStmt()) {
+                EvalValue cond = eval(ifStmt->expression());
+                if (cond.type->kind != EvalType::BOOL || !cond.valid) unsupported();
+                if (cond.integer) execScoped(ifStmt->stmt(0));
+                else if (ifStmt->stmt().size() > 1) execScoped(ifStmt->stmt(1));
+            } else if (auto caseStmt = ctx->caseStmt()) {
+                EvalValue subject = eval(caseStmt->expression());
+                for (auto item : caseStmt->caseStmtItem()) {
+                    for (auto e : item->expression()) {
+                        if (equals(subject, eval(e, subject.type))) {
+                            execScoped(item->stmt());
+                            return;
+                        }
+                    }
+                }
+                if (caseStmt->caseStmtDefaultItem()) execScoped(caseStmt->caseStmtDefaultItem()->stmt());
+            } else if (auto forStmt = ctx->forStmt()) {
+                std::string varName = forStmt->initVar->getText();
+                if (forStmt->updVar->getText() != varName) unsupported();
+                withScope([&]() {
+                    auto type = resolveType(forStmt->type());
+                    declareVar(varName, convert(eval(forStmt->expression(0), type), type));
+                    while (true) {
+                        step();
+                        EvalValue cond = eval(forStmt->expression(1));
+                        if (cond.type->kind != EvalType::BOOL || !cond.valid) unsupported();
+                        if (!cond.integer) break;
+                        execScoped(forStmt->stmt());
+                        if (frames.back().returned) break;
+                        EvalValue upd = convert(eval(forStmt->expression(2), type), type);
+                        *findVar(varName) = upd;
+                    }
+                });
+            } else if (auto retCtx = dynamic_cast<MinispecParser::ReturnExprContext*>(ctx->exprPrimary())) {
+                EvalTypePtr returnType = frames.back().returnType;
+                if (!returnType) unsupported();
+                EvalValue v = convert(eval(retCtx->expression(), returnType), returnType);
+                frames.back().returnValue = v;
+                frames.back().returned = true;
+            } else {
+                // Register writes and other expression statements
+                unsupported();
+            }
+        }
+
+        struct LvalueStep {
+            std::string field;  // empty for indexes and slices
+            int64_t msb, lsb;
+        };
+
+        void getLvaluePath(MinispecParser::LvalueContext* ctx, std::string& var, std::vector<LvalueStep>& path) {
+            if (auto simpleCtx = dynamic_cast<MinispecParser::SimpleLvalueContext*>(ctx)) {
+                var = simpleCtx->lowerCaseIdentifier()->getText();
+            } else if (auto memberCtx = dynamic_cast<MinispecParser::MemberLvalueContext*>(ctx)) {
+                getLvaluePath(memberCtx->lvalue(), var, path);
+                path.push_back({memberCtx->lowerCaseIdentifier()->getText(), 0, 0});
+            } else if (auto indexCtx = dynamic_cast<MinispecParser::IndexLvalueContext*>(ctx)) {
+                getLvaluePath(indexCtx->lvalue(), var, path);
+                int64_t idx = getIndex(eval(indexCtx->index));
+                path.push_back({"", idx, idx});
+            } else if (auto sliceCtx = dynamic_cast<MinispecParser::SliceLvalueContext*>(ctx)) {
+                getLvaluePath(sliceCtx->lvalue(), var, path);
+                EvalValue msb = eval(sliceCtx->msb);
+                EvalValue lsb = eval(sliceCtx->lsb);
+                if (msb.type->kind != EvalType::INTEGER || lsb.type->kind != EvalType::INTEGER) unsupported();
+                path.push_back({"", msb.integer, lsb.integer});
+            } else {
+                unsupported();
+            }
+        }
+
+        // Follows path from var. If the last step selects bits, returns the
+        // Bits value that holds them and sets bitsStep.
+        EvalValue& followLvaluePath(const std::string& var, const std::vector<LvalueStep>& path, const LvalueStep*& bitsStep) {
+            EvalValue* v = findVar(var);
+            if (!v) unsupported();  // e.g., a global
+            bitsStep = nullptr;
+            for (size_t i = 0; i < path.size(); i++) {
+                const auto& s = path[i];
+                const auto& type = v->type;
+                if (!s.field.empty()) {
+                    if (type->kind != EvalType::STRUCT) unsupported();
+                    size_t f = 0;
+                    while (f < type->fields.size() && std::get<0>(type->fields[f]) != s.field) f++;
+                    if (f == type->fields.size()) unsupported();
+                    v = &v->elems[f];
+                } else if (type->kind == EvalType::VECTOR && s.msb == s.lsb) {
+                    if (s.msb < 0 || s.msb >= type->width) unsupported();
+                    v = &v->elems[s.msb];
+                } else if (type->kind == EvalType::BIT && i == path.size() - 1) {
+                    if (s.lsb < 0 || s.msb < s.lsb || s.msb >= type->width) unsupported();
+                    bitsStep = &s;
+                } else {
+                    unsupported();
+                }
+            }
+            return *v;
+        }
+
+        void assign(MinispecParser::LvalueContext* ctx, MinispecParser::ExpressionContext* rhs) {
+            std::string var;
+            std::vector<LvalueStep> path;
+            getLvaluePath(ctx, var, path);
+
+            // Find the target type, then evaluate the rhs, then write (the rhs
+            // may call functions, so don't hold references across it)
+            const LvalueStep* bitsStep;
+            EvalTypePtr type = followLvaluePath(var, path, bitsStep).type;
+            if (bitsStep) type = makeType(EvalType::BIT, bitsStep->msb - bitsStep->lsb + 1);
+            EvalValue v = convert(eval(rhs, type), type);
+
+            EvalValue& target = followLvaluePath(var, path, bitsStep);
+            if (bitsStep) {
+                if (!target.valid) unsupported();
+                for (int64_t i = bitsStep->lsb; i <= bitsStep->msb; i++) setBit(target.bits, i, getBit(v.bits, i - bitsStep->lsb));
+            } else {
+                target = v;
+            }
+        }
+
+    public:
+        Evaluator(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees) {
+            for (auto tree : parsedTrees) {
+                for (auto stmt : tree->packageStmt()) {
+                    if (auto functionDef = stmt->functionDef()) {
+                        functions[functionDef->functionId()->name->getText()].push_back(functionDef);
+                    } else if (auto typeDecl = stmt->typeDecl()) {
+                        if (auto synCtx = typeDecl->typeDefSynonym()) {
+                            synonyms[synCtx->typeId()->name->getText()] = synCtx;
+                        } else if (auto structCtx = typeDecl->typeDefStruct()) {
+                            structs[structCtx->typeId()->name->getText()] = structCtx;
+                        } else if (auto enumCtx = typeDecl->typeDefEnum()) {
+                            std::string enumName = enumCtx->upperCaseIdentifier()->getText();
+                            enums[enumName] = enumCtx;
+                            for (auto elem : enumCtx->typeDefEnumElement()) enumTags[elem->tag->getText()] = enumName;
+                        }
+                    } else if (auto varDecl = stmt->varDecl()) {
+                        if (auto binding = dynamic_cast<MinispecParser::VarBindingContext*>(varDecl)) {
+                            for (auto varInit : binding->varInit()) globals[varInit->var->getText()] = varInit;
+                        } else if (auto letBinding = dynamic_cast<MinispecParser::LetBindingContext*>(varDecl)) {
+                            for (auto id : letBinding->lowerCaseIdentifier()) globals[id->getText()] = letBinding;
+                        }
+                    }
+                }
+            }
+        }
+
+        EvalValue eval(MinispecParser::ExpressionContext* ctx, const EvalTypePtr& expected = nullptr) {
+            step();
+            if (auto condCtx = dynamic_cast<MinispecParser::CondExprContext*>(ctx)) {
+                EvalValue pred = eval(condCtx->pred);
+                if (pred.type->kind != EvalType::BOOL || !pred.valid) unsupported();
+                return eval(condCtx->expression(pred.integer? 1 : 2), expected);
+            } else if (auto caseCtx = dynamic_cast<MinispecParser::CaseExprContext*>(ctx)) {
+                EvalValue subject = eval(caseCtx->expression());
+                MinispecParser::ExpressionContext* defaultBody = nullptr;
+                for (auto item : caseCtx->caseExprItem()) {
+                    if (item->exprPrimary().empty()) defaultBody = item->body;
+                    for (auto e : item->exprPrimary()) {
+                        if (equals(subject, evalPrimary(e, subject.type))) return eval(item->body, expected);
+                    }
+                }
+                // Without a match, the value is unspecified
+                if (!defaultBody) unsupported();
+                return eval(defaultBody, expected);
+            } else if (auto opCtx = dynamic_cast<MinispecParser::OperatorExprContext*>(ctx)) {
+                return evalBinop(opCtx->binopExpr(), expected);
+            }
+            unsupported();
+        }
+
+        EvalValue evalTop(MinispecParser::ExpressionContext* ctx) {
+            return withFrame(Scope(), nullptr, [&]() { return eval(ctx); });
+        }
+};
+
+bool evalNatively(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees,
+        const std::vector<std::string>& exprs, std::vector<std::string>& results) {
+    // Find the expressions in Eval___ (see getEvalModuleCode())
+    std::vector<MinispecParser::ExpressionContext*> exprCtxs;
+    for (auto tree : parsedTrees) {
+        for (auto stmt : tree->packageStmt()) {
+            auto moduleDef = stmt->moduleDef();
+            if (!moduleDef || moduleDef->moduleId()->name->getText() != "Eval___") continue;
+            for (auto moduleStmt : moduleDef->moduleStmt()) {
+                if (!moduleStmt->ruleDef()) continue;
+                for (auto ruleStmt : moduleStmt->ruleDef()->stmt()) {
+                    auto letBinding = dynamic_cast<MinispecParser::LetBindingContext*>(ruleStmt->varDecl());
+                    if (letBinding) exprCtxs.push_back(letBinding->rhs);
+                }
+            }
+        }
+    }
+    if (exprCtxs.size() != exprs.size()) return false;
+
+    // All or nothing: if any expression needs bsc, all of them go through bsc
+    Evaluator evaluator(parsedTrees);
+    std::vector<std::string> evalResults;
+    try {
+        for (size_t i = 0; i < exprs.size(); i++) {
+            evalResults.push_back(getEvalLabel(exprs[i]) + " = " + formatValue(evaluator.evalTop(exprCtxs[i])));
+        }
+    } catch (const EvalUnsupported&) {
+        return false;
+    }
+    results = evalResults;
+    return true;
+}
@@ -0,0 +1,40 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "MinispecParser.h"
+
+// Expression evaluation (msc --eval)
+
+// Returns the Minispec code of module Eval___, which evaluates exprs in a
+// single rule and displays one "<expr> = <value>" line per expression. If
+// importName is not empty, the module imports that file.
+std::string getEvalModuleCode(const std::string& importName, const std::vector<std::string>& exprs);
+
+// Evaluates the expressions of the Eval___ module in parsedTrees within msc,
+// without bsc. Values are computed bit-accurately and formatted like
+// Bluesim's $display of fshow() would. On success, returns true and fills
+// results with one "<expr> = <value>" line per expression. Returns false if
+// any expression needs something the evaluator does not support (e.g., a
+// Bluespec library function, or printing a value whose format bsc picks), in
+// which case the caller should compile and simulate Eval___ instead.
+bool evalNatively(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees,
+        const std::vector<std::string>& exprs, std::vector<std::string>& results);
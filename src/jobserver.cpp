@@ -0,0 +1,106 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <sstream>
+#include <unistd.h>
+#include "jobserver.h"
+
+JobServer::JobServer(int readFd, int writeFd) : readFd(readFd), writeFd(writeFd), owner(getpid()) {}
+
+// Opens a private, non-blocking file description for fd, so that reads never
+// block and other jobserver clients sharing the pipe are not affected
+static int openNonBlocking(int fd) {
+    if (fcntl(fd, F_GETFD) == -1) return -1;  // make did not pass it to us
+    return open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static JobServer* jobServer = nullptr;
+
+static void releaseJobServerTokens() {
+    if (jobServer) jobServer->releaseAll();
+}
+
+JobServer* JobServer::get() {
+    static bool initialized = false;
+    if (initialized) return jobServer;
+    initialized = true;
+
+    const char* makeFlags = getenv("MAKEFLAGS");
+    if (!makeFlags) return nullptr;
+    // Use the last jobserver option, as make does (older makes use
+    // --jobserver-fds)
+    std::string auth;
+    std::istringstream iss(makeFlags);
+    for (std::string flag; iss >> flag; ) {
+        for (std::string prefix : {"--jobserver-auth=", "--jobserver-fds="})
+            if (flag.compare(0, prefix.size(), prefix) == 0) auth = flag.substr(prefix.size());
+    }
+    if (auth.empty()) return nullptr;
+
+    int readFd = -1, writeFd = -1;
+    if (auth.compare(0, 5, "fifo:") == 0) {
+        readFd = open(auth.substr(5).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        writeFd = readFd;
+    } else {
+        size_t comma = auth.find(',');
+        if (comma == std::string::npos) return nullptr;
+        int r = atoi(auth.substr(0, comma).c_str());
+        int w = atoi(auth.substr(comma + 1).c_str());
+        if (r < 0 || w < 0 || fcntl(w, F_GETFD) == -1) return nullptr;
+        readFd = openNonBlocking(r);
+        writeFd = w;
+    }
+    if (readFd == -1) return nullptr;
+    jobServer = new JobServer(readFd, writeFd);
+    atexit(releaseJobServerTokens);
+    return jobServer;
+}
+
+size_t JobServer::getNumTokens() {
+    // A forked child starts without tokens; its parent holds and returns them
+    if (owner != getpid()) {
+        owner = getpid();
+        tokens.clear();
+    }
+    return tokens.size();
+}
+
+bool JobServer::tryAcquire() {
+    getNumTokens();
+    char token;
+    ssize_t bytes;
+    while ((bytes = read(readFd, &token, 1)) == -1 && errno == EINTR);
+    if (bytes != 1) return false;
+    tokens.push_back(token);
+    return true;
+}
+
+void JobServer::release() {
+    if (!getNumTokens()) return;
+    char token = tokens.back();
+    while (write(writeFd, &token, 1) == -1 && errno == EINTR);
+    tokens.pop_back();
+}
+
+void JobServer::releaseAll() {
+    while (getNumTokens()) release();
+}
@@ -0,0 +1,53 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <sys/types.h>
+
+// GNU make jobserver client. When msc runs under make -jN, make passes a
+// jobserver in MAKEFLAGS (--jobserver-auth=R,W or =fifo:PATH) that holds one
+// token per job slot beyond the first. msc implicitly owns one slot, and
+// must acquire a token for each additional concurrent subprocess or worker,
+// returning it when done, so that all of make's jobs share the -jN budget.
+class JobServer {
+    private:
+        int readFd;
+        int writeFd;
+        pid_t owner;  // tokens are held by this process, not forked children
+        std::vector<char> tokens;
+
+        JobServer(int readFd, int writeFd);
+
+    public:
+        // Returns the jobserver msc was given, or nullptr if there is none
+        // (in which case callers just limit themselves to -j)
+        static JobServer* get();
+
+        // For poll(): readable when a token may be available
+        int getFd() const { return readFd; }
+
+        // Acquires a token without blocking. Returns false if none is available.
+        bool tryAcquire();
+        // Returns one acquired token
+        void release();
+        // Returns all acquired tokens (done on exit)
+        void releaseAll();
+        size_t getNumTokens();
+};
@@ -0,0 +1,261 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "json.h"
+
+const JsonValue* JsonValue::get(const std::string& key) const {
+    for (auto& [k, v] : objectVal) if (k == key) return &v;
+    return nullptr;
+}
+
+JsonValue& JsonValue::push(const JsonValue& v) {
+    type = Array;
+    arrayVal.push_back(v);
+    return *this;
+}
+
+JsonValue& JsonValue::set(const std::string& key, const JsonValue& v) {
+    type = Object;
+    for (auto& [k, val] : objectVal) {
+        if (k == key) {
+            val = v;
+            return *this;
+        }
+    }
+    objectVal.push_back(std::make_pair(key, v));
+    return *this;
+}
+
+std::string jsonQuote(const std::string& s) {
+    std::string res = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n"; break;
+            case '\r': res += "\\r"; break;
+            case '\t': res += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    res += buf;
+                } else {
+                    res += c;
+                }
+        }
+    }
+    return res + "\"";
+}
+
+std::string JsonValue::str() const {
+    switch (type) {
+        case Null: return "null";
+        case Bool: return boolVal? "true" : "false";
+        case Number: {
+            if (!std::isfinite(numVal)) return "null";
+            char buf[32];
+            if (numVal == std::trunc(numVal) && std::fabs(numVal) < 1e15) {
+                snprintf(buf, sizeof(buf), "%lld", (long long) numVal);
+            } else {
+                snprintf(buf, sizeof(buf), "%.6g", numVal);
+            }
+            return buf;
+        }
+        case String: return jsonQuote(strVal);
+        case Array: {
+            std::string res = "[";
+            for (size_t i = 0; i < arrayVal.size(); i++) {
+                if (i) res += ", ";
+                res += arrayVal[i].str();
+            }
+            return res + "]";
+        }
+        case Object: {
+            std::string res = "{";
+            for (size_t i = 0; i < objectVal.size(); i++) {
+                if (i) res += ", ";
+                res += jsonQuote(objectVal[i].first) + ": " + objectVal[i].second.str();
+            }
+            return res + "}";
+        }
+    }
+    return "null";
+}
+
+class JsonParser {
+    private:
+        const std::string& s;
+        size_t pos = 0;
+
+        [[noreturn]] void fail(const std::string& msg) {
+            throw std::runtime_error(msg + " at offset " + std::to_string(pos));
+        }
+
+        void skipWs() {
+            while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\n' || s[pos] == '\r')) pos++;
+        }
+
+        bool consume(const char* lit) {
+            size_t len = strlen(lit);
+            if (s.compare(pos, len, lit) != 0) return false;
+            pos += len;
+            return true;
+        }
+
+        void appendUtf8(std::string& res, uint32_t cp) {
+            if (cp < 0x80) {
+                res += (char) cp;
+            } else if (cp < 0x800) {
+                res += (char) (0xC0 | (cp >> 6));
+                res += (char) (0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                res += (char) (0xE0 | (cp >> 12));
+                res += (char) (0x80 | ((cp >> 6) & 0x3F));
+                res += (char) (0x80 | (cp & 0x3F));
+            } else {
+                res += (char) (0xF0 | (cp >> 18));
+                res += (char) (0x80 | ((cp >> 12) & 0x3F));
+                res += (char) (0x80 | ((cp >> 6) & 0x3F));
+                res += (char) (0x80 | (cp & 0x3F));
+            }
+        }
+
+        uint32_t parseHex4() {
+            if (pos + 4 > s.size()) fail("truncated unicode escape");
+            uint32_t cp = 0;
+            for (int i = 0; i < 4; i++) {
+                char c = s[pos++];
+                cp <<= 4;
+                if (c >= '0' && c <= '9') cp |= c - '0';
+                else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+                else fail("invalid unicode escape");
+            }
+            return cp;
+        }
+
+        std::string parseString() {
+            if (pos >= s.size() || s[pos] != '"') fail("expected string");
+            pos++;
+            std::string res;
+            while (true) {
+                if (pos >= s.size()) fail("unterminated string");
+                char c = s[pos++];
+                if (c == '"') break;
+                if (c != '\\') {
+                    res += c;
+                    continue;
+                }
+                if (pos >= s.size()) fail("unterminated string");
+                char e = s[pos++];
+                switch (e) {
+                    case '"': res += '"'; break;
+                    case '\\': res += '\\'; break;
+                    case '/': res += '/'; break;
+                    case 'b': res += '\b'; break;
+                    case 'f': res += '\f'; break;
+                    case 'n': res += '\n'; break;
+                    case 'r': res += '\r'; break;
+                    case 't': res += '\t'; break;
+                    case 'u': {
+                        uint32_t cp = parseHex4();
+                        if (cp >= 0xD800 && cp < 0xDC00 && consume("\\u")) {
+                            uint32_t lo = parseHex4();
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        }
+                        appendUtf8(res, cp);
+                        break;
+                    }
+                    default: fail("invalid escape");
+                }
+            }
+            return res;
+        }
+
+        JsonValue parseValue() {
+            skipWs();
+            if (pos >= s.size()) fail("unexpected end of input");
+            char c = s[pos];
+            if (c == '{') {
+                pos++;
+                JsonValue obj = JsonValue::object();
+                skipWs();
+                if (consume("}")) return obj;
+                while (true) {
+                    skipWs();
+                    std::string key = parseString();
+                    skipWs();
+                    if (!consume(":")) fail("expected ':'");
+                    obj.set(key, parseValue());
+                    skipWs();
+                    if (consume("}")) return obj;
+                    if (!consume(",")) fail("expected ',' or '}'");
+                }
+            } else if (c == '[') {
+                pos++;
+                JsonValue arr = JsonValue::array();
+                skipWs();
+                if (consume("]")) return arr;
+                while (true) {
+                    arr.push(parseValue());
+                    skipWs();
+                    if (consume("]")) return arr;
+                    if (!consume(",")) fail("expected ',' or ']'");
+                }
+            } else if (c == '"') {
+                return JsonValue(parseString());
+            } else if (consume("true")) {
+                return JsonValue(true);
+            } else if (consume("false")) {
+                return JsonValue(false);
+            } else if (consume("null")) {
+                return JsonValue();
+            } else if (c == '-' || isdigit(c)) {
+                size_t end;
+                double v;
+                try {
+                    v = std::stod(s.substr(pos), &end);
+                } catch (const std::exception&) {
+                    fail("invalid number");
+                }
+                pos += end;
+                return JsonValue(v);
+            }
+            fail("unexpected character");
+        }
+
+    public:
+        JsonParser(const std::string& s) : s(s) {}
+
+        JsonValue parse() {
+            JsonValue v = parseValue();
+            skipWs();
+            if (pos != s.size()) fail("trailing characters");
+            return v;
+        }
+};
+
+JsonValue parseJson(const std::string& str) {
+    return JsonParser(str).parse();
+}
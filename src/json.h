@@ -0,0 +1,83 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON support for msc's machine-readable inputs and outputs (batch
+// manifests, reports, etc.). Objects preserve insertion order.
+class JsonValue {
+    public:
+        enum Type { Null, Bool, Number, String, Array, Object };
+
+    private:
+        Type type;
+        bool boolVal = false;
+        double numVal = 0.0;
+        std::string strVal;
+        std::vector<JsonValue> arrayVal;
+        std::vector<std::pair<std::string, JsonValue>> objectVal;
+
+    public:
+        JsonValue() : type(Null) {}
+        JsonValue(bool b) : type(Bool), boolVal(b) {}
+        JsonValue(int v) : type(Number), numVal(v) {}
+        JsonValue(int64_t v) : type(Number), numVal(v) {}
+        JsonValue(uint64_t v) : type(Number), numVal(v) {}
+        JsonValue(double v) : type(Number), numVal(v) {}
+        JsonValue(const char* s) : type(String), strVal(s) {}
+        JsonValue(const std::string& s) : type(String), strVal(s) {}
+
+        static JsonValue array() { JsonValue v; v.type = Array; return v; }
+        static JsonValue object() { JsonValue v; v.type = Object; return v; }
+
+        Type getType() const { return type; }
+        bool isNull() const { return type == Null; }
+        bool isBool() const { return type == Bool; }
+        bool isNumber() const { return type == Number; }
+        bool isString() const { return type == String; }
+        bool isArray() const { return type == Array; }
+        bool isObject() const { return type == Object; }
+
+        bool getBool() const { return boolVal; }
+        double getNumber() const { return numVal; }
+        const std::string& getString() const { return strVal; }
+        const std::vector<JsonValue>& getArray() const { return arrayVal; }
+        const std::vector<std::pair<std::string, JsonValue>>& getObject() const { return objectVal; }
+
+        // Object member lookup; returns nullptr if this is not an object or
+        // does not have the member
+        const JsonValue* get(const std::string& key) const;
+
+        // Builders; these return *this to allow chaining
+        JsonValue& push(const JsonValue& v);
+        JsonValue& set(const std::string& key, const JsonValue& v);
+
+        // Serializes this value in a single line
+        std::string str() const;
+};
+
+// Parses a JSON document. Throws std::runtime_error on malformed input.
+JsonValue parseJson(const std::string& str);
+
+// Returns s as a quoted and escaped JSON string
+std::string jsonQuote(const std::string& s);
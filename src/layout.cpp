@@ -0,0 +1,165 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "layout.h"
+
+// Guards against recursive types and modules, which bsc rejects anyway
+static const uint32_t maxDepth = 256;
+
+void DesignLayout::clear() {
+    types.clear();
+    typeOrder.clear();
+    modules.clear();
+    moduleOrder.clear();
+    wrappers.clear();
+}
+
+void DesignLayout::addType(const std::string& name, const Type& type) {
+    if (!types.count(name)) typeOrder.push_back(name);
+    types[name] = type;
+}
+
+const DesignLayout::Type* DesignLayout::getType(const std::string& name) const {
+    auto it = types.find(name);
+    return (it == types.end())? nullptr : &it->second;
+}
+
+void DesignLayout::addModule(const std::string& name, const Module& module) {
+    if (!modules.count(name)) moduleOrder.push_back(name);
+    modules[name] = module;
+}
+
+bool DesignLayout::getFields(const std::string& typeName, std::vector<std::tuple<std::string, uint64_t>>& fields, uint32_t depth) const {
+    auto type = getType(typeName);
+    if (!type || depth > maxDepth) return false;
+
+    // Appends the fields of a member, prefixed by its name
+    auto addMember = [&](const std::string& name, const std::string& memberType) {
+        std::vector<std::tuple<std::string, uint64_t>> memberFields;
+        if (!getFields(memberType, memberFields, depth + 1)) return false;
+        for (auto& [field, width] : memberFields)
+            fields.push_back({field.empty()? name : name + "." + field, width});
+        return true;
+    };
+
+    switch (type->kind) {
+        case BITS:
+        case ENUM:
+            fields.push_back({"", type->width});
+            return true;
+        case STRUCT:
+            // Later members take lower bits
+            for (auto it = type->members.rbegin(); it != type->members.rend(); it++)
+                if (!addMember(it->name, it->type)) return false;
+            return true;
+        case VECTOR:
+            for (uint64_t i = 0; i < type->elems; i++)
+                if (!addMember("_" + std::to_string(i), type->elemType)) return false;
+            return true;
+        case MAYBE:
+            return addMember("value", type->elemType) && addMember("valid", "Bool");
+        case SYNONYM:
+            return getFields(type->elemType, fields, depth + 1);
+        case REG:
+            return false;
+    }
+    return false;
+}
+
+bool DesignLayout::getWidth(const std::string& type, uint64_t& width) const {
+    std::vector<std::tuple<std::string, uint64_t>> fields;
+    if (!getFields(type, fields)) return false;
+    width = 0;
+    for (auto& [field, fieldWidth] : fields) width += fieldWidth;
+    return true;
+}
+
+void DesignLayout::getRegisters(const std::string& prefix, const std::string& typeName, const std::string& moduleName,
+        JsonValue& regs, JsonValue& bviSubmodules, uint32_t depth) const {
+    if (depth > maxDepth) return;
+    auto join = [&prefix](const std::string& name) { return prefix.empty()? name : prefix + "_" + name; };
+
+    auto type = getType(typeName);
+    while (type && type->kind == SYNONYM && depth++ < maxDepth) type = getType(type->elemType);
+    if (type && type->kind == REG) {
+        regs.push(JsonValue::object().set("name", prefix).set("type", type->elemType));
+    } else if (type && type->kind == VECTOR) {
+        // Vectors of submodules are named by element index
+        for (uint64_t i = 0; i < type->elems; i++)
+            getRegisters(join(std::to_string(i)), type->elemType, moduleName, regs, bviSubmodules, depth + 1);
+    } else {
+        // NOTE: Modules imported from Bluespec are omitted silently
+        auto it = modules.find(moduleName);
+        if (it == modules.end()) return;
+        auto& module = it->second;
+        if (module.isBvi && depth) {
+            bviSubmodules.push(JsonValue::object().set("name", prefix).set("module", moduleName));
+            return;
+        }
+        for (auto& submodule : module.submodules)
+            getRegisters(join(submodule.name), submodule.type, submodule.module, regs, bviSubmodules, depth + 1);
+    }
+}
+
+JsonValue DesignLayout::toJson() const {
+    auto portsJson = [](const std::vector<Port>& ports) {
+        JsonValue res = JsonValue::array();
+        for (auto& port : ports) res.push(JsonValue::object().set("name", port.name).set("type", port.type));
+        return res;
+    };
+
+    JsonValue typesJson = JsonValue::object();
+    for (auto& name : typeOrder) {
+        std::vector<std::tuple<std::string, uint64_t>> fields;
+        if (!getFields(name, fields)) continue;
+        uint64_t width = 0;
+        JsonValue fieldsJson = JsonValue::array();
+        for (auto& [field, fieldWidth] : fields) {
+            fieldsJson.push(JsonValue::object().set("name", field).set("offset", width).set("width", fieldWidth));
+            width += fieldWidth;
+        }
+        JsonValue typeJson = JsonValue::object().set("width", width);
+        if (fields.size() != 1 || !std::get<0>(fields[0]).empty()) typeJson.set("fields", fieldsJson);
+        typesJson.set(name, typeJson);
+    }
+
+    JsonValue modulesJson = JsonValue::object();
+    for (auto& name : moduleOrder) {
+        auto& module = modules.at(name);
+        JsonValue methodsJson = JsonValue::array();
+        for (auto& method : module.methods) {
+            methodsJson.push(JsonValue::object().set("name", method.name).set("type", method.type)
+                    .set("args", portsJson(method.args)));
+        }
+        JsonValue regs = JsonValue::array();
+        JsonValue bviSubmodules = JsonValue::array();
+        getRegisters("", "", name, regs, bviSubmodules);
+        modulesJson.set(name, JsonValue::object()
+                .set("interface", module.ifc)
+                .set("function", module.isFunction)
+                .set("bvi", module.isBvi)
+                .set("inputs", portsJson(module.inputs))
+                .set("methods", methodsJson)
+                .set("registers", regs)
+                .set("bviSubmodules", bviSubmodules));
+    }
+    for (auto& [name, wrappedModule] : wrappers)
+        modulesJson.set(name, JsonValue::object().set("wraps", wrappedModule));
+
+    return JsonValue::object().set("types", typesJson).set("modules", modulesJson);
+}
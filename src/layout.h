@@ -0,0 +1,112 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "json.h"
+
+// Bit layouts of the types and modules of a translated design, for tools that
+// map synthesized signals back to Minispec names (e.g., synth). Types are
+// named by their elaborated Bluespec names without escapes or spaces (e.g.,
+// "Vector#(4,Bit#(8))"), and modules by their Bluespec module names (e.g.,
+// "mkCounter"). Layouts follow bsc's conventions: the first struct member
+// takes the highest bits, Vector element 0 takes the lowest bits, and the
+// valid bit of a Maybe is its highest bit.
+class DesignLayout {
+    public:
+        struct Port {
+            std::string name;
+            std::string type;
+        };
+
+        struct Method {
+            std::string name;
+            std::string type;
+            std::vector<Port> args;
+        };
+
+        struct Submodule {
+            std::string name;
+            std::string type;    // interface type (e.g., Vector#(2,Counter))
+            std::string module;  // module of each instance (e.g., mkCounter)
+        };
+
+        struct Module {
+            std::string ifc;
+            bool isFunction = false;  // synthesis wrapper of a function
+            bool isBvi = false;       // external module on Verilog compiles
+            std::vector<Port> inputs;
+            std::vector<Method> methods;
+            std::vector<Submodule> submodules;
+        };
+
+    private:
+        enum Kind {BITS, ENUM, STRUCT, VECTOR, MAYBE, REG, SYNONYM};
+        struct Type {
+            Kind kind;
+            uint64_t width;        // BITS, ENUM
+            uint64_t elems;        // VECTOR
+            std::string elemType;  // VECTOR, MAYBE, REG, SYNONYM
+            std::vector<Port> members;  // STRUCT
+        };
+        std::unordered_map<std::string, Type> types;
+        std::vector<std::string> typeOrder;
+        std::unordered_map<std::string, Module> modules;
+        std::vector<std::string> moduleOrder;
+        std::map<std::string, std::string> wrappers;
+
+        void addType(const std::string& name, const Type& type);
+        const Type* getType(const std::string& name) const;
+
+        // Flattened (name, width) leaves, lowest bits first; returns false if
+        // the type has no known layout
+        bool getFields(const std::string& type, std::vector<std::tuple<std::string, uint64_t>>& fields, uint32_t depth = 0) const;
+        void getRegisters(const std::string& prefix, const std::string& type, const std::string& module,
+                JsonValue& regs, JsonValue& bviSubmodules, uint32_t depth = 0) const;
+
+    public:
+        void clear();
+
+        void addBits(const std::string& name, uint64_t width) { addType(name, {BITS, width, 0, "", {}}); }
+        void addEnum(const std::string& name, uint64_t width) { addType(name, {ENUM, width, 0, "", {}}); }
+        void addStruct(const std::string& name, const std::vector<Port>& members) { addType(name, {STRUCT, 0, 0, "", members}); }
+        void addVector(const std::string& name, uint64_t elems, const std::string& elemType) { addType(name, {VECTOR, 0, elems, elemType, {}}); }
+        void addMaybe(const std::string& name, const std::string& valueType) { addType(name, {MAYBE, 0, 0, valueType, {}}); }
+        void addReg(const std::string& name, const std::string& valueType) { addType(name, {REG, 0, 0, valueType, {}}); }
+        void addSynonym(const std::string& name, const std::string& type) { addType(name, {SYNONYM, 0, 0, type, {}}); }
+
+        // Returns whether type has a known bit layout (i.e., it is a Bits
+        // type recorded above, not an interface or a type msc doesn't know),
+        // and its width
+        bool getWidth(const std::string& type, uint64_t& width) const;
+
+        void addModule(const std::string& name, const Module& module);
+        // Top-level wrapper modules (see translateFiles()) expose the
+        // wrapped module's interface as a submodule named "res"
+        void addWrapper(const std::string& name, const std::string& wrappedModule) { wrappers[name] = wrappedModule; }
+
+        // Returns the table of types (width and flattened fields) and modules
+        // (interface, inputs, methods, flattened registers, and BVI submodules)
+        JsonValue toJson() const;
+};
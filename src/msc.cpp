@@ -18,355 +18,538 @@
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <filesystem>
 #include <regex>
 #include <unordered_set>
 #include <variant>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "antlr4-runtime.h"
 #include "argparse/argparse.hpp"
+#include "batch.h"
+#include "bscrts.h"
+#include "bsvcache.h"
 #include "errors.h"
+#include "eval.h"
 #include "log.h"
 #include "parse.h"
+#include "server.h"
 #include "strutils.h"
+#include "subprocess.h"
+#include "timereport.h"
 #include "translate.h"
 #include "version.h"
+#include "vsim.h"
 #include "MinispecLexer.h"
 #include "MinispecParser.h"
 
 using namespace antlr4;
 
 // Bluespec errors
-typedef std::function<std::string(uint32_t, uint32_t)> TranslateLocFn;
-typedef std::function<std::string(uint32_t, uint32_t, const std::vector<std::string>&)> ContextStrFn;
-typedef std::function<tree::ParseTree*(uint32_t, uint32_t)> FindFn;
-
-void reportBluespecOutput(std::string str, const SourceMap& sm, const std::string& topLevel, bool simOut) {
-    typedef std::regex_iterator<std::string::const_iterator> regex_it;
-    const regex_it rend;
-
-    // C++ regexes suck... I want ECMAScript mode with multiline (it seems
-    // lookahead doesn't work with std::regex::extended), but
-    // std::regex:multiline is a C++17 feature, and isn't even in gcc 8.2! So
-    // substitute all newlines with a line termination token that doesn't show
-    // up in Bluespec output.
-    const char* lineTerm = " _@%@_ ";
-    replace(str, "\n", lineTerm);
-    std::regex evRegex("(Warning|Error): (.*?)(?=( _@%@_ Error:| _@%@_ Warning:|$))");
-
-    const std::string locRegexStr = "\"(\\S+)\",\\s+line\\s+(\\d+),\\s+column\\s+(\\d+)";
-    std::regex locRegex(locRegexStr);
-    std::regex hdrRegex(locRegexStr + ":\\s+\\((\\S+)\\)"); // include type
-
-    auto translateLoc = [&](uint32_t line, uint32_t lineChar) {
-        auto pt = sm.find(line, lineChar);
-        if (pt) return getLoc(pt);
-        else return "(translated bsv:" + std::to_string(line) + ":" + std::to_string(lineChar) + ")";
-    };
 
-    auto translateAllLocs = [&](std::string& msg) {
-        std::smatch locMatch;
-        std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> locToPos;
-        while (std::regex_search(msg, locMatch, locRegex)) {
-            std::string file = locMatch[1];
-            uint32_t line = atoi(locMatch[2].str().c_str());
-            uint32_t lineChar = atoi(locMatch[3].str().c_str());
-            std::string loc;
-            if (file == "Translated.bsv") {
-                loc = translateLoc(line, lineChar);
-            } else {
-                loc = file + ":" + std::to_string(line) + ":" + std::to_string(lineChar);
+// A location in bsc output, e.g., "Translated.bsv", line 12, column 5
+struct BscLoc {
+    size_t pos;  // position and length of the loc in the scanned string
+    size_t len;
+    std::string file;
+    uint32_t line;
+    uint32_t lineChar;
+};
+
+// Hand-written matchers for the common parts of bsc messages (locs, headers,
+// quoted elements). These run on every message, so they scan linearly instead
+// of using regexes. They match the same strings as the regexes in comments.
+
+static size_t skipSpaces(const std::string& s, size_t pos) {
+    while (pos < s.size() && isspace(s[pos])) pos++;
+    return pos;
+}
+
+static size_t skipDigits(const std::string& s, size_t pos, uint32_t& val) {
+    val = 0;
+    while (pos < s.size() && isdigit(s[pos])) val = val * 10 + (s[pos++] - '0');
+    return pos;
+}
+
+static bool matchWord(const std::string& s, size_t pos, const char* word) {
+    return s.compare(pos, strlen(word), word) == 0;
+}
+
+// "(\S+)",\s+line\s+(\d+),\s+column\s+(\d+), starting at pos
+static bool matchBscLoc(const std::string& s, size_t pos, BscLoc& loc) {
+    if (pos >= s.size() || s[pos] != '"') return false;
+    size_t p = pos + 1;
+    while (p < s.size() && !isspace(s[p])) p++;
+    // The filename is followed by '",' and then whitespace
+    if (p < pos + 4 || s[p-1] != ',' || s[p-2] != '"') return false;
+    loc.file = s.substr(pos + 1, p - 2 - (pos + 1));
+
+    size_t q = skipSpaces(s, p);
+    if (q == p || !matchWord(s, q, "line")) return false;
+    p = q + 4;
+    q = skipSpaces(s, p);
+    if (q == p) return false;
+    p = skipDigits(s, q, loc.line);
+    if (p == q || p >= s.size() || s[p] != ',') return false;
+    p++;
+    q = skipSpaces(s, p);
+    if (q == p || !matchWord(s, q, "column")) return false;
+    p = q + 6;
+    q = skipSpaces(s, p);
+    if (q == p) return false;
+    p = skipDigits(s, q, loc.lineChar);
+    if (p == q) return false;
+
+    loc.pos = pos;
+    loc.len = p - pos;
+    return true;
+}
+
+static bool findBscLoc(const std::string& s, size_t start, BscLoc& loc) {
+    for (size_t pos = s.find('"', start); pos != std::string::npos; pos = s.find('"', pos + 1))
+        if (matchBscLoc(s, pos, loc)) return true;
+    return false;
+}
+
+// loc:\s+\((\S+)\), i.e., a loc followed by the message code
+static bool findBscHeader(const std::string& s, BscLoc& loc, std::string& code) {
+    for (size_t start = 0; findBscLoc(s, start, loc); start = loc.pos + 1) {
+        size_t p = loc.pos + loc.len;
+        if (p >= s.size() || s[p] != ':') continue;
+        size_t q = skipSpaces(s, p + 1);
+        if (q == p + 1 || q >= s.size() || s[q] != '(') continue;
+        size_t e = q + 1;
+        while (e < s.size() && !isspace(s[e])) e++;
+        size_t close = s.rfind(')', e - 1);
+        if (close == std::string::npos || close <= q + 1) continue;
+        code = s.substr(q + 1, close - q - 1);
+        loc.len = close + 1 - loc.pos;
+        return true;
+    }
+    return false;
+}
+
+// Translates bsc's errors and warnings to Minispec diagnostics as bsc produces
+// them. bsc's output is fed in one line at a time; each message begins with a
+// line starting with "Error:" or "Warning:" and extends until the next one.
+class BluespecOutputTranslator {
+    private:
+        const SourceMap& sm;
+        const std::vector<std::string>& topLevels;
+        const bool simOut;
+
+        bool inMsg = false;
+        bool msgIsError = false;
+        std::string msg;
+        uint64_t numErrors = 0;
+
+    public:
+        BluespecOutputTranslator(const SourceMap& sm, const std::vector<std::string>& topLevels, bool simOut)
+            : sm(sm), topLevels(topLevels), simOut(simOut) {}
+
+        void addLine(const std::string& line) {
+            const char* errHdr = "Error: ";
+            const char* warnHdr = "Warning: ";
+            size_t msgStart = std::string::npos;
+            bool isError = false;
+            if (matchWord(line, 0, errHdr)) {
+                msgStart = 0;
+                isError = true;
+            } else if (matchWord(line, 0, warnHdr)) {
+                msgStart = 0;
+            } else if (!inMsg) {
+                // Skip any preamble, but catch messages that don't start a line
+                size_t errPos = line.find(errHdr);
+                size_t warnPos = line.find(warnHdr);
+                msgStart = std::min(errPos, warnPos);
+                isError = errPos < warnPos;
+            }
+
+            if (msgStart != std::string::npos) {
+                finish();
+                inMsg = true;
+                msgIsError = isError;
+                msg = line.substr(msgStart + strlen(isError? errHdr : warnHdr));
+            } else if (inMsg) {
+                msg += "\n";
+                msg += line;
             }
-            replace(msg, locMatch[0], hlColored(loc));
-            locToPos[hlColored(loc)] = std::tie(line, lineChar);
         }
-        return locToPos;
-    };
 
-    auto contextStrFn = [&](uint32_t line, uint32_t lineChar,
-            const std::vector<std::string>& elems) -> std::string
-    {
-        tree::ParseTree* ctx = nullptr;
-        for (auto elem : elems) {
-            ctx = sm.find(line, lineChar, elem);
-            if (ctx) break;
-        }
-        if (!ctx) ctx = sm.find(line, lineChar);
-	if (ctx) return contextStr(ctx, {ctx});
-        return "";
-    };
+        // Translates the last message, if any
+        void finish() {
+            if (!inMsg) return;
+            translate(msgIsError, msg);
+            inMsg = false;
+            msg.clear();
+        }
 
-    auto reportUnknownMsg = [&](bool isError, std::string msg) {
-        replace(msg, lineTerm, "\n");
-        translateAllLocs(msg);
-        msg = (isError? errorColored("error:") : warnColored("warning:")) + " " + msg + "\n";
-        reportMsg(isError, msg);
-    };
+        // Drops a partially received message (e.g., when bsc is killed)
+        void discard() {
+            inMsg = false;
+            msg.clear();
+        }
 
-    for (regex_it rit(str.begin(), str.end(), evRegex); rit != rend; rit++) {
-        auto& m = *rit;
-        bool isError = std::string(m[1]) == "Error";
-        std::string msg = m[2];
-        std::smatch hdrMatch;
-        if (!std::regex_search(msg, hdrMatch, hdrRegex)) {
-            // Special-case not-found top-level error
-            if (msg.find("Command line:") != std::string::npos && msg.find("Unbound variable `mk") != std::string::npos) {
-                bool isModule = isupper(topLevel[0]);
-                msg = errorColored("error:") + " cannot find top-level " + (isModule? "module" : "function") + " " + errorColored("'" + topLevel + "'");
-                reportMsg(isError, msg);
-            } else {
-                reportUnknownMsg(isError, msg);
+        uint64_t getNumErrors() const { return numErrors; }
+
+    private:
+        // bsc may report our files with a directory (e.g., when found through -p)
+        static std::string baseName(const std::string& file) {
+            return std::filesystem::path(file).filename();
+        }
+
+        DiagLoc translateLoc(const std::string& file, uint32_t line, uint32_t lineChar) {
+            auto pt = sm.find(file, line, lineChar);
+            if (pt) return getDiagLoc(pt);
+            else return {"(translated bsv:" + std::to_string(line) + ":" + std::to_string(lineChar) + ")"};
+        }
+
+        std::string translateAllLocs(const std::string& msg,
+                std::unordered_map<std::string, std::tuple<std::string, uint32_t, uint32_t>>& locToPos) {
+            std::string res;
+            res.reserve(msg.size());
+            size_t start = 0;
+            BscLoc bl;
+            while (findBscLoc(msg, start, bl)) {
+                std::string loc;
+                if (sm.hasFile(baseName(bl.file))) {
+                    loc = getLoc(translateLoc(baseName(bl.file), bl.line, bl.lineChar));
+                } else {
+                    loc = bl.file + ":" + std::to_string(bl.line) + ":" + std::to_string(bl.lineChar);
+                }
+                res.append(msg, start, bl.pos - start);
+                res += hlColored(loc);
+                locToPos[hlColored(loc)] = std::make_tuple(baseName(bl.file), bl.line, bl.lineChar);
+                start = bl.pos + bl.len;
             }
-            continue;
-        }
-        std::string file = hdrMatch[1];
-        uint32_t line = atoi(hdrMatch[2].str().c_str());
-        uint32_t lineChar = atoi(hdrMatch[3].str().c_str());
-        std::string code = hdrMatch[4];
-        std::string body = msg.substr(hdrMatch.length());
-        if (file != "Translated.bsv") {
-            reportUnknownMsg(isError, "in imported BSV file " + msg);
-            continue;
-        }
-
-        replace(body, lineTerm, " ");
-        replace(body, "  ", " ");
-        std::string loc = translateLoc(line, lineChar);
-        body = trim(body);
-        std::string unprocessedBody = body;
-        if (body.size()) body[0] = tolower(body[0]);
-        auto locToPos = translateAllLocs(body);
-
-        // Find and highlight syntax elements
-        std::vector<std::string> elems;
-        std::regex elemRegex("`(.*?)'");
-        std::smatch elemMatch;
-        while (std::regex_search(body, elemMatch, elemRegex)) {
-            std::string elem = elemMatch[1];
+            res.append(msg, start, std::string::npos);
+            return res;
+        }
+
+        std::vector<std::string> contextLinesFn(const std::string& file, uint32_t line, uint32_t lineChar, const std::vector<std::string>& elems) {
+            tree::ParseTree* ctx = nullptr;
+            for (auto elem : elems) {
+                ctx = sm.find(file, line, lineChar, elem);
+                if (ctx) break;
+            }
+            if (!ctx) ctx = sm.find(file, line, lineChar);
+            if (ctx) return contextLines(ctx, {ctx});
+            return {};
+        }
+
+        void report(bool isError, const Diagnostic& diag, const std::string& locInfo = "",
+                tree::ParseTree* ctx = nullptr) {
+            if (isError) numErrors++;
+            reportMsg(isError, diag, locInfo, ctx);
+        }
+
+        void reportUnknownMsg(bool isError, const std::string& msg, const std::string& code = "") {
+            std::unordered_map<std::string, std::tuple<std::string, uint32_t, uint32_t>> locToPos;
+            Diagnostic diag;
+            diag.message = translateAllLocs(msg, locToPos);
+            diag.code = code;
+            report(isError, diag);
+        }
+
+        void translate(bool isError, const std::string& msg);
+};
+
+void BluespecOutputTranslator::translate(bool isError, const std::string& msg) {
+    BscLoc hdr;
+    std::string code;
+    if (!findBscHeader(msg, hdr, code)) {
+        // Special-case not-found top-level error
+        const std::string unboundStr = "Unbound variable `";
+        auto unboundPos = msg.find(unboundStr + "mk");
+        if (msg.find("Command line:") != std::string::npos && unboundPos != std::string::npos) {
+            // Find which top-level this is
+            auto nameStart = unboundPos + unboundStr.size();
+            std::string topModule = msg.substr(nameStart, msg.find('\'', nameStart) - nameStart);
+            std::string topLevel = topModule.substr(2);
+            auto& topModules = sm.getTopModules();
+            for (size_t i = 0; i < topModules.size(); i++)
+                if (topModules[i] == topModule) topLevel = topLevels[i];
+            bool isModule = isupper(topLevel[0]);
+            Diagnostic diag;
+            diag.message = "cannot find top-level " + std::string(isModule? "module" : "function") + " " + errorColored("'" + topLevel + "'");
+            report(isError, diag);
+        } else {
+            reportUnknownMsg(isError, msg);
+        }
+        return;
+    }
+    std::string file = baseName(hdr.file);
+    uint32_t line = hdr.line;
+    uint32_t lineChar = hdr.lineChar;
+    if (!sm.hasFile(file)) {
+        reportUnknownMsg(isError, "in imported BSV file " + msg, code);
+        return;
+    }
+
+    // Join lines and collapse whitespace
+    std::string body = msg.substr(hdr.pos + hdr.len);
+    for (char& c : body) if (c == '\n') c = ' ';
+    body = trim(body);
+    DiagLoc loc = translateLoc(file, line, lineChar);
+    std::string unprocessedBody = body;
+    if (body.size()) body[0] = tolower(body[0]);
+    std::unordered_map<std::string, std::tuple<std::string, uint32_t, uint32_t>> locToPos;
+    body = translateAllLocs(body, locToPos);
+
+    // Find and highlight syntax elements, i.e., `(.*?)'
+    std::vector<std::string> elems;
+    {
+        std::string hlBody;
+        hlBody.reserve(body.size());
+        size_t start = 0;
+        while (true) {
+            size_t open = body.find('`', start);
+            size_t close = (open == std::string::npos)? open : body.find('\'', open + 1);
+            if (close == std::string::npos) break;
+            std::string elem = body.substr(open + 1, close - open - 1);
             // Translate all module constructors back to the module name
             if (elem.size() > 2 && elem.find("mk") == 0 && isupper(elem[2]))
                 elem = elem.substr(2);
-	    elems.push_back(elem);
-	    replace(body, elemMatch[0], errorColored("'" + elem + "'"));
-        }
-
-        // Special-case a few codes; these rewrite body on success, o/w they fall through the default code
-        if (code == "T0020" || code == "T0080") {
-            // NOTE: T0020 is for expressions and T0080 is for functions, but
-            // Bluespec seems to implement several constant as functions (e.g.,
-            // True and False). So, we output exactly the same error message
-            // for both
-            std::regex typeRegex((code == "T0020")? "type error at: (.*?) Expected type: (.*?) Inferred type: (.*?)$" : "type error at the use of the following function: (.*?) The expected return type of the function: (.*?) The return type according to the use: (.*?)$");
-            std::smatch match;
-            if (std::regex_search(body, match, typeRegex)) {
-                std::string elem = match[1];
-                std::string expectedType = match[2];
-                std::string type = match[3];
-                body = "expression " + errorColored("'" + elem + "'") + " has type " + hlColored(type) + ", but use requires type " + hlColored(expectedType);
+            if (std::find(elems.begin(), elems.end(), elem) == elems.end())
                 elems.push_back(elem);
+            hlBody.append(body, start, open - start);
+            hlBody += errorColored("'" + elem + "'");
+            start = close + 1;
+        }
+        hlBody.append(body, start, std::string::npos);
+        body = hlBody;
+    }
+
+    // Special-case a few codes; these rewrite body on success, o/w they fall
+    // through the default code. Regexes are compiled once, on first use.
+    if (code == "T0020" || code == "T0080") {
+        // NOTE: T0020 is for expressions and T0080 is for functions, but
+        // Bluespec seems to implement several constant as functions (e.g.,
+        // True and False). So, we output exactly the same error message
+        // for both
+        static const std::regex exprTypeRegex("type error at: (.*?) Expected type: (.*?) Inferred type: (.*?)$");
+        static const std::regex fcnTypeRegex("type error at the use of the following function: (.*?) The expected return type of the function: (.*?) The return type according to the use: (.*?)$");
+        std::smatch match;
+        if (std::regex_search(body, match, (code == "T0020")? exprTypeRegex : fcnTypeRegex)) {
+            std::string elem = match[1];
+            std::string expectedType = match[2];
+            std::string type = match[3];
+            body = "expression " + errorColored("'" + elem + "'") + " has type " + hlColored(type) + ", but use requires type " + hlColored(expectedType);
+            elems.push_back(elem);
+        }
+    } else if (code == "T0031" || code == "T0032") {
+        // First, find if the compiler is pinpointing an expression.
+        // If so, use the expression loc as the loc, as that is,
+        // by observation, more accurate.
+        // NOTE: We used to do this only for T0032, where the default loc
+        // is always way off---the beginning of the offending module. But
+        // for some T0031s we've found the default loc to be bad too, so
+        // just do it always. If the location is perplexing in some cases,
+        // we could do more detailed analysis to see when the default loc
+        // is bad (e.g., it's untranslated)
+        static const std::regex exprRegex(" The proviso was implied by expressions at the following positions: (\\S+)");
+        std::smatch exprMatch;
+        if (std::regex_search(body, exprMatch, exprRegex)) {
+            std::string exprLoc = exprMatch[1];
+            bool isLoc = locToPos.find(exprLoc) != locToPos.end();
+            bool isMinispec = exprLoc.find("(translated") == std::string::npos;
+            if (isLoc && isMinispec) {
+                std::tie(file, line, lineChar) = locToPos[exprLoc];
+                loc = translateLoc(file, line, lineChar);
+                replace(body, exprMatch[0], "");  // take it out
             }
-        } else if (code == "T0031" || code == "T0032") {
-            // First, find if the compiler is pinpointing an expression.
-            // If so, use the expression loc as the loc, as that is,
-            // by observation, more accurate.
-            // NOTE: We used to do this only for T0032, where the default loc
-            // is always way off---the beginning of the offending module. But
-            // for some T0031s we've found the default loc to be bad too, so
-            // just do it always. If the location is perplexing in some cases,
-            // we could do more detailed analysis to see when the default loc
-            // is bad (e.g., it's untranslated)
-            std::regex exprRegex(" The proviso was implied by expressions at the following positions: (\\S+)");
-            std::smatch exprMatch;
-            if (std::regex_search(body, exprMatch, exprRegex)) {
-                std::string exprLoc = exprMatch[1];
-                bool isLoc = locToPos.find(exprLoc) != locToPos.end();
-                bool isMinispec = exprLoc.find("(translated") == std::string::npos;
-                if (isLoc && isMinispec) {
-                    loc = exprLoc;
-                    std::tie(line, lineChar) = locToPos[exprLoc];
-                    replace(body, exprMatch[0], "");  // take it out
-                }
-            }
+        }
 
-	    // Then, handle the actual proviso error
-	    std::regex provisoRegex((code == "T0031")?
-                        "no instances of the form:\\s+(\\S+?)#\\((.*)\\)" :
-                        "proviso which could not be resolved:\\s+(\\S+?)#\\((.*)\\)");
-            std::smatch match;
-            if (std::regex_search(body, match, provisoRegex)) {
-                std::string typeclass = match[1];
-                std::string type = match[2];
-                if (typeclass == "Arith") {
-                    body = "type " + hlColored(type) + " does not support arithmetic operations";
-                } else if (typeclass == "Ord") {
-                    body = "type " + hlColored(type) + " does not support comparison operations";
-                } else if (typeclass == "Literal") {
-                    body = "cannot convert literal to type " + hlColored(type);
-                } else if (typeclass == "FShow") {
-                    body = "cannot display value of type " + hlColored(type);
-                    if (type.find("function") == 0)
-                        body += " (this is a function, did you forget some/all the arguments?)";
-                } else if (typeclass == "Bits") {
-                    std::regex bitsRegex("(.*?), (\\S+)");
-                    std::smatch bitsMatch;
-                    if (std::regex_search(type, bitsMatch, bitsRegex)) {
-                        std::string badType = bitsMatch[1];
-                        std::string length = bitsMatch[2];
-                        body = "type " + errorColored("'" + badType + "'") + " cannot be used here";
-                        if (badType == "Integer") {
-                            body += " because Integer is a compile-time-only type with an unbounded number of bits, so it can't be synthesized to hardware";
-                        } else if (length == "a__") {
-                            // FIXME: This happens in Reg#(), but seems very tailored.
-                            body += " because this type is not synthesizable to bits, which is required by the use";
-                        } else {
-                            body += " because either this type is not synthesizable to bits, or it has a bit-width incompatible with its use";
-                        }
-                    }
-                } else if (typeclass == "Add") {
-                    body = "expression type has a number of bits or elements incompatible with its use";
-                    std::regex addRegex("(\\d+), (\\d+), (\\d+)");
-                    std::smatch addMatch;
-                    if (std::regex_search(type, addMatch, addRegex)) {
-                        std::string n1 = addMatch[1];
-                        std::string n2 = addMatch[2];
-                        std::string n3 = addMatch[3];
-                        body += " (for lengths to match, "  + n1 + " + " + n2 + " should equal " + n3 + ")";
-                    }
-                    // All the "overlength" expressions I've seen so far (e.g.,
-                    // concatenation) follow this format; if you see something
-                    // else, e.g., Add#(a__, 1, 0), generalize this regex.
-                    std::regex overRegex("(\\d+), (\\S+)_, 0");
-                    if (std::regex_search(type, addMatch, overRegex)) {
-                        std::string n1 = addMatch[1];
-                        body += " (expression has " + n1 + " more/fewer bits or elements than its use allows)";
+        // Then, handle the actual proviso error
+        static const std::regex instancesRegex("no instances of the form:\\s+(\\S+?)#\\((.*)\\)");
+        static const std::regex provisoRegex("proviso which could not be resolved:\\s+(\\S+?)#\\((.*)\\)");
+        std::smatch match;
+        if (std::regex_search(body, match, (code == "T0031")? instancesRegex : provisoRegex)) {
+            std::string typeclass = match[1];
+            std::string type = match[2];
+            if (typeclass == "Arith") {
+                body = "type " + hlColored(type) + " does not support arithmetic operations";
+            } else if (typeclass == "Ord") {
+                body = "type " + hlColored(type) + " does not support comparison operations";
+            } else if (typeclass == "Literal") {
+                body = "cannot convert literal to type " + hlColored(type);
+            } else if (typeclass == "FShow") {
+                body = "cannot display value of type " + hlColored(type);
+                if (type.find("function") == 0)
+                    body += " (this is a function, did you forget some/all the arguments?)";
+            } else if (typeclass == "Bits") {
+                static const std::regex bitsRegex("(.*?), (\\S+)");
+                std::smatch bitsMatch;
+                if (std::regex_search(type, bitsMatch, bitsRegex)) {
+                    std::string badType = bitsMatch[1];
+                    std::string length = bitsMatch[2];
+                    body = "type " + errorColored("'" + badType + "'") + " cannot be used here";
+                    if (badType == "Integer") {
+                        body += " because Integer is a compile-time-only type with an unbounded number of bits, so it can't be synthesized to hardware";
+                    } else if (length == "a__") {
+                        // FIXME: This happens in Reg#(), but seems very tailored.
+                        body += " because this type is not synthesizable to bits, which is required by the use";
+                    } else {
+                        body += " because either this type is not synthesizable to bits, or it has a bit-width incompatible with its use";
                     }
                 }
+            } else if (typeclass == "Add") {
+                body = "expression type has a number of bits or elements incompatible with its use";
+                static const std::regex addRegex("(\\d+), (\\d+), (\\d+)");
+                std::smatch addMatch;
+                if (std::regex_search(type, addMatch, addRegex)) {
+                    std::string n1 = addMatch[1];
+                    std::string n2 = addMatch[2];
+                    std::string n3 = addMatch[3];
+                    body += " (for lengths to match, "  + n1 + " + " + n2 + " should equal " + n3 + ")";
+                }
+                // All the "overlength" expressions I've seen so far (e.g.,
+                // concatenation) follow this format; if you see something
+                // else, e.g., Add#(a__, 1, 0), generalize this regex.
+                static const std::regex overRegex("(\\d+), (\\S+)_, 0");
+                if (std::regex_search(type, addMatch, overRegex)) {
+                    std::string n1 = addMatch[1];
+                    body += " (expression has " + n1 + " more/fewer bits or elements than its use allows)";
+                }
             }
-	} else if (code == "T0003") {
-	    // I see these only on mistyped literals, but unbound constructor
-	    // is such a general message that who knows where else it may show
-	    // up. So leave the translated error general.
-	    replace(body, "unbound constructor", "undefined literal, type, or module");
-        } else if (code == "T0004") {
-	    replace(body, "unbound variable", "undefined variable or function");
-	} else if (code == "T0007") {
-	    replace(body, "unbound type constructor", "undefined type or module");
-        } else if (code == "T0016") {
-            // Error message is good, except when it's an input, so process only that
-            std::regex inputRegex("Field `(.*?)___input' is not in the type `(.*?)' which was derived for this expression");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, inputRegex)) {
-                std::string input = match[1];
-                std::string modType = match[2];
-                body = "module " + hlColored(modType) + " does not have an input named " + errorColored("'" + input + "'");
-            }
-        } else if (code == "T0081" || code == "T0083" || code == "T0084") {
-            // Errors related to using a function with the wrong number of arguments
-            // First, the expected/inferred type trailing info is more confusing then helpful (function type noise). So take that out.
-            std::string trailMarker = (code == "T0081")? " Expected type:" : " The expected type is:";
-            auto trailStart = body.find(trailMarker);
-            body = body.substr(0, trailStart);  // safe even if trail is string::npos
-            // Second, if the function is actually a module, don't call it a function :)
-            if (body.find(": mk") != std::string::npos) {
-                replace(body, ": mk", ": ");
-                replace(body, "function", "module");
-            }
-        } else if (code == "G0004") {
-            // Register double-writes and input/wire double-sets
-            std::regex conflictRegex("Rule `(.*?)' uses methods that conflict in parallel: (.*?)(\\S+) and (.*?)(\\S+) For the complete expressions");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, conflictRegex)) {
-                std::string rule = match[1];
-                // g1/g2 are the "guards" and may be empty; m1 and m2 are the methods
-                std::string g1 = match[2];
-                std::string m1 = match[3];
-                std::string g2 = match[4];
-                std::string m2 = match[5];
-                bool isWrite = m1.find(".write") != std::string::npos;
-                bool isWset = m1.find(".wset") != std::string::npos;
-                bool isWget2 = m2.find(".wget") != std::string::npos;
-                bool isWhas2 = m2.find(".whas") != std::string::npos;
-                std::string base1 = "'" + m1.substr(0, m1.find(".")) + "'";
-                std::string base2 = "'" + m2.substr(0, m1.find(".")) + "'";
-
-                body = "rule " + errorColored("'" + rule + "'") + " ";
-                if (m1 == m2 && (isWrite || isWset)) {
-                    if (isWrite) {
-                        body += "writes to register " + errorColored(base1) + " more than once, which is forbidden";
-                    } else {
-                        assert(isWset);
-                        body += "sets input or wire " + errorColored(base1) + " more than once, which is forbidden";
-                    }
-                    // Non-disjoint if statements are confusing, so clarify
-                    if (g1 == g2 || g1 == "if (...) ")
-                        body += "; these happen inside if statements that have overlapping predicates (make the if statements mutually exclusive, so that they never take effect on the same cycle)";
-                } else if (isWset && isWget2 && base1 == base2) {
-                    body += "both sets input or wire " + errorColored(base1) + ", and reads from it (perhaps through a method), which is forbidden";
-                } else if (isWset && isWhas2 && base1 == base2) {
-                    // NOTE(dsm): whas seems to always fire with wget; print them separately though, in case there's a wset/whas conflict but not wset/wget
-                    body += "both sets input or wire " + errorColored(base1) + " (which has a default value), and reads from it (perhaps through a method), which is forbidden";
+        }
+    } else if (code == "T0003") {
+        // I see these only on mistyped literals, but unbound constructor
+        // is such a general message that who knows where else it may show
+        // up. So leave the translated error general.
+        replace(body, "unbound constructor", "undefined literal, type, or module");
+    } else if (code == "T0004") {
+        replace(body, "unbound variable", "undefined variable or function");
+    } else if (code == "T0007") {
+        replace(body, "unbound type constructor", "undefined type or module");
+    } else if (code == "T0016") {
+        // Error message is good, except when it's an input, so process only that
+        static const std::regex inputRegex("Field `(.*?)___input' is not in the type `(.*?)' which was derived for this expression");
+        std::smatch match;
+        if (std::regex_search(unprocessedBody, match, inputRegex)) {
+            std::string input = match[1];
+            std::string modType = match[2];
+            body = "module " + hlColored(modType) + " does not have an input named " + errorColored("'" + input + "'");
+        }
+    } else if (code == "T0081" || code == "T0083" || code == "T0084") {
+        // Errors related to using a function with the wrong number of arguments
+        // First, the expected/inferred type trailing info is more confusing then helpful (function type noise). So take that out.
+        std::string trailMarker = (code == "T0081")? " Expected type:" : " The expected type is:";
+        auto trailStart = body.find(trailMarker);
+        body = body.substr(0, trailStart);  // safe even if trail is string::npos
+        // Second, if the function is actually a module, don't call it a function :)
+        if (body.find(": mk") != std::string::npos) {
+            replace(body, ": mk", ": ");
+            replace(body, "function", "module");
+        }
+    } else if (code == "G0004") {
+        // Register double-writes and input/wire double-sets
+        static const std::regex conflictRegex("Rule `(.*?)' uses methods that conflict in parallel: (.*?)(\\S+) and (.*?)(\\S+) For the complete expressions");
+        std::smatch match;
+        if (std::regex_search(unprocessedBody, match, conflictRegex)) {
+            std::string rule = match[1];
+            // g1/g2 are the "guards" and may be empty; m1 and m2 are the methods
+            std::string g1 = match[2];
+            std::string m1 = match[3];
+            std::string g2 = match[4];
+            std::string m2 = match[5];
+            bool isWrite = m1.find(".write") != std::string::npos;
+            bool isWset = m1.find(".wset") != std::string::npos;
+            bool isWget2 = m2.find(".wget") != std::string::npos;
+            bool isWhas2 = m2.find(".whas") != std::string::npos;
+            std::string base1 = "'" + m1.substr(0, m1.find(".")) + "'";
+            std::string base2 = "'" + m2.substr(0, m1.find(".")) + "'";
+
+            body = "rule " + errorColored("'" + rule + "'") + " ";
+            if (m1 == m2 && (isWrite || isWset)) {
+                if (isWrite) {
+                    body += "writes to register " + errorColored(base1) + " more than once, which is forbidden";
                 } else {
-                    // Print a generic message, this must be interacting with Bluespec code
-                    body += "cannot call methods " + errorColored(m1) + " and " + errorColored(m2) + " because they conflict";
+                    assert(isWset);
+                    body += "sets input or wire " + errorColored(base1) + " more than once, which is forbidden";
                 }
-            }
-        } else if (code == "G0005") {
-            // Minispec rules must fire every cycle
-            std::regex blockedRegex("The assertion `fire_when_enabled' failed for rule `(.*?)' because it is blocked by rule (.*?) in the scheduler");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, blockedRegex)) {
-                body = "rules " + errorColored(match[1]) + " and " + errorColored(match[2]) +
-                    " conflict and cannot both fire every cycle (e.g., they both try to set the same input of a shared module)";
-            }
-        } else if (code == "G0066") {
-            std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, unsetRegex)) {
-                std::string instance = match[1];
-                body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is never being set";
-            }
-        } else if (code == "G0015") {
-            std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled, but the condition for executing the method could not be proven to be always True: _write");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, unsetRegex)) {
-                // This is a warning, but its gravity is context-dependent. If
-                // we're producing Verilog, then it should stay a warning (or
-                // go away); if this is simulation, then we must promote it to
-                // an error, as it'll actually cause things to misbehave.
-                isError = simOut;
-                std::string instance = match[1];
-                body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is being set only sometimes (at least, I cannot prove that a rule is setting it every cycle; simplify your control flow or add a default value); note: this warning is promoted to an error when producing simulation executables";
+                // Non-disjoint if statements are confusing, so clarify
+                if (g1 == g2 || g1 == "if (...) ")
+                    body += "; these happen inside if statements that have overlapping predicates (make the if statements mutually exclusive, so that they never take effect on the same cycle)";
+            } else if (isWset && isWget2 && base1 == base2) {
+                body += "both sets input or wire " + errorColored(base1) + ", and reads from it (perhaps through a method), which is forbidden";
+            } else if (isWset && isWhas2 && base1 == base2) {
+                // NOTE(dsm): whas seems to always fire with wget; print them separately though, in case there's a wset/whas conflict but not wset/wget
+                body += "both sets input or wire " + errorColored(base1) + " (which has a default value), and reads from it (perhaps through a method), which is forbidden";
+            } else {
+                // Print a generic message, this must be interacting with Bluespec code
+                body += "cannot call methods " + errorColored(m1) + " and " + errorColored(m2) + " because they conflict";
             }
         }
+    } else if (code == "G0005") {
+        // Minispec rules must fire every cycle
+        static const std::regex blockedRegex("The assertion `fire_when_enabled' failed for rule `(.*?)' because it is blocked by rule (.*?) in the scheduler");
+        std::smatch match;
+        if (std::regex_search(unprocessedBody, match, blockedRegex)) {
+            body = "rules " + errorColored(match[1]) + " and " + errorColored(match[2]) +
+                " conflict and cannot both fire every cycle (e.g., they both try to set the same input of a shared module)";
+        }
+    } else if (code == "G0066") {
+        static const std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled");
+        std::smatch match;
+        if (std::regex_search(unprocessedBody, match, unsetRegex)) {
+            std::string instance = match[1];
+            body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is never being set";
+        }
+    } else if (code == "G0015") {
+        static const std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled, but the condition for executing the method could not be proven to be always True: _write");
+        std::smatch match;
+        if (std::regex_search(unprocessedBody, match, unsetRegex)) {
+            // This is a warning, but its gravity is context-dependent. If
+            // we're producing Verilog, then it should stay a warning (or
+            // go away); if this is simulation, then we must promote it to
+            // an error, as it'll actually cause things to misbehave.
+            isError = simOut;
+            std::string instance = match[1];
+            body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is being set only sometimes (at least, I cannot prove that a rule is setting it every cycle; simplify your control flow or add a default value); note: this warning is promoted to an error when producing simulation executables";
+        }
+    }
 
-        // Simplify bsc output: Translated::TypeName -> TypeName, etc.
-        replace(body, "Translated::", "");
-        replace(body, "Vector::Vector", "Vector");
-
-        std::stringstream ss;
-        ss << hlColored(loc + ":") << " " << (isError? errorColored("error:") : warnColored("warning:")) << " " << body << "\n";
-        ss << contextStrFn(line, lineChar, elems);
-        //ss << code;
-        reportMsg(isError, ss.str(), sm.getContextInfo(line, lineChar), sm.find(line, lineChar));
+    // Simplify bsc output: Translated::TypeName -> TypeName, etc. With
+    // per-package output, package names are Translated_<file>.
+    for (size_t pos = body.find("Translated"); pos != std::string::npos; pos = body.find("Translated", pos)) {
+        size_t end = pos + strlen("Translated");
+        while (end < body.size() && (isalnum(body[end]) || body[end] == '_')) end++;
+        bool idStart = pos == 0 || !(isalnum(body[pos-1]) || body[pos-1] == '_');
+        if (idStart && matchWord(body, end, "::")) body.erase(pos, end + 2 - pos);
+        else pos = end;
     }
+    replace(body, "Vector::Vector", "Vector");
+
+    Diagnostic diag;
+    diag.loc = loc;
+    diag.message = body;
+    diag.context = contextLinesFn(file, line, lineChar, elems);
+    diag.code = code;
+    report(isError, diag, sm.getContextInfo(file, line, lineChar), sm.find(file, line, lineChar));
 }
 
-struct RunResult {
-    std::string output;
-    int exitCode;
-};
+// Time report (--time-report). Printed at exit, so it covers failed compiles.
+static TimeReport timeReport;
+static std::string timeReportFormat = "";  // "" (disabled), "text", or "json"
+static double diagWallSecs = 0.0;
+static double diagCpuSecs = 0.0;
 
-RunResult run(const std::string& cmd) {
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) error("cannot invoke subprocess");
-    std::stringstream bscOutput;
-    size_t bufSize = 1024;
-    char buf[bufSize];
-    while (!feof(pipe)) if (fgets(buf, bufSize, pipe)) bscOutput << buf;
-    RunResult res;
-    res.output = bscOutput.str();
-    res.exitCode = pclose(pipe);
-    return res;
+static void printTimeReport() {
+    timeReport.addPhase({"diagnostic translation", diagWallSecs, diagCpuSecs, TimeReport::peakRssKb(), false});
+    ElabStats es = getElabStats();
+    timeReport.addCounter("elaboration steps", es.elabSteps);
+    timeReport.addCounter("parametric instances", es.parametricInstances);
+    timeReport.addCounter("loop iterations", es.loopIterations);
+    timeReport.addCounter("auto-synthesized modules", es.autoSynthesized);
+    timeReport.addCounter("auto-noinlined functions", es.autoNoinlined);
+    std::cout.flush();
+    std::cerr << timeReport.str(timeReportFormat == "json");
 }
 
 static std::string tmpDirStr = "";
@@ -375,6 +558,12 @@ void cleanupTmpDir() {
     std::filesystem::remove_all(tmpDirStr);
 }
 
+static std::string evalDirStr = "";
+void cleanupEvalDir() {
+    if (!evalDirStr.size()) return;
+    std::filesystem::remove_all(evalDirStr);
+}
+
 [[noreturn]] void uncaughtExceptionHandler() noexcept {
     // dsm: Why is C++ so retarded? rethrow?
     std::string exStr = "??";
@@ -391,25 +580,36 @@ void cleanupTmpDir() {
     panic("uncaught exception: %s", exStr.c_str());
 }
 
-int main(int argc, const char* argv[]) {
-    std::set_terminate(uncaughtExceptionHandler);
+int compile(int argc, const char* argv[]) {
+    timeReport.reset();
+    diagWallSecs = 0.0;
+    diagCpuSecs = 0.0;
 
     argparse::ArgumentParser args;
     args.add_argument("inputFile")
         .help("input file")
         .default_value(std::string(""));
     args.add_argument("topLevel")
-        .help("name of module/function to compile (if not given, checks input for correctness)")
+        .help("name of module/function to compile (if not given, checks input for correctness); multiple top-levels may be given")
         .default_value(std::string(""));
     args.add_argument("-o", "--output")
-        .help("type of output(s) desired [default: sim]\n                  sim: simulation executable\n                  verilog (or v): Verilog file\n                  bsv: Bluespec file\n                  Use commas to specify multiple outputs (e.g., -o sim,verilog)")
+        .help("type of output(s) desired [default: sim]\n                  sim: simulation executable\n                  vsim: Verilator simulation executable (faster for long simulations)\n                  verilog (or v): Verilog file\n                  bsv: Bluespec file\n                  layout: JSON table of the bit layouts of types and modules (for synth)\n                  Use commas to specify multiple outputs (e.g., -o sim,verilog)")
         .default_value(std::string("sim"));
     args.add_argument("-p", "--path")
         .help("path for source files (for multiple directories, use : as separator)")
         .default_value(std::string(""));
     args.add_argument("-b", "--bscOpts")
-        .help("extra options for the Bluespec compiler (use quotes for multiple options)")
+        .help("extra options for the Bluespec compiler (use quotes for multiple options; if they include +RTS, msc does not pick bsc's runtime settings)")
         .default_value(std::string(""));
+    args.add_argument("--build-dir")
+        .help("emit one Bluespec package per file into this directory, and keep bsc's intermediate files there (reusing it across compiles makes bsc rebuild only changed packages)")
+        .default_value(std::string(""));
+    args.add_argument("--batch")
+        .help("run the compile jobs in the given JSON manifest, reporting one JSON record per job (see batch.cpp)");
+    args.add_argument("--server")
+        .help("run a persistent compile server on the given Unix socket (see server.cpp)");
+    args.add_argument("--client")
+        .help("send this compile to the server on the given Unix socket (set MSC_SERVER to do so by default)");
     args.add_argument("-v", "--version")
         .help("show version information")
         .default_value(false)
@@ -430,27 +630,118 @@ int main(int argc, const char* argv[]) {
         .help("maximum elaboration depth")
         .default_value((uint64_t) 1000)
         .scan<'u', uint64_t>();
+    args.add_argument("-j", "--jobs")
+        .help("maximum number of Bluespec compiler processes to run concurrently (0 means number of cores); under make -jN, msc also shares make's jobserver")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
+    args.add_argument("--auto-synthesize")
+        .help("automatically give modules separate synthesis boundaries, so bsc compiles each one once [default: off]\n                  off: only top-levels and modules with msc_pragma:synthesize\n                  repeated: also modules instantiated more than once in the design, if instances x size of their Bluespec code reaches --auto-synthesize-threshold\n                  all: also all other modules that can be synthesized separately")
+        .default_value(std::string("off"));
+    args.add_argument("--auto-synthesize-threshold")
+        .help("with --auto-synthesize=repeated, minimum instances x size of a module's Bluespec code, including inlined submodules (in bytes), to give it a synthesis boundary")
+        .default_value((uint64_t) 4096)
+        .scan<'u', uint64_t>();
+    args.add_argument("--noinline-threshold")
+        .help("automatically mark functions called from several places (* noinline *), so bsc compiles them once, when call sites x size of their Bluespec code (in bytes) reaches this threshold (0 disables)")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
+    args.add_argument("--vsim-threads")
+        .help("number of threads of Verilator simulation executables (0 means min(4, number of cores))")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
+    args.add_argument("--bsvimport-cache")
+        .help("directory where BSV packages imported with bsvimport are compiled once and reused across runs (default: ~/.cache/minispec/bsvimport; none disables)")
+        .default_value(std::string(""));
+    args.add_argument("--diagnostics-format")
+        .help("how to report errors, warnings, and outputs [default: text]\n                  text: colored text on stderr (outputs on stdout)\n                  json: one JSON record per line on stdout\n                  sarif: a SARIF 2.1.0 log on stdout")
+        .default_value(std::string("text"));
+    args.add_argument("--time-report")
+        .help("report wall time, CPU time, and peak memory of each compilation phase on stderr (use --time-report=json for JSON)")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--eval")
+        .help("evaluate this expression (in the context of inputFile, if given) and print its value; use multiple times to evaluate several expressions with a single compile")
+        .append();
+    args.add_argument("--bsc-max-errors")
+        .help("stop the Bluespec compiler after this many errors (0 means no limit)")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
 
+    // argparse takes a fixed number of positional arguments, so set aside all
+    // top-levels beyond the first one
+    std::vector<const char*> argvToParse = {argv[0]};
+    std::vector<std::string> extraTopLevels;
+    std::list<std::string> splitArgs;  // --opt=value args; a list keeps c_str()s valid
     try {
-        args.parse_args(argc, argv);
+        uint32_t positionals = 0;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            // argparse does not take --opt=value, so split those here. The
+            // format of --time-report is optional, so it's handled separately.
+            if (arg.find("--") == 0 && arg.find('=') != std::string::npos) {
+                std::string value = arg.substr(arg.find('=') + 1);
+                arg = arg.substr(0, arg.find('='));
+                if (arg == "--time-report") {
+                    timeReportFormat = value;
+                    if (timeReportFormat != "text" && timeReportFormat != "json")
+                        error("invalid time report format %s (must be text or json)", errorColored("'" + timeReportFormat + "'").c_str());
+                    argvToParse.push_back("--time-report");
+                } else {
+                    splitArgs.push_back(arg);
+                    splitArgs.push_back(value);
+                }
+                continue;
+            }
+            if (arg.size() > 1 && arg[0] == '-') {
+                argvToParse.push_back(argv[i]);
+                size_t optArgs = 0;
+                try {
+                    optArgs = args[arg].maybe_nargs().value_or(0);
+                } catch (const std::logic_error&) {}  // unknown args are caught by argparse
+                for (size_t j = 0; j < optArgs && i + 1 < argc; j++) argvToParse.push_back(argv[++i]);
+            } else if (positionals++ < 2) {
+                argvToParse.push_back(argv[i]);
+            } else {
+                extraTopLevels.push_back(arg);
+            }
+        }
+        for (auto& a : splitArgs) argvToParse.push_back(a.c_str());
+        args.parse_args(argvToParse.size(), argvToParse.data());
     } catch (const std::exception& err) {
         error("could not parse command-line arguments: %s\n       run %s --help for information on command-line options",
                 err.what(), argv[0]);
     }
 
+    if (args.get<bool>("--time-report")) {
+        if (timeReportFormat.empty()) timeReportFormat = "text";
+        atexit(printTimeReport);
+    }
+
     if (args.get<bool>("--version")) {
         std::cout << "Minispec compiler version " << getVersion() << "\n";
         exit(0);
     }
 
+    std::vector<std::string> evalExprs;
+    if (args.is_used("--eval")) evalExprs = args.get<std::vector<std::string>>("--eval");
+    bool evalMode = !evalExprs.empty();
+
     std::string inputFile = args.get<std::string>("inputFile");
-    if (inputFile == "") error("no input file");
-    std::string topLevel = args.get<std::string>("topLevel");
+    if (inputFile == "" && !evalMode) error("no input file");
+    std::vector<std::string> topLevels;
+    if (args.get<std::string>("topLevel") != "") topLevels.push_back(args.get<std::string>("topLevel"));
+    for (auto& topLevel : extraTopLevels)
+        if (std::find(topLevels.begin(), topLevels.end(), topLevel) == topLevels.end())
+            topLevels.push_back(topLevel);
+    if (evalMode && !topLevels.empty()) error("--eval does not take a top-level (it evaluates expressions in module Eval___)");
+    if (evalMode && args.is_used("--output")) error("--eval does not take --output");
 
     // Find desired outputs
     bool bsvOut = false;
     bool simOut = false;
+    bool vsimOut = false;
     bool verilogOut = false;
+    bool layoutOut = false;
     bool defaultOut = !args.is_used("--output");
     {
         std::string outsArg = args.get<std::string>("--output");
@@ -461,16 +752,64 @@ int main(int argc, const char* argv[]) {
         while (iss >> out) {
             if (out == "bsv") bsvOut = true;
             else if (out == "sim") simOut = true;
+            else if (out == "vsim") vsimOut = true;
             else if (out == "verilog" || out == "v") verilogOut = true;
+            else if (out == "layout") layoutOut = true;
             else error("invalid output type %s (full argument: %s)",
                     errorColored("'" + out + "'").c_str(),
                     errorColored("'" + outsArg + "'").c_str());
         }
     }
 
+    // With --eval, compile module Eval___, which evaluates the expressions
+    // and imports inputFile, if given. Work in a private directory so that
+    // concurrent evals do not clash, so make all user paths absolute.
+    std::string pathArg = args.get<std::string>("--path");
+    std::string buildDir = args.get<std::string>("--build-dir");
+    std::string userCwd = std::filesystem::current_path();
+    if (evalMode) {
+        std::string importName;
+        std::stringstream evalPathSs;
+        if (!inputFile.empty()) {
+            importName = std::filesystem::path(inputFile).stem();
+            evalPathSs << std::filesystem::absolute(inputFile).remove_filename().string() << ":";
+        }
+        std::stringstream pathSs(pathArg);
+        for (std::string dir; std::getline(pathSs, dir, ':'); )
+            evalPathSs << (dir.empty()? userCwd : std::filesystem::absolute(dir).string()) << ":";
+        evalPathSs << userCwd;
+        pathArg = evalPathSs.str();
+        if (!buildDir.empty()) buildDir = std::filesystem::absolute(buildDir);
+
+        std::string evalDir = std::filesystem::temp_directory_path() / "msc_eval_XXXXXX";
+        if (!mkdtemp(&evalDir[0])) error("could not create temporary directory");
+        if (args.get<bool>("--keep-tmps")) {
+            reportOutput("tmpdir", evalDir, "storing temporary files in " + hlColored(evalDir));
+        } else {
+            evalDirStr = evalDir;
+            atexit(cleanupEvalDir);
+        }
+        if (chdir(evalDir.c_str()) != 0) error("could not enter temporary directory %s", evalDir.c_str());
+
+        inputFile = "Eval___.ms";
+        std::ofstream evalStream(inputFile);
+        if (!evalStream.good()) error("Could not open output file %s", inputFile.c_str());
+        evalStream << getEvalModuleCode(importName, evalExprs);
+        evalStream.close();
+        topLevels = {"Eval___"};
+        simOut = true;
+        bsvOut = vsimOut = verilogOut = layoutOut = false;
+    }
+
     // Other options
-    initReporting(args.get<bool>("--all-errors"));
+    std::string diagFormat = args.get<std::string>("--diagnostics-format");
+    if (diagFormat == "text") initReporting(args.get<bool>("--all-errors"), DIAG_TEXT);
+    else if (diagFormat == "json") initReporting(args.get<bool>("--all-errors"), DIAG_JSON);
+    else if (diagFormat == "sarif") initReporting(args.get<bool>("--all-errors"), DIAG_SARIF);
+    else error("invalid --diagnostics-format %s (must be text, json, or sarif)", errorColored("'" + diagFormat + "'").c_str());
     setElabLimits(args.get<uint64_t>("--max-elab-steps"), args.get<uint64_t>("--max-elab-depth"));
+    uint32_t jobs = args.get<uint64_t>("--jobs");
+    if (!jobs) jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
 
     // Construct the Minispec path, composed of: (1) the input file's
     // directory, (2) the directories in the --path flag, and (3) the current
@@ -478,7 +817,7 @@ int main(int argc, const char* argv[]) {
     // corner cases, but without clobbering same-dir includes.
     std::vector<std::string> path;
     path.push_back(std::filesystem::path(inputFile).remove_filename());
-    std::stringstream pathSs(args.get<std::string>("--path"));
+    std::stringstream pathSs(pathArg);
     for (std::string dir; std::getline(pathSs, dir, ':'); )
         path.push_back(dir);
     path.push_back("");
@@ -495,55 +834,314 @@ int main(int argc, const char* argv[]) {
     path = dedup(path);
 
     // Parse all files. Exits on lexer/parser errors.
+    timeReport.beginPhase("parse");
     std::vector<MinispecParser::PackageDefContext*> parsedTrees =
         parseFileAndImports(inputFile, path);
+    timeReport.endPhase();
 
     // Translate files to Bluespec. Exits on elaboration errors.
-    SourceMap sm = translateFiles(parsedTrees, topLevel);
-
-    // Save translated code
-    char tmpDir[128];
-    sprintf(tmpDir, "tmp_msc_XXXXXX");
-    if (mkdtemp(tmpDir) != tmpDir) error("could not create temporary directory");
-    if (args.get<bool>("--keep-tmps")) {
-        std::cout << "storing temporary files in " << hlColored(std::string(tmpDir)) << "\n";
+    bool perPackage = !buildDir.empty();
+    timeReport.beginPhase("elaborate and translate");
+    TranslateOptions translateOptions;
+    translateOptions.perPackage = perPackage;
+    std::string autoSynthesize = args.get<std::string>("--auto-synthesize");
+    if (autoSynthesize == "off") translateOptions.autoSynthesize = AUTOSYNTH_OFF;
+    else if (autoSynthesize == "repeated") translateOptions.autoSynthesize = AUTOSYNTH_REPEATED;
+    else if (autoSynthesize == "all") translateOptions.autoSynthesize = AUTOSYNTH_ALL;
+    else error("invalid --auto-synthesize policy %s (must be off, repeated, or all)", errorColored("'" + autoSynthesize + "'").c_str());
+    translateOptions.autoSynthesizeThreshold = args.get<uint64_t>("--auto-synthesize-threshold");
+    translateOptions.noinlineThreshold = args.get<uint64_t>("--noinline-threshold");
+    SourceMap sm = translateFiles(parsedTrees, topLevels, translateOptions);
+    timeReport.endPhase();
+
+    // Most evals need no bsc: msc can evaluate them directly
+    if (evalMode) {
+        timeReport.beginPhase("eval");
+        std::vector<std::string> results;
+        bool evaluated = evalNatively(parsedTrees, evalExprs, results);
+        timeReport.endPhase();
+        if (evaluated) {
+            for (auto& result : results) std::cout << result << "\n";
+            return 0;
+        }
+    }
+
+    // Save translated code. With --build-dir, files are rewritten only when
+    // they change, so that bsc -u skips unchanged packages.
+    timeReport.beginPhase("write bsv");
+    std::string workDir;
+    if (perPackage) {
+        std::error_code ec;
+        std::filesystem::create_directories(buildDir, ec);
+        if (ec) error("could not create build directory %s", buildDir.c_str());
+        workDir = buildDir;
     } else {
-        tmpDirStr = tmpDir;
-        atexit(cleanupTmpDir);
+        char tmpDir[128];
+        sprintf(tmpDir, "tmp_msc_XXXXXX");
+        if (mkdtemp(tmpDir) != tmpDir) error("could not create temporary directory");
+        if (args.get<bool>("--keep-tmps")) {
+            reportOutput("tmpdir", tmpDir, "storing temporary files in " + hlColored(std::string(tmpDir)));
+        } else {
+            tmpDirStr = tmpDir;
+            atexit(cleanupTmpDir);
+        }
+        workDir = tmpDir;
     }
-    std::string bsvFileName = tmpDir + std::string("/Translated.bsv");
-    std::ofstream stream(bsvFileName);
-    if (!stream.good()) error("Could not open output file %s", bsvFileName.c_str());
-    stream << sm.getCode() << "\n";
-    stream.close();
+    for (size_t i = 0; i < sm.getNumFiles(); i++) {
+        std::string bsvFileName = workDir + "/" + sm.getFileName(i);
+        std::string code = sm.getCode(i) + "\n";
+        if (perPackage) {
+            std::ifstream oldStream(bsvFileName);
+            if (oldStream.good() && std::string(std::istreambuf_iterator<char>(oldStream), {}) == code) continue;
+        }
+        std::ofstream stream(bsvFileName);
+        if (!stream.good()) error("Could not open output file %s", bsvFileName.c_str());
+        stream << code;
+        stream.close();
+    }
+    timeReport.endPhase();
 
-    // bsc path is simply the path with a corrected base for relative dirs
+    // bsc runs in workDir, so use absolute paths for sources and outputs
+    std::string cwd = std::filesystem::current_path();
     std::stringstream bscPath;
     for (std::string dir : path) {
-        auto path = std::filesystem::path(dir);
-        bscPath << (path.is_relative()? "'../" : "'") << dir << "':";
+        bscPath << "'" << (dir.empty()? cwd : std::filesystem::absolute(dir).string()) << "':";
     }
     bscPath << "%:+";
-    std::string bscOpts = "-p " + bscPath.str() + " " + args.get<std::string>("--bscOpts");
-    //std::cout << "BSC options: " << bscOpts << "\n";
-
-    // Invoke Bluespec compiler and check for type errors
-    auto runBscCmd = [&](const std::string& cmd) {
-        //std::cout << cmd << "\n";
-        auto compileRes = run(cmd);
-        reportBluespecOutput(compileRes.output, sm, topLevel, simOut);
+    // Pick bsc's runtime (RTS) stack, heap, and GC settings for the size of
+    // the design, unless the user passed their own. Settings that worked for
+    // the same design before are kept in the build directory, or in the
+    // user's cache directory without --build-dir.
+    std::string userBscOpts = args.get<std::string>("--bscOpts");
+    bool tuneRts = userBscOpts.find("+RTS") == std::string::npos && !getenv("GHCRTS");
+    BscRtsSettings rts = {};
+    bool rtsGrown = false;
+    std::string rtsCacheFile, rtsKey;
+    if (tuneRts) {
+        // Key saved settings on what identifies the design (input file, top
+        // levels, and bsc options), so edits to the code still find them
+        std::string design = userBscOpts + "\n";
+        if (!inputFile.empty()) design += std::filesystem::absolute(inputFile).lexically_normal().string();
+        for (auto& topLevel : topLevels) design += "\n" + topLevel;
+        rtsKey = getBscRtsKey(design);
+        uint64_t codeBytes = 0;
+        for (size_t i = 0; i < sm.getNumFiles(); i++) codeBytes += sm.getCode(i).size();
+        rts = getDefaultBscRtsSettings(codeBytes, jobs);
+        BscRtsSettings savedRts;
+        if (perPackage) rtsCacheFile = workDir + "/.msc-bsc-rts";
+        else if (!getUserCacheDir().empty()) rtsCacheFile = getUserCacheDir() + "/bsc-rts";
+        if (!rtsCacheFile.empty() && loadBscRtsSettings(rtsCacheFile, rtsKey, savedRts))
+            rts = maxBscRtsSettings(rts, savedRts);
+    }
+
+    std::string cdWorkDir = "cd '" + workDir + "' && ";
+
+    // Invoke Bluespec compiler and check for type errors. Diagnostics are
+    // translated while bsc runs, and bsc is stopped early if it produces more
+    // than --bsc-max-errors errors. Multiple commands run concurrently.
+    // Commands that run out of stack or heap space are retried once with
+    // larger RTS limits.
+    uint64_t bscMaxErrors = args.get<uint64_t>("--bsc-max-errors");
+    auto runBscCmds = [&](const std::vector<std::string>& cmds, const std::vector<std::string>& labels) {
+        std::vector<std::unique_ptr<BluespecOutputTranslator>> translators;
+        auto makeLineFn = [bscMaxErrors](BluespecOutputTranslator* translator) -> LineFn {
+            return [translator, bscMaxErrors](const std::string& line) {
+                auto start = std::chrono::steady_clock::now();
+                double startCpu = TimeReport::cpuSecs();
+                translator->addLine(line);
+                diagWallSecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                diagCpuSecs += TimeReport::cpuSecs() - startCpu;
+                return !bscMaxErrors || translator->getNumErrors() < bscMaxErrors;
+            };
+        };
+        std::vector<LineFn> lineFns;
+        for (size_t i = 0; i < cmds.size(); i++) {
+            //std::cout << cmds[i] << "\n";
+            translators.emplace_back(new BluespecOutputTranslator(sm, topLevels, simOut || vsimOut));
+            lineFns.push_back(makeLineFn(translators.back().get()));
+        }
+        auto results = runParallel(cmds, jobs, lineFns);
+        for (size_t i = 0; i < cmds.size(); i++) {
+            auto& res = results[i];
+            timeReport.addPhase({"bsc " + labels[i], res.wallSecs, res.cpuSecs, res.peakRssKb, true});
+        }
+
+        std::vector<size_t> retries;
+        for (size_t i = 0; i < cmds.size(); i++) {
+            if (tuneRts && results[i].exitCode != 0 && !translators[i]->getNumErrors() &&
+                    isBscRtsExhausted(results[i].output))
+                retries.push_back(i);
+        }
+        if (!retries.empty()) {
+            // Only the retried commands run concurrently, so split memory among them
+            uint32_t retryJobs = std::min((uint32_t) retries.size(), jobs);
+            BscRtsSettings grownRts = growBscRtsSettings(rts, retryJobs);
+            warn("the Bluespec compiler ran out of stack or heap space, retrying with %s", hlColored(grownRts.str()).c_str());
+            std::vector<std::string> retryCmds;
+            std::vector<LineFn> retryLineFns;
+            for (auto i : retries) {
+                std::string cmd = cmds[i];
+                replace(cmd, rts.str(), grownRts.str());
+                retryCmds.push_back(cmd);
+                translators[i].reset(new BluespecOutputTranslator(sm, topLevels, simOut || vsimOut));
+                retryLineFns.push_back(makeLineFn(translators[i].get()));
+            }
+            rts = grownRts;
+            rtsGrown = true;
+            auto retryResults = runParallel(retryCmds, jobs, retryLineFns);
+            for (size_t r = 0; r < retries.size(); r++) {
+                auto& res = retryResults[r];
+                timeReport.addPhase({"bsc " + labels[retries[r]] + " (retry)", res.wallSecs, res.cpuSecs, res.peakRssKb, true});
+                results[retries[r]] = res;
+            }
+        }
+
+        for (auto& translator : translators) {
+            if (bscMaxErrors && translator->getNumErrors() >= bscMaxErrors) translator->discard();
+            else translator->finish();
+        }
         exitIfErrors();
-	if (compileRes.exitCode != 0) {
-            // If we didn't parse any error but bsc failed, this is typically
-            // because bsc wasn't found. So print the output.
-            error("could not compile file: %s", compileRes.output.c_str());
+        for (auto& res : results) {
+            if (res.exitCode != 0) {
+                // If we didn't parse any error but bsc failed, this is typically
+                // because bsc wasn't found. So print the output.
+                error("could not compile file: %s", res.output.c_str());
+            }
+        }
+        // Remember settings only once a retry with larger limits succeeded
+        if (rtsGrown && !rtsCacheFile.empty()) {
+            saveBscRtsSettings(rtsCacheFile, rtsKey, rts);
+            rtsGrown = false;
         }
     };
+    auto runBscCmd = [&](const std::string& cmd, const std::string& label) { runBscCmds({cmd}, {label}); };
 
-    std::string outName = topLevel;
-    if (outName == "") {
-        outName = std::filesystem::path(inputFile).stem();
-    } else {
+    // Compile the BSV packages imported with bsvimport (and found on the
+    // path) into persistent bdirs (see bsvcache.h), once per kind of compile,
+    // and return those bdirs for bsc's path. bsc -u then reuses their .bo
+    // files instead of recompiling the packages into workDir on every run.
+    // bdirs stay locked (shared) until msc exits, so other msc processes
+    // don't rewrite them while this one reads them. bdirs are locked
+    // exclusively only to rebuild stale .bo files, so compiles that find
+    // them up to date run concurrently.
+    std::string bsvImportCacheDir = args.get<std::string>("--bsvimport-cache");
+    if (bsvImportCacheDir.empty() && !getUserCacheDir().empty()) bsvImportCacheDir = getUserCacheDir() + "/bsvimport";
+    else if (bsvImportCacheDir == "none") bsvImportCacheDir = "";
+    std::vector<std::tuple<std::string, std::string>> bsvImportFiles;  // (source dir, file)
+    {
+        std::unordered_set<std::string> bsvImportNames;
+        for (auto tree : parsedTrees) {
+            for (auto stmt : tree->packageStmt()) {
+                if (!stmt->bsvImportDecl()) continue;
+                for (auto id : stmt->bsvImportDecl()->upperCaseIdentifier()) {
+                    if (!bsvImportNames.insert(id->getText()).second) continue;
+                    for (std::string dir : path) {
+                        std::string srcDir = dir.empty()? cwd : std::filesystem::absolute(dir).string();
+                        std::string file = srcDir + "/" + id->getText() + ".bsv";
+                        if (!std::filesystem::exists(file)) continue;
+                        bsvImportFiles.push_back({srcDir, file});
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    std::string bscVersion;
+    std::unordered_map<std::string, std::string> bsvImportPaths;  // by kind of compile
+    auto getBsvImportPath = [&](const std::string& kind) -> std::string {
+        if (bsvImportCacheDir.empty() || bsvImportFiles.empty()) return "";
+        auto it = bsvImportPaths.find(kind);
+        if (it != bsvImportPaths.end()) return it->second;
+
+        std::string flags = (kind == "sim")? "-sim" : (kind == "verilog" || kind == "vsim")? "-verilog -D __VERILOG__" : "";
+        if (bscVersion.empty()) {
+            auto res = run("bsc -v 2>&1");
+            bscVersion = res.output.substr(0, res.output.find('\n'));
+        }
+        std::vector<std::string> bdirs;
+        std::unordered_map<std::string, std::vector<std::string>> bdirFiles;
+        for (auto& [srcDir, file] : bsvImportFiles) {
+            std::string bdir = getBsvImportBdir(bsvImportCacheDir, srcDir, bscVersion, flags + " " + userBscOpts);
+            if (bdir.empty()) {
+                warn("could not use bsvimport cache directory %s, compiling %s on every run",
+                        hlColored(bsvImportCacheDir).c_str(), hlColored(file).c_str());
+                continue;
+            }
+            if (!bdirFiles.count(bdir)) bdirs.push_back(bdir);
+            bdirFiles[bdir].push_back(file);
+        }
+
+        // Lock all bdirs in sorted order, holding none of them beforehand,
+        // so concurrent msc processes can't deadlock (flock() conversions
+        // are not atomic, so upgrading one of several held locks could).
+        // Start with shared locks, and retake them with exclusive locks on
+        // the stale bdirs until those are all held exclusively.
+        std::sort(bdirs.begin(), bdirs.end());
+        std::vector<std::string> srcDirs;
+        for (std::string dir : path) srcDirs.push_back(dir.empty()? cwd : std::filesystem::absolute(dir).string());
+        std::unordered_set<std::string> exclusiveBdirs;
+        std::vector<std::string> staleBdirs;
+        while (true) {
+            for (auto& bdir : bdirs) unlockBsvImportBdir(bdir);
+            for (auto& bdir : bdirs)
+                if (!lockBsvImportBdir(bdir, exclusiveBdirs.count(bdir)))
+                    error("could not lock bsvimport cache directory %s", hlColored(bdir).c_str());
+            staleBdirs.clear();
+            bool relock = false;
+            for (auto& bdir : bdirs) {
+                if (isBsvImportBdirUpToDate(bdir, bdirFiles[bdir], srcDirs)) continue;
+                staleBdirs.push_back(bdir);
+                if (exclusiveBdirs.insert(bdir).second) relock = true;
+            }
+            if (!relock) break;
+        }
+        // Other processes may have rebuilt some bdirs while we waited.
+        // Downgrading to a shared lock never blocks.
+        for (auto& bdir : exclusiveBdirs)
+            if (std::find(staleBdirs.begin(), staleBdirs.end(), bdir) == staleBdirs.end())
+                lockBsvImportBdir(bdir, false);
+
+        // Packages that share a bdir may share imports, so compile them one
+        // after the other; different bdirs compile concurrently
+        std::vector<std::string> cmds, labels;
+        for (auto& bdir : staleBdirs) {
+            std::stringstream cmd;
+            cmd << "(" << cdWorkDir;
+            for (size_t i = 0; i < bdirFiles[bdir].size(); i++) {
+                if (i) cmd << " && ";
+                cmd << "bsc " << flags << " -u -bdir '" << bdir << "' -vdir '" << bdir << "' -info-dir '" << bdir
+                    << "' -p '" << bdir << "':" << bscPath.str() << " " << userBscOpts;
+                if (tuneRts) cmd << " " << rts.str();
+                cmd << " '" << bdirFiles[bdir][i] << "'";
+            }
+            cmd << ") 2>&1 >/dev/null";
+            cmds.push_back(cmd.str());
+            labels.push_back("bsvimport " + kind + " " + std::filesystem::path(bdirFiles[bdir][0]).parent_path().string());
+        }
+        if (!cmds.empty()) runBscCmds(cmds, labels);
+        for (auto& bdir : staleBdirs) lockBsvImportBdir(bdir, false);
+
+        std::string res;
+        for (auto& bdir : bdirs) res += "'" + bdir + "':";
+        bsvImportPaths[kind] = res;
+        return res;
+    };
+
+    // With --build-dir, each kind of compile keeps its own bsc output
+    // directory, as e.g. sim and Verilog compiles produce different .bo files
+    auto bscOpts = [&](const std::string& bdir) {
+        std::string opts = "-p ";
+        if (perPackage) {
+            std::filesystem::create_directories(workDir + "/" + bdir);
+            opts = "-bdir " + bdir + " -vdir " + bdir + " -info-dir " + bdir + " -p " + bdir + ":";
+        }
+        opts += getBsvImportPath(bdir) + bscPath.str() + " " + userBscOpts;
+        if (tuneRts) opts += " " + rts.str();
+        return opts;
+    };
+    //std::cout << "BSC options: " << bscOpts("") << "\n";
+
+    auto getOutName = [](std::string outName) {
         // Sanitize parametrics
         replace(outName, "#", "_");
         replace(outName, ",", "_");
@@ -552,40 +1150,168 @@ int main(int argc, const char* argv[]) {
         replace(outName, " ", "");
         replace(outName, "'", "");
         replace(outName, "\t", "");
+        return outName;
+    };
+    std::vector<std::string> outNames;
+    for (auto& topLevel : topLevels) {
+        outNames.push_back(getOutName(topLevel));
+        for (size_t i = 0; i < outNames.size() - 1; i++) {
+            if (outNames[i] == outNames.back()) {
+                error("top-levels %s and %s produce the same output name, %s",
+                        errorColored("'" + topLevels[i] + "'").c_str(),
+                        errorColored("'" + topLevel + "'").c_str(),
+                        hlColored(outNames.back()).c_str());
+            }
+        }
     }
+    auto& topModules = sm.getTopModules();
     bool typechecked = false;
 
     if (simOut) {
-        if (topLevel.size() && isupper(topLevel[0])) {
+        // Only modules can be simulated
+        std::vector<size_t> simTops;
+        for (size_t i = 0; i < topLevels.size(); i++) {
+            if (isupper(topLevels[i][0])) {
+                simTops.push_back(i);
+            } else if (!defaultOut) {
+                warn("you asked for sim output but %s is a top-level function, which can't be simulated, so not producing its simulation executable",
+                        errorColored("'" + topLevels[i] + "'").c_str());
+            }
+        }
+        if (topLevels.empty() && !defaultOut) {
+            warn("you asked for sim output but did not provide a top-level module, so not producing simulation executable");
+        }
+
+        if (simTops.size()) {
+            // Generate all top-level modules in a single bsc invocation
+            // With --build-dir, top-levels carry (* synthesize *) instead of -g
             std::stringstream cmd;
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -sim -g '" << sm.getTopModule() << "' -u Translated.bsv) 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
+            cmd << "(" << cdWorkDir << "bsc " << bscOpts("sim") << " -sim";
+            if (!perPackage) for (auto i : simTops) cmd << " -g '" << topModules[i] << "'";
+            cmd << " -u Translated.bsv) 2>&1 >/dev/null";
+            runBscCmd(cmd.str(), "sim compile");
             typechecked = true;
 
-            // Link simulation executable
-            cmd.str("");
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -sim -e '" <<  sm.getTopModule() << "' -o '../" << outName << "') 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
-            std::cout << "produced simulation executable " << hlColored(outName) << "\n";
-        } else if (!defaultOut) {
-            const char* problem = (topLevel == "")?
-                "did not provide a top-level module" :
-                "specified a top-level function, which can't be simulated";
-            warn("you asked for sim output but %s, so not producing simulation executable", problem);
+            // Link simulation executables. With multiple top-levels, links run
+            // concurrently, so give each its own directory for intermediate files.
+            std::vector<std::string> linkCmds, linkLabels;
+            for (auto i : simTops) {
+                std::string simDir = perPackage? "sim/" + topModules[i] :
+                    (simTops.size() > 1)? "sim_" + std::to_string(i) : "";
+                cmd.str("");
+                cmd << "(" << cdWorkDir;
+                if (simDir.size()) cmd << "mkdir -p " << simDir << " && ";
+                cmd << "bsc " << bscOpts("sim") << " -sim ";
+                if (simDir.size()) cmd << "-simdir " << simDir << " ";
+                cmd << "-e '" << topModules[i] << "' -o '" << cwd << "/" << outNames[i] << "') 2>&1 >/dev/null";
+                linkCmds.push_back(cmd.str());
+                linkLabels.push_back("sim link " + topLevels[i]);
+            }
+            runBscCmds(linkCmds, linkLabels);
+            if (!evalMode) for (auto i : simTops)
+                reportOutput("sim", outNames[i], "produced simulation executable " + hlColored(outNames[i]));
+        }
+    }
+
+    if (vsimOut) {
+        std::vector<size_t> vsimTops;
+        for (size_t i = 0; i < topLevels.size(); i++) {
+            if (isupper(topLevels[i][0])) {
+                vsimTops.push_back(i);
+            } else {
+                warn("you asked for vsim output but %s is a top-level function, which can't be simulated, so not producing its simulation executable",
+                        errorColored("'" + topLevels[i] + "'").c_str());
+            }
+        }
+        if (topLevels.empty()) {
+            warn("you asked for vsim output but did not provide a top-level module, so not producing simulation executable");
+        }
+
+        if (vsimTops.size()) {
+            // Produce Verilog for the top-levels and all their synthesized
+            // submodules, listing the library modules they use
+            std::string vdir = perPackage? "vsim" : ".";
+            std::stringstream cmd;
+            cmd << "(" << cdWorkDir << "bsc " << bscOpts("vsim") << " -verilog -D __VERILOG__ -show-module-use";
+            if (!perPackage) for (auto i : vsimTops) cmd << " -g '" << topModules[i] << "'";
+            cmd << " -u Translated.bsv) 2>&1 >/dev/null";
+            runBscCmd(cmd.str(), "vsim verilog compile");
+            typechecked = true;
+
+            std::string libDir = getBscVerilogLibDir();
+            if (libDir.empty()) error("could not find the Verilog library of the Bluespec compiler (is bsc in your $PATH?)");
+            std::string vdirPath = workDir + "/" + vdir;
+            auto libFiles = getVsimLibFiles(vdirPath, libDir);
+            std::vector<std::string> vFiles;
+            for (auto& entry : std::filesystem::directory_iterator(vdirPath))
+                if (entry.path().extension() == ".v") vFiles.push_back(entry.path().filename());
+
+            // Build a multithreaded Verilator model and harness per top-level.
+            // Builds run concurrently, splitting the allowed jobs among them.
+            uint32_t threads = args.get<uint64_t>("--vsim-threads");
+            if (!threads) threads = std::min(4L, std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+            uint32_t buildJobs = std::max(1u, jobs / (uint32_t) vsimTops.size());
+            std::vector<std::string> vsimCmds;
+            for (auto i : vsimTops) {
+                const std::string& top = topModules[i];
+                std::string objDir = vdir + "/obj_" + top;
+                std::string harnessFile = workDir + "/" + vdir + "/" + top + "_vsim.cpp";
+                std::ofstream harness(harnessFile);
+                if (!harness.good()) error("Could not open output file %s", harnessFile.c_str());
+                harness << getVsimHarness(top);
+                harness.close();
+
+                cmd.str("");
+                cmd << "(" << cdWorkDir << "verilator --cc --exe --build -j " << buildJobs
+                    << " --threads " << threads << " -O3 --x-assign fast --x-initial fast"
+                    << " -Wno-fatal -Wno-lint -Wno-style -Wno-STMTDLY"
+                    << " --top-module '" << top << "' --prefix 'V" << top << "' -Mdir '" << objDir << "'"
+                    << " -y '" << libDir << "' -I'" << vdir << "'";
+                for (auto& vFile : vFiles) cmd << " '" << vdir << "/" << vFile << "'";
+                for (auto& libFile : libFiles) cmd << " '" << libFile << "'";
+                cmd << " '" << top << "_vsim.cpp' -o 'V" << top << "'"
+                    << " && cp '" << objDir << "/V" << top << "' '" << cwd << "/" << outNames[i] << "_vsim') 2>&1";
+                vsimCmds.push_back(cmd.str());
+            }
+            auto results = runParallel(vsimCmds, jobs);
+            for (size_t v = 0; v < vsimTops.size(); v++) {
+                auto& res = results[v];
+                size_t i = vsimTops[v];
+                timeReport.addPhase({"verilator " + topLevels[i], res.wallSecs, res.cpuSecs, res.peakRssKb, true});
+                if (res.exitCode != 0) error("could not build Verilator simulation of %s (is verilator in your $PATH?): %s",
+                        errorColored("'" + topLevels[i] + "'").c_str(), res.output.c_str());
+                reportOutput("vsim", outNames[i] + "_vsim", "produced Verilator simulation executable " + hlColored(outNames[i] + "_vsim"));
+            }
         }
     }
 
     if (verilogOut) {
-        if (topLevel.size()) {
+        if (topLevels.size()) {
             std::stringstream cmd;
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -verilog -D __VERILOG__ -g '" << sm.getTopModule() << "' -u Translated.bsv) 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
+            cmd << "(" << cdWorkDir << "bsc " << bscOpts("verilog") << " -verilog -D __VERILOG__";
+            if (!perPackage) for (auto& topModule : topModules) cmd << " -g '" << topModule << "'";
+            cmd << " -u Translated.bsv) 2>&1 >/dev/null";
+            runBscCmd(cmd.str(), "verilog compile");
             typechecked = true;
 
-            cmd.str("");
-            cmd << "cp '" << tmpDir << "/" << sm.getTopModule() << ".v' '" << outName << ".v'";
-            run(cmd.str());
-            std::cout << "produced verilog output " << hlColored(outName + ".v") << "\n";
+            // Size of the Verilog of the top-levels and their synthesized
+            // submodules and noinline functions, to compare --auto-synthesize
+            // and --noinline-threshold settings
+            uint64_t verilogBytes = 0;
+            std::error_code ec;
+            for (auto& entry : std::filesystem::directory_iterator(workDir + (perPackage? "/verilog" : ""), ec))
+                if (entry.path().extension() == ".v") {
+                    uint64_t size = entry.file_size(ec);
+                    if (!ec) verilogBytes += size;
+                }
+            timeReport.addCounter("verilog bytes", verilogBytes);
+
+            for (size_t i = 0; i < topLevels.size(); i++) {
+                cmd.str("");
+                cmd << "cp '" << workDir << (perPackage? "/verilog/" : "/") << topModules[i] << ".v' '" << outNames[i] << ".v'";
+                run(cmd.str());
+                reportOutput("verilog", outNames[i] + ".v", "produced verilog output " + hlColored(outNames[i] + ".v"));
+            }
         } else if (!defaultOut) {
             warn("you asked for verilog output but did not provide a top-level module or function, so not producing verilog");
         }
@@ -593,19 +1319,75 @@ int main(int argc, const char* argv[]) {
 
     if (!typechecked) {
         std::stringstream cmd;
-        cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -u Translated.bsv) 2>&1 >/dev/null";
-        runBscCmd(cmd.str());
+        cmd << "(" << cdWorkDir << "bsc " << bscOpts("check") << " -u Translated.bsv) 2>&1 >/dev/null";
+        runBscCmd(cmd.str(), "typecheck");
         typechecked = true;
-        std::cout << "no errors found on " << hlColored(inputFile) << "\n";
+        reportOutput("check", inputFile, "no errors found on " + hlColored(inputFile));
     }
 
-    if (bsvOut) {
-        auto cpRes = run("cp " + std::string(tmpDir) + "/Translated.bsv '" + outName + ".bsv'");
+    if (bsvOut && perPackage) {
+        reportOutput("bsv", buildDir, "produced bsv output in " + hlColored(buildDir));
+    } else if (bsvOut) {
+        // The bsv output includes all top-levels, so name it after the only
+        // top-level, or after the input file if there are none or several
+        std::string outName = (outNames.size() == 1)? outNames[0] :
+            std::string(std::filesystem::path(inputFile).stem());
+        auto cpRes = run("cp " + workDir + "/Translated.bsv '" + outName + ".bsv'");
         if (cpRes.exitCode != 0) {
             error("could not copy bsv file");
         }
-        std::cout << "produced bsv output " << hlColored(outName + ".bsv") << "\n";
+        reportOutput("bsv", outName + ".bsv", "produced bsv output " + hlColored(outName + ".bsv"));
+    }
+
+    if (layoutOut) {
+        // Like the bsv output, the layout covers all top-levels
+        std::string outName = (outNames.size() == 1)? outNames[0] :
+            std::string(std::filesystem::path(inputFile).stem());
+        std::string layoutFile = outName + ".layout.json";
+        std::ofstream layoutStream(layoutFile);
+        if (!layoutStream.good()) error("Could not open output file %s", layoutFile.c_str());
+        layoutStream << getDesignLayout().toJson().str() << "\n";
+        layoutStream.close();
+        reportOutput("layout", layoutFile, "produced layout output " + hlColored(layoutFile));
+    }
+
+    if (evalMode) {
+        std::cout.flush();
+        int status = system(("./" + outNames[0]).c_str());
+        return WIFEXITED(status)? WEXITSTATUS(status) : 1;
     }
 
     return 0;
 }
+
+int main(int argc, const char* argv[]) {
+    std::set_terminate(uncaughtExceptionHandler);
+
+    std::string clientSocket;
+    std::vector<const char*> clientArgv = {argv[0]};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--batch") return runBatch(argc, argv, compile);
+        if (arg == "--server") {
+            if (i + 1 >= argc) error("--server requires a socket path");
+            return runServer(argv[i+1], compile);
+        }
+        if (arg == "--client") {
+            if (i + 1 >= argc) error("--client requires a socket path");
+            clientSocket = argv[++i];
+        } else {
+            clientArgv.push_back(argv[i]);
+        }
+    }
+
+    int exitCode;
+    if (!clientSocket.empty()) {
+        if (!runClient(clientSocket, clientArgv.size(), clientArgv.data(), exitCode))
+            error("could not connect to compile server at %s", clientSocket.c_str());
+        return exitCode;
+    }
+    // With MSC_SERVER set, use the server if it's up, else compile locally
+    const char* serverSocket = getenv("MSC_SERVER");
+    if (serverSocket && *serverSocket && runClient(serverSocket, argc, argv, exitCode)) return exitCode;
+    return compile(argc, argv);
+}
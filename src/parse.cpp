@@ -19,7 +19,9 @@
 #include <filesystem>
 #include <iostream>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "antlr4-runtime.h"
+#include "errors.h"
 #include "log.h"
 #include "parse.h"
 #include "strutils.h"
@@ -90,8 +92,8 @@ class ErrorListener : public BaseErrorListener {
         virtual void syntaxError(Recognizer *recognizer, Token *offendingSymbol,
                                  size_t line, size_t charPositionInLine,
                                  const std::string &msg, std::exception_ptr e) override {
-            std::stringstream errLoc;
-            errLoc << recognizer->getInputStream()->getSourceName() << ":" << line << ":" << charPositionInLine + 1;
+            Diagnostic diag;
+            diag.loc = {recognizer->getInputStream()->getSourceName(), (uint32_t) line, (uint32_t) charPositionInLine + 1};
 
             // Handle token recognition errors here, since the lexer doesn't use an ErrorStrategy we can override
             std::string errMsg = msg;
@@ -118,7 +120,7 @@ class ErrorListener : public BaseErrorListener {
                 }
             }
 
-            std::cerr << hlColored(errLoc.str()) << ": " << errorColored("error: ") << errMsg << "\n";
+            diag.message = errMsg;
 
             // Print preceding context if this is the first token in the line
             if (offendingSymbol && offendingSymbol->getTokenIndex() > 0) {
@@ -128,7 +130,7 @@ class ErrorListener : public BaseErrorListener {
                 size_t prevLine = prevToken->getLine();
                 if (prevLine < line && (line - prevLine) < 5) {
                     for (size_t i = prevLine; i < line; i++)
-                        std::cerr << "    " << getLine(i) << "\n";
+                        diag.context.push_back(std::string(getLine(i)));
                 }
             }
 
@@ -139,9 +141,10 @@ class ErrorListener : public BaseErrorListener {
                 errToken.size()? errToken.size() : 0;
             symbolLen = std::min(symbolLen, lineStr.size() - symbolStart);
             size_t symbolEnd = symbolStart + symbolLen;
-            std::cerr << "    " << lineStr.substr(0, symbolStart) <<
-                errorColored(lineStr.substr(symbolStart, symbolLen)) <<
-                lineStr.substr(symbolEnd) << "\n";
+            diag.context.push_back(lineStr.substr(0, symbolStart) +
+                errorColored(lineStr.substr(symbolStart, symbolLen)) +
+                lineStr.substr(symbolEnd));
+            reportErr(diag);
 
 #if 0
             // Until we refine recovery, bail on first error; others are often confusing
@@ -255,7 +258,6 @@ class ErrorStrategy : public DefaultErrorStrategy {
 struct ParsedFile {
     const std::string data;
     const std::vector<std::string_view> lines;
-    std::vector<ParsedFile*> imports;
 
     // Used by the constructor
     static std::vector<std::string_view> getLines(const std::string& str) {
@@ -286,8 +288,8 @@ struct ParsedFile {
     ErrorListener errorListener;
     MinispecParser::PackageDefContext* tree;
 
-    ParsedFile(const std::string& fileName, std::ifstream& stream) :
-        data(std::istreambuf_iterator<char>(stream), {}), lines(getLines(data)),
+    ParsedFile(const std::string& fileName, const std::string& fileData) :
+        data(fileData), lines(getLines(data)),
         input(data), lexer(&input), tokenStream(&lexer), parser(&tokenStream),
         errorListener([&] (uint32_t line) { return this->getLine(line); }) {
             input.name = fileName;
@@ -312,14 +314,46 @@ TokenStream* getTokenStream(ParserRuleContext* ctx) {
     return &ParsedFile::Get(ctx->start->getTokenSource())->tokenStream;
 }
 
+// Parsed files are cached by canonical path and reused while unmodified. This
+// matters when a single process runs multiple compiles (e.g., msc --batch or
+// msc --server). Entries are validated by mtime and size, then by a hash of
+// the contents (so touching a file does not force a re-parse).
+struct ParseCacheEntry {
+    int64_t mtimeNs;
+    int64_t size;
+    size_t hash;
+    pid_t parsedBy;  // process that parsed the file (workers report theirs)
+    ParsedFile* file;
+};
+static std::unordered_map<std::string, ParseCacheEntry> parseCache;
+
 ParsedFile* parseFile(const std::string& fileName) {
+    struct stat sb;
+    if (stat(fileName.c_str(), &sb) != 0) error("Could not read source file %s", fileName.c_str());
+    int64_t mtimeNs = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+    int64_t size = sb.st_size;
+    std::error_code ec;
+    std::string key = std::filesystem::canonical(fileName, ec);
+    if (ec) key = fileName;
+    auto it = parseCache.find(key);
+    if (it != parseCache.end() && it->second.mtimeNs == mtimeNs && it->second.size == size)
+        return it->second.file;
+
     std::ifstream stream;
-    // We generate the stream here due to RAII restrictions (lexing and parsing
-    // are done in ParsedFile's constructor).
     stream.open(fileName);
     if (!stream.good()) error("Could not read source file %s", fileName.c_str());
+    std::string data(std::istreambuf_iterator<char>(stream), {});
+    size_t hash = std::hash<std::string>()(data);
+    if (it != parseCache.end() && it->second.hash == hash && it->second.file->data == data) {
+        it->second.mtimeNs = mtimeNs;
+        it->second.size = size;
+        return it->second.file;
+    }
+
     try {
-        auto parsedFile = new ParsedFile(fileName, stream);
+        auto parsedFile = new ParsedFile(fileName, data);
+        // NOTE: Stale entries are leaked, as their parse trees may still be in use
+        parseCache[key] = {mtimeNs, size, hash, getpid(), parsedFile};
         return parsedFile;
     } catch (ParseCancellationException& p) {
         // NOTE: Probably not called at all, due to fix sidestepping antlr bug
@@ -328,6 +362,22 @@ ParsedFile* parseFile(const std::string& fileName) {
     }
 }
 
+std::vector<ParsedFileInfo> getNewParsedFiles() {
+    std::vector<ParsedFileInfo> res;
+    for (auto& [key, entry] : parseCache) {
+        if (entry.parsedBy != getpid()) continue;
+        res.push_back({key, entry.file->input.name, entry.file->data, entry.mtimeNs, entry.size});
+    }
+    return res;
+}
+
+void addParsedFile(const ParsedFileInfo& info) {
+    auto it = parseCache.find(info.path);
+    if (it != parseCache.end() && it->second.mtimeNs == info.mtimeNs && it->second.size == info.size) return;
+    auto parsedFile = new ParsedFile(info.fileName, info.data);
+    parseCache[info.path] = {info.mtimeNs, info.size, std::hash<std::string>()(info.data), getpid(), parsedFile};
+}
+
 std::string findImportedFile(MinispecParser::IdentifierContext* importItem, ParsedFile* parsedFile, const std::vector<std::string>& path) {
     std::string fileName = importItem->getText() + ".ms";
     struct stat sb;
@@ -339,8 +389,11 @@ std::string findImportedFile(MinispecParser::IdentifierContext* importItem, Pars
             parsedFile->tokenStream.getSourceName().c_str());
 }
 
+// Imports are resolved per compile, as they depend on the path
+typedef std::unordered_map<ParsedFile*, std::vector<ParsedFile*>> ImportsMap;
+
 ParsedFile* parseFileAndImports(std::unordered_map<std::string, ParsedFile*>& parsedFiles,
-        const std::string& fileName, const std::vector<std::string>& path) {
+        ImportsMap& imports, const std::string& fileName, const std::vector<std::string>& path) {
     auto it = parsedFiles.find(fileName);
     if (it != parsedFiles.end()) {
         // Already parsed
@@ -348,13 +401,14 @@ ParsedFile* parseFileAndImports(std::unordered_map<std::string, ParsedFile*>& pa
     } else {
         auto parsedFile = parseFile(fileName);
         parsedFiles[fileName] = parsedFile;
+        imports[parsedFile].clear();
 
         for (auto stmt : parsedFile->tree->packageStmt()) {
             if (auto importDecl = stmt->importDecl()) {
                 for (auto importItem : importDecl->identifier()) {
                     std::string importFile = findImportedFile(importItem, parsedFile, path);
-                    auto parsedImport = parseFileAndImports(parsedFiles, importFile, path);
-                    parsedFile->imports.push_back(parsedImport);
+                    auto parsedImport = parseFileAndImports(parsedFiles, imports, importFile, path);
+                    imports[parsedFile].push_back(parsedImport);
                 }
             }
         }
@@ -364,11 +418,14 @@ ParsedFile* parseFileAndImports(std::unordered_map<std::string, ParsedFile*>& pa
 
 std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::string& fileName, const std::vector<std::string>& path) {
     std::unordered_map<std::string, ParsedFile*> parsedFilesMap;
-    ParsedFile* parsedFile = parseFileAndImports(parsedFilesMap, fileName, path);
+    ImportsMap imports;
+    ParsedFile* parsedFile = parseFileAndImports(parsedFilesMap, imports, fileName, path);
 
     // Topologically sort files and detect import cycles
     struct TopoSort {
+        ImportsMap& imports;
         std::vector<ParsedFile*> path;
+        TopoSort(ImportsMap& imports) : imports(imports) {}
         void topoSort(ParsedFile* pf, std::vector<MinispecParser::PackageDefContext*>& out) {
             auto it = std::find(path.begin(), path.end(), pf);
             if (it != path.end()) {
@@ -379,14 +436,14 @@ std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::s
             }
             if (std::find(out.begin(), out.end(), pf->tree) == out.end()) {
                 path.push_back(pf);
-                for (auto i : pf->imports) topoSort(i, out);
+                for (auto i : imports[pf]) topoSort(i, out);
                 path.pop_back();
                 out.push_back(pf->tree);
             }
         }
     };
     std::vector<MinispecParser::PackageDefContext*> sortedTrees;
-    TopoSort().topoSort(parsedFile, sortedTrees);
+    TopoSort(imports).topoSort(parsedFile, sortedTrees);
     return sortedTrees;
 }
 
@@ -394,7 +451,7 @@ MinispecParser::PackageDefContext* parseSingleFile(const std::string& fileName)
     return parseFile(fileName)->tree;
 }
 
-std::string contextStr(tree::ParseTree* pt, std::vector<tree::ParseTree*> highlights) {
+std::vector<std::string> contextLines(tree::ParseTree* pt, std::vector<tree::ParseTree*> highlights) {
     Token* startToken;
     Token* endToken;
     {
@@ -446,7 +503,8 @@ std::string contextStr(tree::ParseTree* pt, std::vector<tree::ParseTree*> highli
         pos = startPos + len;
     }
     if (pos < str.size()) hlSs << str.substr(pos);
-    std::string hlStr = hlSs.str();
-    replace(hlStr, "\n", "\n    ");
-    return "    " + hlStr.substr(0, hlStr.size() - 4);  // omit space after last newline
+    std::vector<std::string> lines;
+    std::istringstream hlIss(hlSs.str());
+    for (std::string line; std::getline(hlIss, line);) lines.push_back(line);
+    return lines;
 }
@@ -22,7 +22,8 @@
 #include "MinispecParser.h"
 
 // Parses file and all imported files. Returns parse trees sorted in
-// topological order. Exits on lexer or parser errors
+// topological order. Exits on lexer or parser errors. Parsed files are cached,
+// so later calls in the same process reuse the trees of unmodified files.
 std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::string& fileName, const std::vector<std::string>& path);
 
 // Parse a single file without following imports. Returns file's parse tree.
@@ -30,5 +31,23 @@ MinispecParser::PackageDefContext* parseSingleFile(const std::string& fileName);
 
 antlr4::TokenStream* getTokenStream(antlr4::ParserRuleContext* ctx);
 
-// Prints the error context for an error associated with ctx
-std::string contextStr(antlr4::tree::ParseTree* ctx, std::vector<antlr4::tree::ParseTree*> highlights = {});
+// Parse cache sharing, used by msc --server: workers report the files they
+// parsed, and the server adds them to its cache, so later workers inherit them.
+struct ParsedFileInfo {
+    std::string path;      // canonical path (cache key)
+    std::string fileName;  // name used in diagnostics
+    std::string data;
+    int64_t mtimeNs;
+    int64_t size;
+};
+
+// Returns the files parsed by this process (i.e., not inherited from a parent)
+std::vector<ParsedFileInfo> getNewParsedFiles();
+
+// Parses and caches a file. Must only be called on contents that have been
+// parsed successfully before (exits on parse errors).
+void addParsedFile(const ParsedFileInfo& info);
+
+// Returns the source lines of the error context for an error associated
+// with ctx, with highlights colored
+std::vector<std::string> contextLines(antlr4::tree::ParseTree* ctx, std::vector<antlr4::tree::ParseTree*> highlights = {});
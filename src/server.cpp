@@ -0,0 +1,445 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compile server mode, for editors, graders, and build scripts that call msc
+ * many times on overlapping sources. The server (msc --server <socket>)
+ * listens on a Unix domain socket; clients (msc --client <socket> <args>, or
+ * plain msc with MSC_SERVER=<socket> set) send their arguments, working
+ * directory, environment, and stdin/stdout/stderr file descriptors, so the
+ * compile's output goes straight to the client's terminal.
+ *
+ * Each request runs in a forked worker, so concurrent requests are isolated
+ * from each other and a compile that exits on errors does not take down the
+ * server. Workers inherit the server's parse cache (and ANTLR's warmed-up DFA
+ * caches) copy-on-write. When a worker finishes, it sends back the files it
+ * parsed, and the server parses them into its own cache, so later requests
+ * skip parsing unmodified files. Cache entries are validated by mtime, size,
+ * and content (see parseFile()). Elaboration is not cached, as it depends on
+ * each request's top-levels.
+ *
+ * Protocol: the client sends a 4-byte request length with fds 0-2 attached
+ * (SCM_RIGHTS), then the request: a sequence of length-prefixed strings (cwd,
+ * argc, args, envc, env). The server replies with a 4-byte exit code when the
+ * compile finishes. If the client disconnects early, the worker is killed.
+ */
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "log.h"
+#include "parse.h"
+#include "server.h"
+
+static bool writeAll(int fd, const void* buf, size_t len) {
+    const char* p = (const char*) buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buf, size_t len) {
+    char* p = (char*) buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void appendStr(std::string& buf, const std::string& s) {
+    uint32_t len = s.size();
+    buf.append((const char*) &len, sizeof(len));
+    buf.append(s);
+}
+
+// Reads a length-prefixed string at pos; returns false if buf is truncated
+static bool consumeStr(const std::string& buf, size_t& pos, std::string& s) {
+    uint32_t len;
+    if (pos + sizeof(len) > buf.size()) return false;
+    memcpy(&len, buf.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if (pos + len > buf.size()) return false;
+    s = buf.substr(pos, len);
+    pos += len;
+    return true;
+}
+
+static bool fillSockAddr(const std::string& socketPath, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, socketPath.c_str());
+    return true;
+}
+
+static int connectTo(const std::string& socketPath) {
+    sockaddr_un addr;
+    if (!fillSockAddr(socketPath, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Client */
+
+bool runClient(const std::string& socketPath, int argc, const char* argv[], int& exitCode) {
+    int fd = connectTo(socketPath);
+    if (fd < 0) return false;
+
+    std::string req;
+    appendStr(req, std::filesystem::current_path());
+    appendStr(req, std::to_string(argc));
+    for (int i = 0; i < argc; i++) appendStr(req, argv[i]);
+    size_t envc = 0;
+    while (environ[envc]) envc++;
+    appendStr(req, std::to_string(envc));
+    for (size_t i = 0; i < envc; i++) appendStr(req, environ[i]);
+
+    uint32_t reqLen = req.size();
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    iovec iov = {&reqLen, sizeof(reqLen)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(reqLen) || !writeAll(fd, req.data(), req.size())) {
+        close(fd);
+        return false;
+    }
+
+    int32_t code;
+    if (!readAll(fd, &code, sizeof(code))) error("compile server at %s closed the connection", socketPath.c_str());
+    close(fd);
+    exitCode = code;
+    return true;
+}
+
+/* Server */
+
+struct ServerRequest {
+    std::string cwd;
+    std::vector<std::string> args;
+    std::vector<std::string> env;
+    int fds[3];
+};
+
+// A connection whose request is still arriving. Accepted connections are
+// non-blocking, so a slow or silent client never stalls the server or other
+// clients; clients that send no full request within requestTimeoutSecs are
+// dropped.
+struct PendingRequest {
+    int connFd;
+    std::chrono::steady_clock::time_point deadline;
+    bool gotHeader = false;
+    int fds[3] = {-1, -1, -1};
+    std::string buf;  // sized once the header arrives
+    size_t received = 0;
+};
+
+static const int requestTimeoutSecs = 5;
+static const uint32_t maxRequestLen = 64 << 20;
+
+static void closeRequestFds(int fds[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// Reads whatever has arrived of a pending request. Returns 1 when the request
+// is complete, 0 if more data is needed, and -1 on errors.
+static int receiveRequest(PendingRequest& p) {
+    if (!p.gotHeader) {
+        uint32_t reqLen;
+        char cbuf[CMSG_SPACE(sizeof(p.fds))];
+        iovec iov = {&reqLen, sizeof(reqLen)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        ssize_t n = recvmsg(p.connFd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (n != sizeof(reqLen) || reqLen > maxRequestLen) return -1;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+                cmsg->cmsg_len != CMSG_LEN(sizeof(p.fds))) return -1;
+        memcpy(p.fds, CMSG_DATA(cmsg), sizeof(p.fds));
+        p.gotHeader = true;
+        p.buf.resize(reqLen);
+    }
+    while (p.received < p.buf.size()) {
+        ssize_t n = read(p.connFd, p.buf.data() + p.received, p.buf.size() - p.received);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (n <= 0) return -1;
+        p.received += n;
+    }
+    return 1;
+}
+
+static bool parseRequest(const std::string& buf, ServerRequest& req) {
+    size_t pos = 0;
+    std::string countStr;
+    auto consumeList = [&](std::vector<std::string>& list) {
+        if (!consumeStr(buf, pos, countStr)) return false;
+        char* end;
+        size_t count = strtoul(countStr.c_str(), &end, 10);
+        if (*end || count > buf.size()) return false;
+        list.resize(count);
+        for (auto& s : list) if (!consumeStr(buf, pos, s)) return false;
+        return true;
+    };
+    return consumeStr(buf, pos, req.cwd) && consumeList(req.args) && consumeList(req.env) && !req.args.empty();
+}
+
+static int reportFd = -1;
+
+// Runs at worker exit: sends the files this worker parsed to the server
+static void reportParsedFiles() {
+    std::string buf;
+    for (auto& info : getNewParsedFiles()) {
+        appendStr(buf, info.path);
+        appendStr(buf, info.fileName);
+        appendStr(buf, info.data);
+        appendStr(buf, std::to_string(info.mtimeNs));
+        appendStr(buf, std::to_string(info.size));
+    }
+    writeAll(reportFd, buf.data(), buf.size());
+    close(reportFd);
+}
+
+static volatile sig_atomic_t stopServer = 0;
+
+static void handleStopSignal(int) { stopServer = 1; }
+
+int runServer(const std::string& socketPath, CompileFn compile) {
+    sockaddr_un addr;
+    if (!fillSockAddr(socketPath, addr)) error("socket path %s is too long", socketPath.c_str());
+    if (std::filesystem::exists(socketPath)) {
+        int fd = connectTo(socketPath);
+        if (fd >= 0) {
+            close(fd);
+            error("a compile server is already running on %s", socketPath.c_str());
+        }
+        // Stale socket from a server that did not exit cleanly
+        unlink(socketPath.c_str());
+    }
+    // Requests run with the server's privileges, so only the owner may
+    // connect. Create the socket with those permissions, as changing them
+    // after bind() would let others connect in between.
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t oldUmask = umask(0077);
+    int bindRes = (listenFd < 0)? -1 : bind(listenFd, (sockaddr*) &addr, sizeof(addr));
+    int bindErrno = errno;
+    umask(oldUmask);
+    if (bindRes != 0) error("could not create socket %s: %s", socketPath.c_str(), strerror(bindErrno));
+    if (listen(listenFd, 64) != 0) error("could not listen on socket %s: %s", socketPath.c_str(), strerror(errno));
+
+    struct sigaction sa = {};
+    sa.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "msc: compile server listening on %s\n", socketPath.c_str());
+
+    struct Worker {
+        int connFd;
+        int reportFd;
+        std::string report;
+        bool killed;
+    };
+    std::unordered_map<pid_t, Worker> workers;
+    std::vector<PendingRequest> pending;
+
+    auto startWorker = [&](int connFd, ServerRequest& req) {
+        int reportPipe[2];
+        if (pipe2(reportPipe, O_CLOEXEC) != 0) error("could not create pipe: %s", strerror(errno));
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) error("could not fork compile worker");
+        if (pid == 0) {
+            close(listenFd);
+            close(reportPipe[0]);
+            for (auto& [wpid, w] : workers) {
+                close(w.connFd);
+                close(w.reportFd);
+            }
+            for (auto& p : pending) {
+                close(p.connFd);
+                closeRequestFds(p.fds);
+            }
+            for (int fd = 0; fd < 3; fd++) {
+                dup2(req.fds[fd], fd);
+                close(req.fds[fd]);
+            }
+            signal(SIGPIPE, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            clearenv();
+            for (auto& var : req.env) putenv(strdup(var.c_str()));
+            if (chdir(req.cwd.c_str()) != 0) error("could not enter directory %s", req.cwd.c_str());
+            reportFd = reportPipe[1];
+            atexit(reportParsedFiles);
+            std::vector<const char*> argv;
+            for (auto& a : req.args) argv.push_back(a.c_str());
+            argv.push_back(nullptr);
+            exit(compile(argv.size() - 1, argv.data()));
+        }
+        close(reportPipe[1]);
+        for (int fd : req.fds) close(fd);
+        workers[pid] = {connFd, reportPipe[0], "", false};
+    };
+
+    while (!stopServer) {
+        std::vector<pollfd> pfds = {{listenFd, POLLIN, 0}};
+        std::vector<pid_t> pids;
+        for (auto& [pid, w] : workers) {
+            pfds.push_back({w.reportFd, POLLIN, 0});
+            pfds.push_back({w.killed? -1 : w.connFd, POLLIN, 0});
+            pids.push_back(pid);
+        }
+        size_t firstPending = pfds.size();
+        int timeoutMs = -1;
+        auto now = std::chrono::steady_clock::now();
+        for (auto& p : pending) {
+            pfds.push_back({p.connFd, POLLIN, 0});
+            int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(p.deadline - now).count();
+            ms = std::max(ms, (int64_t) 0);
+            if (timeoutMs < 0 || ms < timeoutMs) timeoutMs = ms;
+        }
+        if (poll(pfds.data(), pfds.size(), timeoutMs) < 0) {
+            if (errno == EINTR) continue;
+            error("poll() failed in compile server: %s", strerror(errno));
+        }
+
+        for (size_t i = 0; i < pids.size(); i++) {
+            pid_t pid = pids[i];
+            Worker& w = workers[pid];
+            short reportEvents = pfds[1 + 2*i].revents;
+            short connEvents = pfds[2 + 2*i].revents;
+            // The client sends nothing after its request, so any event on the
+            // connection means it went away; stop the now-pointless compile
+            if (connEvents) {
+                kill(pid, SIGKILL);
+                w.killed = true;
+            }
+            if (!reportEvents) continue;
+            char buf[65536];
+            ssize_t n = read(w.reportFd, buf, sizeof(buf));
+            if (n > 0) {
+                w.report.append(buf, n);
+                continue;
+            }
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+            // Report closed: worker is exiting
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+            int32_t exitCode = WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            size_t pos = 0;
+            ParsedFileInfo info;
+            std::string mtimeStr, sizeStr;
+            while (consumeStr(w.report, pos, info.path) && consumeStr(w.report, pos, info.fileName) &&
+                    consumeStr(w.report, pos, info.data) && consumeStr(w.report, pos, mtimeStr) &&
+                    consumeStr(w.report, pos, sizeStr)) {
+                info.mtimeNs = std::stoll(mtimeStr);
+                info.size = std::stoll(sizeStr);
+                addParsedFile(info);
+            }
+            writeAll(w.connFd, &exitCode, sizeof(exitCode));
+            close(w.connFd);
+            close(w.reportFd);
+            workers.erase(pid);
+        }
+
+        // Advance pending requests; start a worker for each complete one
+        now = std::chrono::steady_clock::now();
+        std::vector<PendingRequest> stillPending;
+        for (size_t i = 0; i < pending.size(); i++) {
+            auto& p = pending[i];
+            int res = pfds[firstPending + i].revents? receiveRequest(p) : 0;
+            ServerRequest req;
+            if (res == 1 && parseRequest(p.buf, req)) {
+                // Back to blocking, as the exit code is written with writeAll()
+                fcntl(p.connFd, F_SETFL, fcntl(p.connFd, F_GETFL) & ~O_NONBLOCK);
+                memcpy(req.fds, p.fds, sizeof(req.fds));
+                for (int& fd : p.fds) fd = -1;  // now owned by req
+                startWorker(p.connFd, req);
+            } else if (res == 0 && now < p.deadline) {
+                stillPending.push_back(std::move(p));
+            } else {
+                closeRequestFds(p.fds);
+                close(p.connFd);
+            }
+        }
+        pending = std::move(stillPending);
+
+        if (pfds[0].revents & POLLIN) {
+            int connFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (connFd >= 0) {
+                PendingRequest p;
+                p.connFd = connFd;
+                p.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(requestTimeoutSecs);
+                pending.push_back(std::move(p));
+            }
+        }
+    }
+
+    for (auto& [pid, w] : workers) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    for (auto& p : pending) {
+        closeRequestFds(p.fds);
+        close(p.connFd);
+    }
+    unlink(socketPath.c_str());
+    return 0;
+}
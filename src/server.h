@@ -0,0 +1,33 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include "batch.h"
+
+// Runs a persistent compile server on a Unix domain socket (msc --server).
+// Each request runs in a forked worker that inherits the server's warm
+// parse cache. Returns when the server is interrupted.
+int runServer(const std::string& socketPath, CompileFn compile);
+
+// Sends a compile request to the server (msc --client). The server runs the
+// compile with the client's working directory, environment, and stdin/stdout/
+// stderr. Returns false if the server could not be reached; otherwise sets
+// exitCode to the compile's exit code.
+bool runClient(const std::string& socketPath, int argc, const char* argv[], int& exitCode);
@@ -17,7 +17,6 @@
  */
 
 #include <string>
-#include <regex>
 #include "strutils.h"
 
 
@@ -29,7 +28,12 @@ static const char* fixColorCode = "\x1B[32m";
 static const char* hlColorCode = "\x1B[1;37m";
 static const char* clearCode = "\033[0m";
 
+static bool colorOutput = true;
+
+void setColorOutput(bool enable) { colorOutput = enable; }
+
 static std::string colorize(const char* colorCode, const std::string& str) {
+    if (!colorOutput) return str;
     return colorCode + str + clearCode;
 }
 
@@ -53,6 +57,12 @@ void replace(std::string& s, const std::string& sub, const std::string& repl) {
 }
 
 std::string trim(const std::string& s) {
-    // https://stackoverflow.com/a/21815483
-    return std::regex_replace(s, std::regex("^ +| +$|( ) +"), "$1");
+    // Drop leading and trailing spaces, and collapse runs of spaces into one
+    std::string res;
+    res.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != ' ') res += s[i];
+        else if (res.size() && i + 1 < s.size() && s[i + 1] != ' ') res += ' ';
+    }
+    return res;
 }
@@ -20,7 +20,8 @@
 
 #include <string>
 
-// String coloring
+// String coloring (can be disabled, e.g., for machine-readable output)
+void setColorOutput(bool enable);
 std::string errorColored(const std::string& str);
 std::string warnColored(const std::string& str);
 std::string noteColored(const std::string& str);
@@ -0,0 +1,151 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "jobserver.h"
+#include "log.h"
+#include "subprocess.h"
+
+class Subprocess {
+    private:
+        pid_t pid = -1;
+        int fd = -1;
+        LineFn lineFn;
+        std::string partialLine;
+        bool killed = false;
+        std::chrono::steady_clock::time_point startTime;
+
+    public:
+        RunResult res;
+
+        Subprocess(const std::string& cmd, LineFn lineFn) : lineFn(lineFn) {
+            startTime = std::chrono::steady_clock::now();
+            int fds[2];
+            if (pipe(fds) != 0) error("cannot invoke subprocess");
+            pid = fork();
+            if (pid < 0) error("cannot invoke subprocess");
+            if (pid == 0) {
+                // Run in a new process group, so we can kill the whole command
+                setpgid(0, 0);
+                close(fds[0]);
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[1]);
+                execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*) nullptr);
+                _exit(127);
+            }
+            setpgid(pid, pid);  // avoid racing with the child
+            close(fds[1]);
+            fd = fds[0];
+        }
+
+        int getFd() const { return fd; }
+
+        // Reads available output. Returns false on EOF.
+        bool read() {
+            char buf[4096];
+            ssize_t bytes = ::read(fd, buf, sizeof(buf));
+            if (bytes < 0 && errno == EINTR) return true;
+            if (bytes <= 0) return false;
+            res.output.append(buf, bytes);
+            if (!lineFn || killed) return true;
+            partialLine.append(buf, bytes);
+            size_t start = 0;
+            for (size_t nl = partialLine.find('\n'); nl != std::string::npos; nl = partialLine.find('\n', start)) {
+                if (!lineFn(partialLine.substr(start, nl - start))) {
+                    kill(-pid, SIGKILL);
+                    killed = true;
+                    break;
+                }
+                start = nl + 1;
+            }
+            partialLine.erase(0, start);
+            return true;
+        }
+
+        void finish() {
+            if (lineFn && !killed && partialLine.size()) lineFn(partialLine);
+            close(fd);
+            int status;
+            struct rusage ru;
+            while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR);
+            res.exitCode = WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            // The shell waits for its children, so ru covers the whole command
+            res.wallSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            res.cpuSecs = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+            res.peakRssKb = ru.ru_maxrss;
+        }
+};
+
+RunResult run(const std::string& cmd, LineFn lineFn) {
+    return runParallel({cmd}, 1, {lineFn})[0];
+}
+
+std::vector<RunResult> runParallel(const std::vector<std::string>& cmds,
+        uint32_t maxJobs, const std::vector<LineFn>& lineFns) {
+    assert(maxJobs > 0);
+    assert(lineFns.empty() || lineFns.size() == cmds.size());
+    std::vector<RunResult> results(cmds.size());
+    std::vector<std::tuple<size_t, Subprocess*>> running;
+    size_t nextCmd = 0;
+    // Under make, every command beyond the first needs a jobserver token
+    JobServer* jobServer = JobServer::get();
+    while (nextCmd < cmds.size() || !running.empty()) {
+        while (nextCmd < cmds.size() && running.size() < maxJobs) {
+            if (jobServer && running.size() && running.size() > jobServer->getNumTokens() &&
+                    !jobServer->tryAcquire())
+                break;
+            LineFn lineFn = lineFns.empty()? nullptr : lineFns[nextCmd];
+            running.push_back(std::make_tuple(nextCmd, new Subprocess(cmds[nextCmd], lineFn)));
+            nextCmd++;
+        }
+        // Return tokens we no longer need once all commands have started
+        while (jobServer && nextCmd == cmds.size() && jobServer->getNumTokens() + 1 > std::max(running.size(), (size_t) 1))
+            jobServer->release();
+
+        std::vector<pollfd> pfds;
+        for (auto& [_, proc] : running) pfds.push_back({proc->getFd(), POLLIN, 0});
+        bool waitForToken = jobServer && nextCmd < cmds.size() && running.size() < maxJobs;
+        if (waitForToken) pfds.push_back({jobServer->getFd(), POLLIN, 0});
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            error("cannot wait for subprocesses");
+        }
+
+        // A token may be available (tryAcquire() will tell), or a command
+        // may have finished, freeing its token for the next one
+        for (size_t i = running.size(); i-- > 0; ) {
+            if (!pfds[i].revents) continue;
+            auto [idx, proc] = running[i];
+            if (proc->read()) continue;
+            proc->finish();
+            results[idx] = proc->res;
+            delete proc;
+            running.erase(running.begin() + i);
+        }
+    }
+    if (jobServer) jobServer->releaseAll();
+    return results;
+}
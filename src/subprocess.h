@@ -0,0 +1,49 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Subprocess management. All commands run through the shell, with their
+// stdout captured (use 2>&1 to capture stderr).
+
+struct RunResult {
+    std::string output;
+    int exitCode;
+    // Resource usage of the command and all its children
+    double wallSecs;
+    double cpuSecs;  // user + system
+    int64_t peakRssKb;
+};
+
+// Called on each line of output as soon as it's produced. Returning false
+// kills the command (and all its children).
+typedef std::function<bool(const std::string&)> LineFn;
+
+// Runs cmd and waits for it to finish
+RunResult run(const std::string& cmd, LineFn lineFn = nullptr);
+
+// Runs cmds concurrently, with up to maxJobs running at a time, and waits
+// for all of them to finish. Commands are started in order. lineFns, if
+// non-empty, has one entry per command. Returns results in command order.
+std::vector<RunResult> runParallel(const std::vector<std::string>& cmds,
+        uint32_t maxJobs, const std::vector<LineFn>& lineFns = {});
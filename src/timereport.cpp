@@ -0,0 +1,93 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iomanip>
+#include <sstream>
+#include <sys/resource.h>
+#include <time.h>
+#include "json.h"
+#include "timereport.h"
+
+double TimeReport::cpuSecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int64_t TimeReport::peakRssKb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+void TimeReport::reset() {
+    phases.clear();
+    counters.clear();
+    startTime = std::chrono::steady_clock::now();
+    curPhase.clear();
+}
+
+void TimeReport::beginPhase(const std::string& name) {
+    curPhase = name;
+    phaseStartTime = std::chrono::steady_clock::now();
+    phaseStartCpu = cpuSecs();
+}
+
+void TimeReport::endPhase() {
+    double wallSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - phaseStartTime).count();
+    phases.push_back({curPhase, wallSecs, cpuSecs() - phaseStartCpu, peakRssKb(), false});
+}
+
+std::string TimeReport::str(bool json) const {
+    // Totals include all subprocesses that have been waited for
+    double totalWall = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    double childCpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+    Phase total = {"total", totalWall, cpuSecs() + childCpu, std::max(peakRssKb(), (int64_t) ru.ru_maxrss), false};
+
+    if (json) {
+        auto phaseJson = [](const Phase& p) {
+            JsonValue res = JsonValue::object();
+            res.set("name", p.name).set("wallSecs", p.wallSecs).set("cpuSecs", p.cpuSecs)
+                .set("peakRssKb", p.peakRssKb).set("subprocess", p.subprocess);
+            return res;
+        };
+        JsonValue phasesJson = JsonValue::array();
+        for (auto& p : phases) phasesJson.push(phaseJson(p));
+        JsonValue countersJson = JsonValue::object();
+        for (auto& [name, value] : counters) countersJson.set(name, value);
+        JsonValue res = JsonValue::object();
+        res.set("phases", phasesJson).set("total", phaseJson(total)).set("counters", countersJson);
+        return res.str() + "\n";
+    }
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    ss << std::left << std::setw(40) << "phase" << std::right << std::setw(10) << "wall (s)"
+        << std::setw(10) << "cpu (s)" << std::setw(14) << "peak RSS (MB)" << "\n";
+    auto printPhase = [&](const Phase& p) {
+        std::string name = p.subprocess? "  " + p.name : p.name;
+        ss << std::left << std::setw(40) << name << std::right << std::setw(10) << p.wallSecs
+            << std::setw(10) << p.cpuSecs << std::setw(14) << p.peakRssKb / 1024.0 << "\n";
+    };
+    for (auto& p : phases) printPhase(p);
+    printPhase(total);
+    for (auto& [name, value] : counters) ss << name << ": " << value << "\n";
+    return ss.str();
+}
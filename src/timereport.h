@@ -0,0 +1,65 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Per-phase wall time, CPU time, and peak memory of a compile (msc --time-report)
+class TimeReport {
+    public:
+        struct Phase {
+            std::string name;
+            double wallSecs;
+            double cpuSecs;
+            int64_t peakRssKb;  // for msc phases, msc's peak RSS so far
+            bool subprocess;
+        };
+
+    private:
+        std::vector<Phase> phases;
+        std::vector<std::tuple<std::string, uint64_t>> counters;
+        std::chrono::steady_clock::time_point startTime;
+        std::chrono::steady_clock::time_point phaseStartTime;
+        double phaseStartCpu = 0.0;
+        std::string curPhase;
+
+    public:
+        TimeReport() : startTime(std::chrono::steady_clock::now()) {}
+
+        // Starts over, e.g., for each compile of msc --server or --batch,
+        // which run in workers forked from a long-lived process
+        void reset();
+
+        static double cpuSecs();  // CPU time used by msc itself
+        static int64_t peakRssKb();
+
+        // Measures an msc phase, from beginPhase() to endPhase()
+        void beginPhase(const std::string& name);
+        void endPhase();
+
+        void addPhase(const Phase& phase) { phases.push_back(phase); }
+        void addCounter(const std::string& name, uint64_t value) { counters.push_back({name, value}); }
+
+        // Returns a table, or a JSON object if json is set
+        std::string str(bool json) const;
+};
@@ -18,6 +18,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <filesystem>
 #include <iostream>
 #include <unordered_set>
 #include <variant>
@@ -237,8 +238,26 @@ class TranslatedCode {
             if (ctxInfo != "") dstToInfo[range] = ctxInfo;
         }
 
-        SourceMap getSourceMap(const std::string& simModule = "") const {
-            return SourceMap(dstToSrc, dstToInfo, code.str(), simModule);
+        size_t size() { return pos(); }
+
+        SourceMap getSourceMap(const std::vector<std::string>& topModules = {},
+                const std::string& fileName = "Translated.bsv") const {
+            return SourceMap(fileName, dstToSrc, dstToInfo, code.str(), topModules);
+        }
+
+        // Replaces all occurrences of from with to, which must have the same
+        // length so that the source map stays valid
+        void patch(const std::string& from, const std::string& to) {
+            assert(from.size() == to.size());
+            std::string str = code.str();
+            bool patched = false;
+            for (size_t p = str.find(from); p != std::string::npos; p = str.find(from, p + to.size())) {
+                str.replace(p, from.size(), to);
+                patched = true;
+            }
+            if (!patched) return;
+            code.str(str);
+            code.seekp(0, std::ios_base::end);
         }
 
         std::vector<ParametricUseInfo> dequeueParametricUsesEmitted() {
@@ -386,9 +405,7 @@ bool isUnsizedLiteral(MinispecParser::IntLiteralContext *ctx) {
     return quotePos == -1ul || quotePos == 0;
 }
 
-int64_t parseUnsizedLiteral(MinispecParser::IntLiteralContext *ctx) {
-    assert(isUnsizedLiteral(ctx));
-    auto s = ctx->getText();
+int64_t parseUnsizedLiteral(std::string s) {
     replace(s, "_", "");
     if (s.find("'") == -1ul) return std::stol(s); // decimal
     assert(s.size() >= 3);
@@ -402,6 +419,11 @@ int64_t parseUnsizedLiteral(MinispecParser::IntLiteralContext *ctx) {
     }
 }
 
+int64_t parseUnsizedLiteral(MinispecParser::IntLiteralContext *ctx) {
+    assert(isUnsizedLiteral(ctx));
+    return parseUnsizedLiteral(ctx->getText());
+}
+
 // Helper for post-parse error messages
 std::string quote(ParserRuleContext* ctx) {
     assert(ctx);
@@ -416,7 +438,10 @@ std::string quote(ParserRuleContext* ctx) {
 class SemanticError {
     public:
         virtual ParserRuleContext* getCtx() const { return nullptr; }
-        virtual std::string str() const = 0;
+        virtual Diagnostic diag() const = 0;
+        // Hash of everything but getCtx() that diag() depends on, to
+        // deduplicate errors without rendering them
+        virtual size_t argsHash() const = 0;
 };
 
 class BasicError : public SemanticError {
@@ -429,15 +454,18 @@ class BasicError : public SemanticError {
 
         ParserRuleContext* getCtx() const override { return ctx; }
 
-        virtual std::string str() const override {
-            std::string errMsg = msg;
-            replace(errMsg, "$CTX", quote(ctx));
-            std::stringstream ss;
-            ss << hlColored(getLoc(ctx) + ":")  << " " << errMsg << "\n";
-            ss << contextStr(ctx, {ctx});
-            return ss.str();
+        virtual Diagnostic diag() const override {
+            Diagnostic diag;
+            diag.loc = getDiagLoc(ctx);
+            diag.message = msg;
+            replace(diag.message, "$CTX", quote(ctx));
+            diag.context = contextLines(ctx, {ctx});
+            diag.label = false;
+            return diag;
         }
 
+        virtual size_t argsHash() const override { return std::hash<std::string>()(msg); }
+
         static Any create(ParserRuleContext* ctx, const std::string& msg) {
             return std::make_shared<BasicError>(ctx, msg);
         }
@@ -484,14 +512,20 @@ class SubErrors : public SemanticError {
             return res;
         }
 
-        virtual std::string str() const override {
-            std::stringstream ss;
+        virtual Diagnostic diag() const override {
+            Diagnostic diag;
             for (auto e : errors) {
                 std::string errMsg = e->msg;
                 replace(errMsg, "$CTX", quote(e->ctx));
-                ss << hlColored(getSubLoc(e->ctx) + ":")  << " " << errMsg << "\n";
+                diag.subLocs.push_back(getDiagLoc(e->ctx, errMsg));
             }
-            return ss.str();
+            return diag;
+        }
+
+        virtual size_t argsHash() const override {
+            size_t h = 0;
+            for (auto e : errors) h = h * 31 + (std::hash<void*>()(e->ctx) ^ e->argsHash());
+            return h;
         }
 
         friend class ElabError;
@@ -508,18 +542,21 @@ class ElabError : public SemanticError {
 
         ParserRuleContext* getCtx() const override { return ctx; }
 
-        virtual std::string str() const override {
-            std::stringstream ss;
-            ss << hlColored(getLoc(ctx) + ":") << " " << errorColored("error:") << " ";
-            ss << (msg? msg : "could not elaborate Integer expression") << "\n";
-            ss << subErrors->str();
+        virtual Diagnostic diag() const override {
+            Diagnostic diag = subErrors->diag();
+            diag.loc = getDiagLoc(ctx);
+            diag.message = msg? msg : "could not elaborate Integer expression";
 
             std::vector<tree::ParseTree*> highlights;
             for (auto e : subErrors->errors) highlights.push_back(e->ctx);
             if (highlights.empty()) highlights.push_back(ctx);
-            ss << contextStr(ctx, highlights);
+            diag.context = contextLines(ctx, highlights);
 
-            return ss.str();
+            return diag;
+        }
+
+        virtual size_t argsHash() const override {
+            return std::hash<std::string>()(msg? msg : "") ^ subErrors->argsHash();
         }
 };
 
@@ -531,6 +568,7 @@ struct ForElabStep {
 typedef std::variant<ParametricUse, ForElabStep> ElabStep;
 static std::array<ElabStep, 16> elabStepBuf;
 static uint64_t numElabSteps = 0;
+static ElabStats elabStats = {};
 static uint64_t maxElabSteps = 50000;
 static uint64_t maxElabDepth = 1000;
 
@@ -539,8 +577,25 @@ void setElabLimits(uint64_t maxSteps, uint64_t maxDepth) {
     maxElabDepth = maxDepth;
 }
 
+ElabStats getElabStats() {
+    ElabStats res = elabStats;
+    res.elabSteps = numElabSteps;
+    return res;
+}
+
+static DesignLayout designLayout;
+
+const DesignLayout& getDesignLayout() { return designLayout; }
+
+// Whether count * size reaches threshold, without overflowing
+static bool reachesThreshold(uint64_t count, uint64_t size, uint64_t threshold) {
+    return count && size >= threshold / count + (threshold % count != 0);
+}
+
 void registerElabStep(ElabStep es, uint64_t depth = 0) {
     elabStepBuf[numElabSteps++ % elabStepBuf.size()] = es;
+    if (std::holds_alternative<ParametricUse>(es)) elabStats.parametricInstances++;
+    else elabStats.loopIterations++;
     bool error = false;
     // FIXME: Use error formatting helpers...
     if (maxElabSteps && numElabSteps > maxElabSteps) {
@@ -602,14 +657,46 @@ class Elaborator : public MinispecBaseListener {
         IntegerContext& ic;
         ParametricsMap& parametrics;
         const std::unordered_set<std::string>& localTypeNames;
-        const ParametricUsePtr topLevelParametric;  // to elaborate function wrapper
+        const std::vector<ParametricUsePtr> topLevelParametrics;  // to elaborate function wrappers
+        const bool synthesizeTopLevels;  // tag top-levels with (* synthesize *) instead of relying on bsc -g
+        const AutoSynthesizePolicy autoSynthesize;
+
+        // Module hierarchy, by Bluespec module name: the modules each module
+        // instantiates, and how many times (e.g., Vector#(4, Foo) -> 4)
+        std::unordered_map<std::string, std::vector<std::tuple<std::string, uint64_t>>> moduleHierarchy;
+        // Size of each module's emitted Bluespec code, in bytes
+        std::unordered_map<std::string, uint64_t> moduleSizes;
+        // Modules that may get automatic synthesize boundaries, their
+        // placeholders in the emitted code, and the types of their ports (see
+        // getAutoSynthesizePatches())
+        std::vector<std::tuple<std::string, std::string, std::vector<std::string>>> autoSynthCandidates;
+        const uint64_t autoSynthesizeThreshold;
+        const uint64_t noinlineThreshold;
+        // Package-level functions by name, to resolve call sites
+        const std::unordered_map<std::string, MinispecParser::FunctionDefContext*>& packageFunctions;
+        // Call sites of each package-level function in the elaborated code
+        // (unrolled loops count once per iteration), and functions that may
+        // get automatic noinline attributes: definition, code size,
+        // placeholder, and argument and result types (see getNoinlinePatches())
+        std::unordered_map<MinispecParser::FunctionDefContext*, uint64_t> callSites;
+        std::vector<std::tuple<MinispecParser::FunctionDefContext*, uint64_t, std::string, std::vector<std::string>>> noinlineCandidates;
         std::unordered_set<ParametricUse> parametricsEmitted;
 
         std::unordered_map<tree::ParseTree*, Any> elabValues;
         std::unordered_set<std::string> submoduleNames;
 
         void report(const SemanticError& error) {
-            reportErr(error.str(), "", error.getCtx());
+            reportMsg(true, {"", error.getCtx(), error.argsHash()}, [&error]() { return error.diag(); }, "", error.getCtx());
+        }
+
+        bool isTopLevel(const ParametricUse& pu) const {
+            for (auto tlp : topLevelParametrics) if (*tlp == pu) return true;
+            return false;
+        }
+
+        bool isTopLevelName(const std::string& name) const {
+            for (auto tlp : topLevelParametrics) if (tlp->name == name) return true;
+            return false;
         }
 
     public:
@@ -706,6 +793,70 @@ class Elaborator : public MinispecBaseListener {
                     [&](tree::ParseTree* ctx) { return getValue(ctx); }, skipSpaces);
         }
 
+        // Design layout helpers (see layout.h). layoutType() returns the
+        // layout name of an elaborated type, and records the layouts of the
+        // built-in types it uses; Minispec types are recorded by their
+        // typedefs. Types with unelaborated params get no layout.
+        std::string layoutType(const ParametricUse& pu) {
+            std::string name = pu.str(/*alreadyEscaped=*/true);
+            auto& params = pu.params;
+            auto isSize = [&](size_t i) { return params[i].is<int64_t>() && params[i].as<int64_t>() >= 0; };
+            auto isType = [&](size_t i) { return params[i].is<ParametricUsePtr>(); };
+            auto typeParam = [&](size_t i) { return layoutType(*params[i].as<ParametricUsePtr>()); };
+            if (pu.name == "Bool" && params.empty()) {
+                designLayout.addBits(name, 1);
+            } else if ((pu.name == "Bit" || pu.name == "Int" || pu.name == "UInt") && params.size() == 1 && isSize(0)) {
+                designLayout.addBits(name, params[0].as<int64_t>());
+            } else if (pu.name == "Vector" && params.size() == 2 && isSize(0) && isType(1)) {
+                designLayout.addVector(name, params[0].as<int64_t>(), typeParam(1));
+            } else if (pu.name == "Maybe" && params.size() == 1 && isType(0)) {
+                designLayout.addBits("Bool", 1);
+                designLayout.addMaybe(name, typeParam(0));
+            } else if ((pu.name == "Reg" || pu.name == "RegU") && params.size() == 1 && isType(0)) {
+                designLayout.addReg(name, typeParam(0));
+            } else {
+                for (size_t i = 0; i < params.size(); i++) if (isType(i)) typeParam(i);
+            }
+            return name;
+        }
+
+        std::string layoutType(MinispecParser::TypeContext* ctx) {
+            std::function<ParametricUsePtr(MinispecParser::TypeContext*)> getType =
+                    [&](MinispecParser::TypeContext* ctx) -> ParametricUsePtr {
+                Any val = getValue(ctx);
+                if (val.is<ParametricUsePtr>()) return val.as<ParametricUsePtr>();
+                auto res = std::make_shared<ParametricUse>();
+                res->name = ctx->name->getText();
+                res->escape = false;
+                if (ctx->params()) {
+                    for (auto p : ctx->params()->param()) {
+                        Any pVal = getValue(p);
+                        if (pVal.is<int64_t>() || pVal.is<ParametricUsePtr>()) res->params.push_back(pVal);
+                        else if (p->type() && getType(p->type())) res->params.push_back(getType(p->type()));
+                        else return nullptr;
+                    }
+                }
+                return res;
+            };
+            auto pu = getType(ctx);
+            return pu? layoutType(*pu) : ctx->getText();
+        }
+
+        // Layout name of a (possibly parametric) type or module definition
+        template <typename IdContext>
+        std::string layoutName(IdContext* ctx) {
+            Any val = getValue(ctx);
+            if (val.is<ParametricUsePtr>()) return val.as<ParametricUsePtr>()->str(/*alreadyEscaped=*/true);
+            return ctx->name->getText();
+        }
+
+        std::vector<DesignLayout::Port> layoutArgs(MinispecParser::ArgFormalsContext* ctx) {
+            std::vector<DesignLayout::Port> res;
+            if (ctx)
+                for (auto af : ctx->argFormal()) res.push_back({af->argName->getText(), layoutType(af->type())});
+            return res;
+        }
+
         void checkElaboratedParams(ParserRuleContext* ctx) {
             class SubListener : public MinispecBaseListener {
                 public:
@@ -1331,6 +1482,7 @@ class Elaborator : public MinispecBaseListener {
         }
 
         void exitCallExpr(MinispecParser::CallExprContext *ctx) override {
+            if (auto fcn = getCalledFunction(ctx)) callSites[fcn]++;
             if (ctx->fcn->getText() == "log2" && ctx->expression().size() == 1) {
                 Any v = getValue(ctx->expression()[0]);
                 Any res;
@@ -1346,6 +1498,62 @@ class Elaborator : public MinispecBaseListener {
             }
         }
 
+        // Returns the package-level function a call invokes, or nullptr if it
+        // calls something else, e.g., a method, a parametric function, or a
+        // function of the enclosing module (which shadows package-level ones)
+        MinispecParser::FunctionDefContext* getCalledFunction(MinispecParser::CallExprContext* ctx) const {
+            auto var = dynamic_cast<MinispecParser::VarExprContext*>(ctx->fcn);
+            if (!var || var->params()) return nullptr;
+            std::string name = var->var->getText();
+            auto it = packageFunctions.find(name);
+            if (it == packageFunctions.end()) return nullptr;
+            for (auto p = ctx->parent; p; p = p->parent) {
+                auto moduleDef = dynamic_cast<MinispecParser::ModuleDefContext*>(p);
+                if (!moduleDef) continue;
+                for (auto stmt : moduleDef->moduleStmt())
+                    if (stmt->functionDef() && stmt->functionDef()->functionId()->name->getText() == name) return nullptr;
+                break;
+            }
+            return it->second;
+        }
+
+        // Whether all types are Bits types, i.e., have a known bit layout.
+        // Types are checked by their elaborated names once elaboration
+        // finishes, so typedefs after their uses count. Interfaces, Integer,
+        // String, and types from bsvimported packages are not Bits types.
+        bool areBitsTypes(const std::vector<std::string>& types) const {
+            uint64_t width;
+            for (auto& type : types)
+                if (!designLayout.getWidth(type, width)) return false;
+            return true;
+        }
+
+        // Whether a module can get an automatic synthesize boundary without
+        // changing its behavior. bsc can only synthesize modules without
+        // arguments and with Bits-typed methods (see areBitsTypes()).
+        // Parametric modules have escaped names, which break bsc -sim and
+        // Verilog output. And inputs without defaults must be set every
+        // cycle, which bsc only checks when the module is inlined into its
+        // parent.
+        bool isAutoSynthesizable(MinispecParser::ModuleDefContext* ctx) const {
+            if (ctx->moduleId()->paramFormals()) return false;
+            if (ctx->argFormals() && !ctx->argFormals()->argFormal().empty()) return false;
+            for (auto stmt : ctx->moduleStmt())
+                if (auto i = stmt->inputDef())
+                    if (!i->defaultVal) return false;
+            return true;
+        }
+
+        // Whether a function can be tagged (* noinline *). bsc requires
+        // noinline functions to have Bits-typed arguments and results (see
+        // areBitsTypes()), and parametric functions have escaped names it
+        // cannot use.
+        bool isNoinlinable(MinispecParser::FunctionDefContext* ctx) const {
+            if (ctx->functionId()->paramFormals()) return false;
+            if (!dynamic_cast<MinispecParser::PackageStmtContext*>(ctx->parent)) return false;
+            return ctx->argFormals() && !ctx->argFormals()->argFormal().empty();
+        }
+
         // Module elaboration
         void enterModuleDef(MinispecParser::ModuleDefContext* ctx) override {
             ic.enterImmutableLevel();
@@ -1431,9 +1639,63 @@ class Elaborator : public MinispecBaseListener {
                     emitSynthesizePragma = s.find("msc_pragma:synthesize") != std::string::npos;
                 }
             }
+            if (synthesizeTopLevels && !ctx->moduleId()->paramFormals() &&
+                    isTopLevel(*createParametricUsePtr(ctx->moduleId()->name->getText(), nullptr))) {
+                emitSynthesizePragma = true;
+            }
+
+            // Record the module's ports and submodules in the design layout
+            DesignLayout::Module layoutModule;
+            layoutModule.ifc = layoutName(ctx->moduleId());
+            layoutModule.isBvi = emitBVIDef;
+            for (auto stmt : ctx->moduleStmt()) {
+                if (auto i = stmt->inputDef()) {
+                    layoutModule.inputs.push_back({i->name->getText(), layoutType(i->type())});
+                } else if (auto m = stmt->methodDef()) {
+                    layoutModule.methods.push_back({m->name->getText(), layoutType(m->type()), layoutArgs(m->argFormals())});
+                } else if (auto s = stmt->submoduleDecl()) {
+                    // Each instance of a Vector of submodules has the element's module
+                    auto elemType = s->type();
+                    while (elemType && elemType->name->getText() == "Vector" && elemType->params() &&
+                            elemType->params()->param().size() == 2)
+                        elemType = elemType->params()->param()[1]->type();
+                    std::string type = layoutType(s->type());
+                    std::string module = elemType? "mk" + layoutType(elemType) : "";
+                    layoutModule.submodules.push_back({s->name->getText(), type, module});
+                }
+            }
+            designLayout.addModule("mk" + layoutModule.ifc, layoutModule);
+
+            // Bluespec module names, for the module hierarchy
+            auto moduleName = [this](tree::ParseTree* modTypeCtx) {
+                auto tc = createTranslatedCodePtr();
+                tc->emit(modTypeCtx);
+                std::string typeName = tc->getSourceMap().getCode();
+                if (typeName.find("\\") == 0) return "\\mk" + typeName.substr(1);
+                else return "mk" + typeName.substr(0, typeName.find("#"));
+            };
+            std::string modName = moduleName(ctx->moduleId());
+            auto& submodules = moduleHierarchy[modName];
+            submodules.clear();
+            size_t moduleStart = tc->size();
 
             if (emitBVIDef) tc->emitLine("`ifndef __VERILOG__");
-            if (emitSynthesizePragma) tc->emitLine("(* synthesize *)");
+            if (emitSynthesizePragma) {
+                tc->emitLine("(* synthesize *)");
+            } else if (autoSynthesize != AUTOSYNTH_OFF && !emitBVIDef && isAutoSynthesizable(ctx) &&
+                    !isTopLevel(*createParametricUsePtr(ctx->moduleId()->name->getText(), nullptr))) {
+                // Whether to synthesize depends on the whole design, so emit
+                // a placeholder and patch it after elaboration
+                std::string placeholder = "/*msc_autosynth:" + modName + "*/";
+                std::vector<std::string> portTypes;
+                for (auto& input : layoutModule.inputs) portTypes.push_back(input.type);
+                for (auto& method : layoutModule.methods) {
+                    portTypes.push_back(method.type);
+                    for (auto& arg : method.args) portTypes.push_back(arg.type);
+                }
+                autoSynthCandidates.push_back({modName, placeholder, portTypes});
+                tc->emitLine(placeholder);
+            }
 
             // Then, emit the module, following standard BSV conventions for naming
             tc->emitStart(ctx);
@@ -1451,13 +1713,6 @@ class Elaborator : public MinispecBaseListener {
             emitModuleHeader();
 
             // Emit in order required by bsv: submodules/input wires, then functions, then rules, then methods
-            auto moduleName = [this](MinispecParser::TypeContext* modTypeCtx) {
-                auto tc = createTranslatedCodePtr();
-                tc->emit(modTypeCtx);
-                std::string typeName = tc->getSourceMap().getCode();
-                if (typeName.find("\\") == 0) return "\\mk" + typeName.substr(1);
-                else return "mk" + typeName.substr(0, typeName.find("#"));
-            };
             for (auto stmt : ctx->moduleStmt()) {
                 tc->emitStart(stmt);
                 if (auto i = stmt->inputDef()) {
@@ -1474,6 +1729,7 @@ class Elaborator : public MinispecBaseListener {
                         // levels of nesting there are
                         auto curType = s->type();
                         size_t nestingDepth = 0;
+                        uint64_t numInstances = 1;
                         while (curType && curType->name->getText() == "Vector") {
                             nestingDepth++;
                             auto params = curType->params();
@@ -1487,6 +1743,8 @@ class Elaborator : public MinispecBaseListener {
                                     curType = nullptr;
                                 } else {
                                     // Next level
+                                    Any len = paramVec[0]->intParam? getValue(paramVec[0]->intParam) : Any();
+                                    numInstances *= (len.is<int64_t>() && len.as<int64_t>() >= 0)? len.as<int64_t>() : 2;
                                     curType = paramVec[1]->type();
                                     if (!curType) {
                                         report(BasicError(paramVec[1], "Vector's second parameter must be a type"));
@@ -1504,6 +1762,7 @@ class Elaborator : public MinispecBaseListener {
                             tc->emitStart(curType);
                             tc->emit(moduleName(curType));
                             tc->emitEnd();
+                            submodules.push_back({moduleName(curType), numInstances});
                             tc->emit(s->args());
                             for (size_t i = 0; i < nestingDepth; i++) tc->emit(")");
                             tc->emitLine(";");
@@ -1514,6 +1773,7 @@ class Elaborator : public MinispecBaseListener {
                         tc->emitStart(s->type());
                         tc->emit(moduleName(s->type()));
                         tc->emitEnd();
+                        submodules.push_back({moduleName(s->type()), 1});
                         tc->emitLine(s->args(), ";");
                     }
                 } else if (auto x = stmt->stmt()) {
@@ -1563,6 +1823,7 @@ class Elaborator : public MinispecBaseListener {
 
             tc->emitLine("endmodule\n");
             tc->emitEnd();
+            moduleSizes[modName] = tc->size() - moduleStart;
 
             // Finally, emit BVI if needed
             if (emitBVIDef) {
@@ -1598,8 +1859,7 @@ class Elaborator : public MinispecBaseListener {
 
             setValue(ctx, tc);
 
-            if (topLevelParametric &&
-                topLevelParametric->name == ctx->moduleId()->name->getText() &&
+            if (isTopLevelName(ctx->moduleId()->name->getText()) &&
                 ctx->argFormals() && !ctx->argFormals()->argFormal().empty()) {
                 report(BasicError(ctx->argFormals(), "top-level module " +
                         quote(ctx->moduleId()->name) + " cannot have arguments"));
@@ -1608,7 +1868,7 @@ class Elaborator : public MinispecBaseListener {
 
         void exitFunctionDef(MinispecParser::FunctionDefContext* ctx) override {
             auto pu = createParametricUsePtr(ctx->functionId()->name->getText(), ctx->functionId()->paramFormals());
-            if (topLevelParametric && *topLevelParametric == *pu) {
+            if (isTopLevel(*pu)) {
                 // Emit synthesis wrapper
                 std::string ifcName = ctx->functionId()->name->getText() + "___";
                 ifcName[0] = std::toupper(ifcName[0]);
@@ -1626,6 +1886,7 @@ class Elaborator : public MinispecBaseListener {
                 tc->emitLine("  (* prefix=\"_\", result = \"out\" *)");
                 tc->emitLine("  method ", ctx->type(), " fn", ctx->argFormals(), ";");
                 tc->emitLine("endinterface\n");
+                if (synthesizeTopLevels && !ctx->functionId()->paramFormals()) tc->emitLine("(* synthesize *)");
                 tc->emitLine("module ", modPu->str(), " ( ", ifcPu->str(), " );");
                 tc->emit("  method ", ctx->type(), " fn", ctx->argFormals(), " = ", pu->str(), " (");
                 if (ctx->argFormals()) {
@@ -1639,6 +1900,27 @@ class Elaborator : public MinispecBaseListener {
                 tc->emitLine("endmodule");
                 tc->emitEnd();
                 setValue(ctx, tc);
+
+                DesignLayout::Module layoutModule;
+                layoutModule.ifc = ifcPu->str(/*alreadyEscaped=*/true);
+                layoutModule.isFunction = true;
+                layoutModule.methods.push_back({"fn", layoutType(ctx->type()), layoutArgs(ctx->argFormals())});
+                designLayout.addModule(modPu->str(/*alreadyEscaped=*/true), layoutModule);
+            } else if (noinlineThreshold && isNoinlinable(ctx)) {
+                // Emit a placeholder, patched to (* noinline *) or blanked
+                // once all call sites have been elaborated
+                std::string name = ctx->functionId()->name->getText();
+                std::string placeholder = "/*msc_noinline:" + name + "*/";
+                auto tc = createTranslatedCodePtr();
+                tc->emitStart(ctx);
+                tc->emitLine(placeholder);
+                size_t start = tc->size();
+                tc->emit(ctx);
+                std::vector<std::string> types = {layoutType(ctx->type())};
+                for (auto& arg : layoutArgs(ctx->argFormals())) types.push_back(arg.type);
+                noinlineCandidates.push_back({ctx, tc->size() - start, placeholder, types});
+                tc->emitEnd();
+                setValue(ctx, tc);
             }
             ic.exitLevel();
         }
@@ -1695,12 +1977,40 @@ class Elaborator : public MinispecBaseListener {
             }
         }
 
-        // Auto-deriving
+        // Auto-deriving (and layouts)
         void exitTypeDefEnum(MinispecParser::TypeDefEnumContext* ctx) override {
             setValue(ctx->children.back() /*;*/, " deriving(Bits, Eq, FShow);");
+            // As in Bluespec, tags without values follow the previous one,
+            // and the width fits the largest tag
+            int64_t tag = -1;
+            int64_t maxTag = 0;
+            for (auto elem : ctx->typeDefEnumElement()) {
+                if (elem->tagval) {
+                    std::string tagStr = elem->tagval->getText();
+                    size_t quotePos = tagStr.find("'");
+                    try {
+                        tag = parseUnsizedLiteral((quotePos == std::string::npos)? tagStr : tagStr.substr(quotePos));
+                    } catch (std::logic_error&) {
+                        return;  // too large, bsc will complain
+                    }
+                } else {
+                    tag++;
+                }
+                maxTag = std::max(maxTag, tag);
+            }
+            uint64_t width = 0;
+            while (width < 63 && (maxTag >> width)) width++;
+            designLayout.addEnum(ctx->upperCaseIdentifier()->getText(), width);
         }
         void exitTypeDefStruct(MinispecParser::TypeDefStructContext* ctx) override {
             setValue(ctx->children.back() /*;*/, " deriving(Bits, Eq, FShow);");
+            std::vector<DesignLayout::Port> members;
+            for (auto m : ctx->structMember())
+                members.push_back({m->lowerCaseIdentifier()->getText(), layoutType(m->type())});
+            designLayout.addStruct(layoutName(ctx->typeId()), members);
+        }
+        void exitTypeDefSynonym(MinispecParser::TypeDefSynonymContext* ctx) override {
+            designLayout.addSynonym(layoutName(ctx->typeId()), layoutType(ctx->type()));
         }
 
         // Imports
@@ -1776,8 +2086,84 @@ class Elaborator : public MinispecBaseListener {
             setValue(ctx->EOF(), Skip());
         }
 
-        Elaborator(IntegerContext* integerContext, ParametricsMap* parametrics, const std::unordered_set<std::string>* localTypeNames, ParametricUsePtr topLevelParametric) :
-            ic(*integerContext), parametrics(*parametrics), localTypeNames(*localTypeNames), topLevelParametric(topLevelParametric) {}
+        Elaborator(IntegerContext* integerContext, ParametricsMap* parametrics, const std::unordered_set<std::string>* localTypeNames,
+                const std::unordered_map<std::string, MinispecParser::FunctionDefContext*>* packageFunctions,
+                const std::vector<ParametricUsePtr>& topLevelParametrics, const TranslateOptions& options) :
+            ic(*integerContext), parametrics(*parametrics), localTypeNames(*localTypeNames), topLevelParametrics(topLevelParametrics),
+            synthesizeTopLevels(options.perPackage), autoSynthesize(options.autoSynthesize),
+            autoSynthesizeThreshold(options.autoSynthesizeThreshold), noinlineThreshold(options.noinlineThreshold),
+            packageFunctions(*packageFunctions) {}
+
+        // Returns the (placeholder, replacement) pairs that turn automatic
+        // synthesize boundaries on or off, based on the policy, on how many
+        // times each module is instantiated in the design hierarchy, and on
+        // how much code bsc would elaborate for all of its inlined instances
+        std::vector<std::tuple<std::string, std::string>> getAutoSynthesizePatches() const {
+            // Modules not instantiated by others are roots (instantiated once)
+            std::unordered_map<std::string, std::vector<std::tuple<std::string, uint64_t>>> parents;
+            for (auto& [mod, submodules] : moduleHierarchy)
+                for (auto& [submod, count] : submodules) parents[submod].push_back({mod, count});
+            std::unordered_map<std::string, uint64_t> instances;
+            std::function<uint64_t(const std::string&)> getInstances = [&](const std::string& mod) -> uint64_t {
+                auto it = instances.find(mod);
+                if (it != instances.end()) return it->second;
+                instances[mod] = 0;  // guards against cycles, which bsc rejects anyway
+                uint64_t res = parents.count(mod)? 0 : 1;
+                if (parents.count(mod))
+                    for (auto& [parent, count] : parents.at(mod))
+                        res = std::min(res + getInstances(parent) * count, (uint64_t) 1ul << 40);
+                instances[mod] = res;
+                return res;
+            };
+
+            // Code of each module and of the submodules inlined into it
+            const uint64_t maxSize = 1ul << 40;
+            std::unordered_map<std::string, uint64_t> inlinedSizes;
+            std::function<uint64_t(const std::string&)> getInlinedSize = [&](const std::string& mod) -> uint64_t {
+                auto it = inlinedSizes.find(mod);
+                if (it != inlinedSizes.end()) return it->second;
+                inlinedSizes[mod] = 0;  // guards against cycles
+                uint64_t res = moduleSizes.count(mod)? moduleSizes.at(mod) : 0;
+                if (moduleHierarchy.count(mod)) {
+                    for (auto& [submod, count] : moduleHierarchy.at(mod)) {
+                        uint64_t size = getInlinedSize(submod);
+                        res = (count && size > maxSize / count)? maxSize : std::min(res + size * count, maxSize);
+                    }
+                }
+                inlinedSizes[mod] = res;
+                return res;
+            };
+
+            std::vector<std::tuple<std::string, std::string>> res;
+            for (auto& [mod, placeholder, portTypes] : autoSynthCandidates) {
+                uint64_t instances = getInstances(mod);
+                bool synthesize = areBitsTypes(portTypes) && (autoSynthesize == AUTOSYNTH_ALL ||
+                        (instances > 1 && reachesThreshold(instances, getInlinedSize(mod), autoSynthesizeThreshold)));
+                std::string replacement = synthesize? "(* synthesize *)" : "";
+                replacement.resize(placeholder.size(), ' ');
+                res.push_back({placeholder, replacement});
+                if (synthesize) elabStats.autoSynthesized++;
+            }
+            return res;
+        }
+
+        // Returns the (placeholder, replacement) pairs that add or drop
+        // automatic noinline attributes. Inlining a function called from a
+        // single place saves nothing, so those are never noinlined.
+        std::vector<std::tuple<std::string, std::string>> getNoinlinePatches() const {
+            std::vector<std::tuple<std::string, std::string>> res;
+            for (auto& [fcn, size, placeholder, types] : noinlineCandidates) {
+                auto it = callSites.find(fcn);
+                uint64_t calls = (it == callSites.end())? 0 : it->second;
+                bool noinline = calls > 1 && reachesThreshold(calls, size, noinlineThreshold) && areBitsTypes(types);
+                std::string replacement = noinline? "(* noinline *)" : "";
+                replacement.resize(placeholder.size(), ' ');
+                res.push_back({placeholder, replacement});
+                if (noinline) elabStats.autoNoinlined++;
+            }
+            return res;
+        }
+
 
         bool isParametricEmitted(const ParametricUse& p) const { return parametricsEmitted.count(p); }
 };
@@ -1820,7 +2206,6 @@ static ParametricUsePtr createTopLevelParametricUsePtr(const std::string& name,
 }
 
 static ParametricUsePtr validateTopLevel(const std::string& topLevel) {
-    if (topLevel == "") return nullptr;
     std::string errHdr = "invalid top-level argument " +
         errorColored("'" + topLevel + "'") + ": ";
     try {
@@ -1848,52 +2233,141 @@ std::string getPrelude() {
     return prelude.str();
 }
 
-SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::string& topLevel) {
-    // Initial validation of topLevel arg
-    auto topLevelParametric = validateTopLevel(topLevel);
+SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::vector<std::string>& topLevels, const TranslateOptions& options) {
+    bool perPackage = options.perPackage;
+    designLayout.clear();
+    // Initial validation of topLevel args
+    std::vector<ParametricUsePtr> topLevelParametrics;
+    for (auto& topLevel : topLevels) topLevelParametrics.push_back(validateTopLevel(topLevel));
 
     // Do an initial pass to capture all type and module names. This advance visibility
     // is needed because we need to know whether a parametric type use maps to
     // a Minispec type or to a Bluespec type (it changes the emitted code)
     std::unordered_set<std::string> localTypeNames;
-    for (auto tree : parsedTrees) {
-        for (auto stmt : tree->packageStmt()) {
-            if (stmt->moduleDef()) {
-                localTypeNames.insert(stmt->moduleDef()->moduleId()->name->getText());
+    std::unordered_map<std::string, size_t> typeNameToTree;  // for per-package output
+    std::unordered_map<std::string, MinispecParser::FunctionDefContext*> packageFunctions;
+    for (size_t t = 0; t < parsedTrees.size(); t++) {
+        for (auto stmt : parsedTrees[t]->packageStmt()) {
+            std::string name;
+            if (stmt->functionDef()) {
+                packageFunctions[stmt->functionDef()->functionId()->name->getText()] = stmt->functionDef();
+            } else if (stmt->moduleDef()) {
+                name = stmt->moduleDef()->moduleId()->name->getText();
             } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefSynonym()) {
                 auto typeId = stmt->typeDecl()->typeDefSynonym()->typeId();
-                localTypeNames.insert(typeId->name->getText());
+                name = typeId->name->getText();
             } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefEnum()) {
-                localTypeNames.insert(stmt->typeDecl()->typeDefEnum()->upperCaseIdentifier()->getText());
+                name = stmt->typeDecl()->typeDefEnum()->upperCaseIdentifier()->getText();
             } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefStruct()) {
                 auto typeId = stmt->typeDecl()->typeDefStruct()->typeId();
-                localTypeNames.insert(typeId->name->getText());
+                name = typeId->name->getText();
             }
+            if (name.empty()) continue;
+            localTypeNames.insert(name);
+            typeNameToTree[name] = t;
         }
     }
 
     ParametricsMap parametrics;
     IntegerContext integerContext;
-    Elaborator elab(&integerContext, &parametrics, &localTypeNames, topLevelParametric);
-    TranslatedCode tc([&elab](tree::ParseTree* ctx) { return elab.getValue(ctx); });
+    Elaborator elab(&integerContext, &parametrics, &localTypeNames, &packageFunctions, topLevelParametrics, options);
+    auto getValue = [&elab](tree::ParseTree* ctx) { return elab.getValue(ctx); };
+
+    // Output packages. By default, all code goes to a single package. With
+    // perPackage, package 0 has the prelude, package t+1 has parsedTrees[t]
+    // and the parametric instances it owns, and the last package (Translated)
+    // has the top-level wrappers. Each package imports all earlier packages,
+    // as Minispec files see all the definitions of earlier files.
+    std::vector<TranslatedCodePtr> pkgs;
+    std::vector<std::string> pkgNames;
+    if (perPackage) {
+        std::unordered_set<std::string> usedNames;
+        auto addPkg = [&](std::string name) {
+            for (char& c : name) if (!isalnum(c) && c != '_') c = '_';
+            std::string uniqueName = name;
+            for (uint32_t i = 1; usedNames.count(uniqueName); i++) uniqueName = name + "_" + std::to_string(i);
+            usedNames.insert(uniqueName);
+            pkgNames.push_back(uniqueName);
+            pkgs.push_back(std::make_shared<TranslatedCode>(getValue));
+        };
+        addPkg("Translated__Prelude");
+        for (auto tree : parsedTrees) {
+            std::string fileName = tree->start->getTokenSource()->getSourceName();
+            addPkg("Translated_" + std::filesystem::path(fileName).stem().string());
+        }
+        addPkg("Translated");
+    } else {
+        pkgNames.push_back("Translated");
+        pkgs.push_back(std::make_shared<TranslatedCode>(getValue));
+    }
+    auto treePkg = [&](size_t t) -> size_t { return perPackage? t + 1 : 0; };
+    size_t topPkg = pkgs.size() - 1;
+
+    if (perPackage) {
+        // Emit imports. BSV imports are not re-exported, so each package also
+        // imports the BSV packages imported by earlier files (and the prelude).
+        std::vector<std::string> bsvImports = {"Vector"};  // see MinispecPrelude.bsv
+        for (size_t pkg = 1; pkg < pkgs.size(); pkg++) {
+            auto& tc = *pkgs[pkg];
+            tc.emitLine("// Produced by msc, version ", getVersion());
+            for (auto& bsvImport : bsvImports) tc.emitLine("import ", bsvImport, "::*;");
+            for (size_t p = 0; p < pkg; p++) tc.emitLine("import ", pkgNames[p], "::*;");
+            tc.emitLine();
+            if (pkg - 1 < parsedTrees.size()) {
+                for (auto stmt : parsedTrees[pkg - 1]->packageStmt())
+                    if (stmt->bsvImportDecl())
+                        for (auto id : stmt->bsvImportDecl()->upperCaseIdentifier())
+                            bsvImports.push_back(id->getText());
+            }
+        }
+    }
 
     // Emit all non-parametrics (or fully elaborated parametrics)
-    tc.emit(getPrelude());
-    for (auto tree : parsedTrees) {
-        elaboratorWalker.walk(&elab, tree);
-        tc.emit(tree);
+    pkgs[0]->emit(getPrelude());
+    for (size_t t = 0; t < parsedTrees.size(); t++) {
+        elaboratorWalker.walk(&elab, parsedTrees[t]);
+        auto& tc = *pkgs[treePkg(t)];
+        tc.emit(parsedTrees[t]);
         // Ensure there's a newline between files even if the emmitted file
         // doesn't end with a newline
         tc.emitLine();
     }
 
+    // With perPackage, parametric instances go in the last package among
+    // those of their definition and their type params, which sees them all
+    std::unordered_map<tree::ParseTree*, size_t> ctxToTree;
+    for (size_t t = 0; t < parsedTrees.size(); t++) ctxToTree[parsedTrees[t]] = t;
+    auto defPkg = [&](ParserRuleContext* ctx) -> size_t {
+        tree::ParseTree* t = ctx;
+        while (t->parent) t = t->parent;
+        auto it = ctxToTree.find(t);
+        return (it == ctxToTree.end())? 0 : treePkg(it->second);
+    };
+    std::function<size_t(const ParametricUse&)> paramsPkg = [&](const ParametricUse& p) -> size_t {
+        size_t res = 0;
+        for (auto& param : p.params) {
+            if (!param.is<ParametricUsePtr>()) continue;
+            auto& pu = *param.as<ParametricUsePtr>();
+            auto typeIt = typeNameToTree.find(pu.name);
+            if (typeIt != typeNameToTree.end()) res = std::max(res, treePkg(typeIt->second));
+            auto parIt = parametrics.find(pu.name);
+            if (parIt != parametrics.end())
+                for (auto ctx : parIt->second) res = std::max(res, defPkg(ctx));
+            res = std::max(res, paramsPkg(pu));
+        }
+        return res;
+    };
+
     // Emit parametrics
     uint64_t elabDepth = 0;
     while (true) {
         elabDepth++;
-        auto paramUses = tc.dequeueParametricUsesEmitted();
-        if (elabDepth == 1 && topLevelParametric && !topLevelParametric->params.empty()) {
-            paramUses.push_back(std::make_tuple(*topLevelParametric, nullptr));
+        std::vector<std::tuple<ParametricUse, tree::ParseTree*>> paramUses;
+        for (auto& pkg : pkgs)
+            for (auto& pui : pkg->dequeueParametricUsesEmitted()) paramUses.push_back(pui);
+        if (elabDepth == 1) {
+            for (auto tlp : topLevelParametrics)
+                if (!tlp->params.empty()) paramUses.push_back(std::make_tuple(*tlp, nullptr));
         }
         if (paramUses.empty()) break;  // no more parametrics
 
@@ -1963,17 +2437,20 @@ SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>&
                 std::string defStr = p.name + "#(" + paramFormalsSs.str() + ")";
 
                 bool ctxHasParamsErrs = false;
+                // Errors are rendered only if they're reported and not duplicates
                 auto paramsErr = [&](const std::string& msg) {
-                    std::stringstream ss;
-                    std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
-                    ss << hlColored(loc + ":") << " "
-                        << errorColored(" error:") << " cannot instantiate "
-                        << errorColored("'" + p.str(true) + "'")
-                        << " from parametric " << paramType << " "
-                        << hlColored(defStr) << " defined at "
-                        << hlColored(getLoc(ctx)) << ": " << msg << "\n";
-                    if (emitCtx) ss << contextStr(emitCtx);
-                    paramsErrs.push_back(std::bind(reportErr, ss.str(), "", emitCtx));
+                    std::string pStr = p.str(true);
+                    DiagKey key = {"", emitCtx, std::hash<void*>()(ctx) ^ std::hash<std::string>()(pStr + "\n" + msg)};
+                    auto render = [emitCtx = emitCtx, pStr, paramType = paramType, defStr, ctx = ctx, msg]() {
+                        Diagnostic diag;
+                        diag.loc = emitCtx? getDiagLoc(emitCtx) : DiagLoc{"command-line arg"};
+                        diag.message = "cannot instantiate " + errorColored("'" + pStr + "'") +
+                            " from parametric " + paramType + " " + hlColored(defStr) +
+                            " defined at " + hlColored(getLoc(ctx)) + ": " + msg;
+                        if (emitCtx) diag.context = contextLines(emitCtx);
+                        return diag;
+                    };
+                    paramsErrs.push_back([key, render, emitCtx = emitCtx]() { reportMsg(true, key, render, "", emitCtx); });
                     ctxHasParamsErrs = true;
                 };
 
@@ -2049,6 +2526,7 @@ SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>&
                     elab.clearValues(ctx);
                     elaboratorWalker.walk(&elab, ctx);
                     integerContext.exitLevel();
+                    auto& tc = *pkgs[std::max(defPkg(ctx), paramsPkg(p))];
                     tc.emitStart(ctx);
                     tc.emitLine();
                     tc.emitLine(ctx);
@@ -2062,46 +2540,65 @@ SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>&
             if (!ctxMatched) {
                 // Dump all errors, and summarize the failure to match any if > 1 parametric
                 if (ctxs.size() > 1) {
-                    std::stringstream ss;
-                    std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
-                    ss << hlColored(loc + ":") << " "
-                        << errorColored(" error:") << " cannot instantiate "
-                        << errorColored("'" + p.str(true) + "'")
-                        << " from any of " << ctxs.size() << " parametric definitions\n";
-                    if (emitCtx) ss << contextStr(emitCtx);
-                    reportErr(ss.str(), "", emitCtx);
+                    std::string pStr = p.str(true);
+                    auto render = [&]() {
+                        Diagnostic diag;
+                        diag.loc = emitCtx? getDiagLoc(emitCtx) : DiagLoc{"command-line arg"};
+                        diag.message = "cannot instantiate " + errorColored("'" + pStr + "'") +
+                            " from any of " + std::to_string(ctxs.size()) + " parametric definitions";
+                        if (emitCtx) diag.context = contextLines(emitCtx);
+                        return diag;
+                    };
+                    reportMsg(true, {"", emitCtx, std::hash<std::string>()(pStr)}, render, "", emitCtx);
                 }
                 for (auto err : paramsErrs) err();
             }
         }
     }
 
-    std::string topModule = "";
-    if (topLevelParametric) topModule = "mk" + topLevelParametric->str();
+    std::vector<std::string> topModules;
+    for (size_t i = 0; i < topLevelParametrics.size(); i++) {
+        auto tlp = topLevelParametrics[i];
+        if (tlp->params.empty()) {
+            topModules.push_back("mk" + tlp->str());
+            continue;
+        }
 
-    // Top-level parametric modules with names containing #() break both bsc
-    // -sim (the generated C++ files have the unescaped raw name all over) and
-    // produce invalid Verilog output. So produce a wrapper module.
-    if (topLevelParametric && !topLevelParametric->params.empty()) {
-        if (!elab.isParametricEmitted(*topLevelParametric)) {
-            std::string msg = errorColored("error:") + " cannot find top-level parametric " +
-                errorColored("'" + topLevelParametric->str() + "'");
-            reportErr(msg, "", nullptr);
+        // Top-level parametric modules with names containing #() break both bsc
+        // -sim (the generated C++ files have the unescaped raw name all over) and
+        // produce invalid Verilog output. So produce a wrapper module.
+        if (!elab.isParametricEmitted(*tlp)) {
+            Diagnostic diag;
+            diag.message = "cannot find top-level parametric " + errorColored("'" + tlp->str() + "'");
+            reportErr(diag);
         }
 
-        ParametricUse ifcPu = *topLevelParametric;
+        ParametricUse ifcPu = *tlp;
         if (!isupper(ifcPu.name[0])) {
             ifcPu.name[0] = toupper(ifcPu.name[0]);
             ifcPu.name += "___";
         }
+        // With a single top-level, keep the wrapper name stable for tools
+        std::string wrapperName = "mkTopLevel___";
+        if (topLevelParametrics.size() > 1) wrapperName += std::to_string(i);
+        auto& tc = *pkgs[topPkg];
         tc.emitLine("\n// Top-level wrapper module");
-        tc.emitLine("module mkTopLevel___( \\", ifcPu.str(), " );");
-        tc.emitLine("  \\", ifcPu.str(), " res <- \\mk", topLevelParametric->str(), " ;");
+        if (perPackage) tc.emitLine("(* synthesize *)");
+        tc.emitLine("module ", wrapperName, "( \\", ifcPu.str(), " );");
+        tc.emitLine("  \\", ifcPu.str(), " res <- \\mk", tlp->str(), " ;");
         tc.emitLine("  return res;");
         tc.emitLine("endmodule");
-        topModule = "mkTopLevel___";
+        designLayout.addWrapper(wrapperName, "mk" + tlp->str());
+        topModules.push_back(wrapperName);
     }
 
     exitIfErrors();
-    return tc.getSourceMap(topModule);
+    for (auto& [placeholder, replacement] : elab.getAutoSynthesizePatches())
+        for (auto& pkg : pkgs) pkg->patch(placeholder, replacement);
+    for (auto& [placeholder, replacement] : elab.getNoinlinePatches())
+        for (auto& pkg : pkgs) pkg->patch(placeholder, replacement);
+    SourceMap sm = pkgs[0]->getSourceMap(topModules, pkgNames[0] + ".bsv");
+    for (size_t pkg = 1; pkg < pkgs.size(); pkg++)
+        sm.append(pkgs[pkg]->getSourceMap({}, pkgNames[pkg] + ".bsv"));
+    return sm;
 }
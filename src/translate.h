@@ -20,68 +20,94 @@
 #include <map>
 #include <sstream>
 #include "antlr4-runtime.h"
+#include "layout.h"
 #include "MinispecParser.h"
 
 // Stores the translated Bluespec source as well as the map to the Minispec
-// source syntax elements that produced each piece of Bluespec code
+// source syntax elements that produced each piece of Bluespec code. The
+// translated source may span multiple Bluespec files (one per package).
 class SourceMap {
     private:
         typedef std::tuple<ssize_t, ssize_t> Range;
-        const std::map<Range, antlr4::tree::ParseTree*> dstToSrc;
-        const std::map<Range, std::string> dstToInfo;
-        const std::string code;
-        const std::string topModule;
-        std::vector<size_t> lineToPos;
+        struct File {
+            std::string name;
+            std::map<Range, antlr4::tree::ParseTree*> dstToSrc;
+            std::map<Range, std::string> dstToInfo;
+            std::string code;
+            std::vector<size_t> lineToPos;
+        };
+        std::vector<File> files;
+        std::vector<std::string> topModules;
 
-        SourceMap(const std::map<Range, antlr4::tree::ParseTree*>& dstToSrc,
+        SourceMap(const std::string& fileName,
+                  const std::map<Range, antlr4::tree::ParseTree*>& dstToSrc,
                   const std::map<Range, std::string>& dstToInfo,
-                  const std::string& code, const std::string& topModule) :
-            dstToSrc(dstToSrc), dstToInfo(dstToInfo), code(code), topModule(topModule)
+                  const std::string& code, const std::vector<std::string>& topModules) :
+            topModules(topModules)
         {
-            lineToPos.push_back(0);
+            files.push_back({fileName, dstToSrc, dstToInfo, code, {0}});
+            auto& lineToPos = files.back().lineToPos;
             for (size_t p = 0; p < code.size(); p++) {
                 if (code[p] == '\n') lineToPos.push_back(p + 1);
             }
         }
 
-        size_t getPos(size_t line, size_t lineChar) const {
-            assert(line <= lineToPos.size());
+        const File* getFile(const std::string& fileName) const {
+            for (auto& f : files) if (f.name == fileName) return &f;
+            return nullptr;
+        }
+
+        static size_t getPos(const File& f, size_t line, size_t lineChar) {
+            assert(line <= f.lineToPos.size());
             assert(line > 0);
             assert(lineChar > 0);
-            return lineToPos[line - 1] + (lineChar - 1);
+            return f.lineToPos[line - 1] + (lineChar - 1);
         }
 
         friend class TranslatedCode;  // for private constructor
 
     public:
+        // Adds the files of another SourceMap (keeps this one's top modules)
+        void append(SourceMap&& other) {
+            for (auto& f : other.files) files.push_back(std::move(f));
+        }
+
+        bool hasFile(const std::string& fileName) const { return getFile(fileName); }
+
         // Find source element for this output position
-	antlr4::tree::ParseTree* find(size_t line, size_t lineChar) const {
-            size_t pos = getPos(line, lineChar);
+	antlr4::tree::ParseTree* find(const std::string& fileName, size_t line, size_t lineChar) const {
+            auto f = getFile(fileName);
+            if (!f) return nullptr;
+            size_t pos = getPos(*f, line, lineChar);
             Range range = std::make_tuple(pos, pos);
-            auto it = dstToSrc.lower_bound(range);
-            if (it == dstToSrc.end()) return nullptr;
+            auto it = f->dstToSrc.lower_bound(range);
+            if (it == f->dstToSrc.end()) return nullptr;
             auto [foundStart, foundEnd] = it->first;
             if (foundStart != (ssize_t)pos) return nullptr;
             return it->second;
         }
 
         // Find exact source element match for output text
-	antlr4::tree::ParseTree* find(size_t line, size_t lineChar, std::string_view sv) const {
-            size_t pos = getPos(line, lineChar);
+	antlr4::tree::ParseTree* find(const std::string& fileName, size_t line, size_t lineChar, std::string_view sv) const {
+            auto f = getFile(fileName);
+            if (!f) return nullptr;
+            size_t pos = getPos(*f, line, lineChar);
             Range range = std::make_tuple(pos, pos + sv.size());
-            auto it = dstToSrc.find(range);
-            if (it == dstToSrc.end()) return nullptr;
-            if (getCode().substr(pos, sv.size()) != sv) return nullptr;
+            auto it = f->dstToSrc.find(range);
+            if (it == f->dstToSrc.end()) return nullptr;
+            if (f->code.substr(pos, sv.size()) != sv) return nullptr;
             return it->second;
         }
 
-        std::string getContextInfo(size_t line, size_t lineChar) const {
+        std::string getContextInfo(const std::string& fileName, size_t line, size_t lineChar) const {
             // Include all context info, outside-in.
             // NOTE: There are faster implementation, but this one is simple
             // and fast enough (used only on errors, few infos, etc.)
-            size_t pos = getPos(line, lineChar);
+            auto f = getFile(fileName);
+            if (!f) return "";
+            size_t pos = getPos(*f, line, lineChar);
             std::stringstream ss;
-            for (auto& [range, info] : dstToInfo) {
+            for (auto& [range, info] : f->dstToInfo) {
                 auto& [start, end] = range;
                 if (start <= (ssize_t)pos && end >= (ssize_t)pos) {
                     ss << "In " << info << "\n";
@@ -91,10 +117,50 @@ class SourceMap {
             return ss.str();
         }
 
-        const std::string& getCode() const { return code; }
-        const std::string& getTopModule() const { return topModule; }
+        size_t getNumFiles() const { return files.size(); }
+        const std::string& getFileName(size_t i = 0) const { return files[i].name; }
+        const std::string& getCode(size_t i = 0) const { return files[i].code; }
+        // Bluespec module names for each top-level, in the order given to translateFiles()
+        const std::vector<std::string>& getTopModules() const { return topModules; }
 };
 
 void setElabLimits(uint64_t maxSteps, uint64_t maxDepth);
 
-SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::string& topLevel);
+struct ElabStats {
+    uint64_t elabSteps;
+    uint64_t parametricInstances;  // parametric functions, modules, and types elaborated
+    uint64_t loopIterations;       // for loop iterations unrolled
+    uint64_t autoSynthesized;      // modules given automatic synthesize boundaries
+    uint64_t autoNoinlined;        // functions given automatic noinline attributes
+};
+ElabStats getElabStats();
+
+// Layout of the types and modules of the last translated design
+const DesignLayout& getDesignLayout();
+
+// Which modules get (* synthesize *) boundaries automatically (besides
+// top-levels and modules with msc_pragma:synthesize): none, those
+// instantiated more than once in the design hierarchy, or all that can be
+// synthesized separately
+enum AutoSynthesizePolicy {AUTOSYNTH_OFF, AUTOSYNTH_REPEATED, AUTOSYNTH_ALL};
+
+struct TranslateOptions {
+    bool perPackage = false;  // see translateFiles()
+    AutoSynthesizePolicy autoSynthesize = AUTOSYNTH_OFF;
+    // With AUTOSYNTH_REPEATED, only synthesize modules when (instances *
+    // size of their Bluespec code and their inlined submodules', in bytes)
+    // reaches this threshold, as boundaries on small modules save bsc little
+    uint64_t autoSynthesizeThreshold = 0;
+    // Tag package-level functions (* noinline *) when they are called from
+    // more than one place and (call sites * size of their Bluespec code, in
+    // bytes) reaches this threshold. 0 disables automatic noinline.
+    uint64_t noinlineThreshold = 0;
+};
+
+// Translates the parsed files into Bluespec, including all top-level modules
+// and functions (which may be parametric). By default, produces a single
+// Bluespec file, Translated.bsv. With perPackage, produces one Bluespec
+// package per Minispec file (plus one for the prelude), so that bsc -u only
+// recompiles the packages that change; Translated.bsv then imports all of them
+// and holds the top-level wrappers.
+SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::vector<std::string>& topLevels, const TranslateOptions& options = TranslateOptions());
@@ -0,0 +1,102 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include "strutils.h"
+#include "subprocess.h"
+#include "vsim.h"
+
+std::string getBscVerilogLibDir() {
+    // Ask bsc directly, so this works without $BLUESPECDIR and with symlinks
+    // (same as synth)
+    auto res = run("bsc -print-flags 2>&1");
+    if (res.exitCode != 0) return "";
+    size_t pos = res.output.find("  -i ");
+    if (pos == std::string::npos) return "";
+    pos += 5;
+    std::string libDir = trim(res.output.substr(pos, res.output.find('\n', pos) - pos));
+    libDir = (std::filesystem::path(libDir) / "Verilog").string();
+    return std::filesystem::is_directory(libDir)? libDir : "";
+}
+
+std::vector<std::string> getVsimLibFiles(const std::string& vdir, const std::string& libDir) {
+    std::set<std::string> files;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(vdir, ec)) {
+        if (entry.path().extension() != ".use") continue;
+        std::ifstream ifs(entry.path());
+        for (std::string mod; std::getline(ifs, mod); ) {
+            mod = trim(mod);
+            if (mod.empty()) continue;
+            std::string file = libDir + "/" + mod + ".v";
+            if (std::filesystem::exists(file)) files.insert(file);
+        }
+    }
+    return std::vector<std::string>(files.begin(), files.end());
+}
+
+std::string getVsimHarness(const std::string& topModule) {
+    // Bluesim-compatible flags: -m <cycles> stops after that many cycles.
+    // --stats reports simulated cycles and cycles per second on stderr.
+    std::string harness = R"(// Produced by msc: Verilator harness for $TOP
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include "verilated.h"
+#include "V$TOP.h"
+
+int main(int argc, char** argv) {
+    uint64_t maxCycles = 0;
+    bool stats = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-m") && i + 1 < argc) maxCycles = strtoull(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--stats")) stats = true;
+    }
+    Verilated::commandArgs(argc, argv);
+    auto top = std::make_unique<V$TOP>();
+
+    // Like Bluesim, hold reset during the first cycle
+    auto start = std::chrono::steady_clock::now();
+    uint64_t cycle = 0;
+    top->CLK = 0;
+    top->RST_N = 0;
+    top->eval();
+    while (!Verilated::gotFinish() && (!maxCycles || cycle < maxCycles)) {
+        top->CLK = 1;
+        top->eval();
+        if (cycle == 0) top->RST_N = 1;
+        top->CLK = 0;
+        top->eval();
+        cycle++;
+    }
+    top->final();
+
+    if (stats) {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "%lu cycles in %.3f s (%.0f cycles/s)\n", (unsigned long) cycle, secs, cycle / secs);
+    }
+    return 0;
+}
+)";
+    replace(harness, "$TOP", topModule);
+    return harness;
+}
@@ -0,0 +1,36 @@
+/** $lic$
+ * Copyright (C) 2019-2024 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Verilator simulation (msc -o vsim) helpers
+
+// Returns the directory with the Verilog of Bluespec's library modules
+// (e.g., FIFO2.v), or an empty string if bsc can't be run or doesn't have it
+std::string getBscVerilogLibDir();
+
+// Returns the library Verilog files used by the modules compiled to vdir,
+// as listed in the .use files produced by bsc -show-module-use
+std::vector<std::string> getVsimLibFiles(const std::string& vdir, const std::string& libDir);
+
+// Returns the C++ harness that drives topModule's clock and reset like a
+// Bluesim executable does
+std::string getVsimHarness(const std::string& topModule);